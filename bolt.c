@@ -33,18 +33,52 @@
 #include "connection.h"
 #include "worker.h"
 #include "config.h"
+#include "cache.h"
 #include "utils.h"
+#include "numa.h"
+#include "slab.h"
+
+#if defined(BOLT_HAVE_EVENTFD)
+#include <sys/eventfd.h>
+#endif
 
 bolt_setting_t *setting, _setting = {
     .host = "0.0.0.0",
     .port = 80,
+    .threads = 1,
     .workers = 10,
     .logfile = NULL,
     .logmark = BOLT_LOG_ERROR,
     .daemon = 0,
     .max_cache = BOLT_MIN_CACHE_SIZE,
     .gc_threshold = 80,
+    .cache_shards = 16,
     .nocache = 0,
+    .sendfile_size = 0,
+    .schedule = BOLT_SCHEDULE_FIFO,
+    .cache_policy = BOLT_CACHE_POLICY_LRU,
+    .max_tasks = 0,
+    .worker_queue = 1024,
+    .max_waiters = 0,
+    .max_cost = 0,
+    .retry_after = 1,
+    .stream_pixels = 0,
+    .orphan_task = BOLT_ORPHAN_DROP,
+    .task_timeout = 0,
+    .decode_cache = 0,
+    .decode_cache_life = 10,
+    .native_formats = 0,
+    .cpu_budget = 0,
+    .magick_memory = 0,
+    .magick_map = 0,
+    .magick_area = 0,
+    .reactor_cpus_num = 0,
+    .worker_cpus_num = 0,
+    .numa = 0,
+    .slab = 0,
+    .huge_pages = 0,
+    .status_url = NULL,
+    .status_len = 0,
     .path = NULL,
     .path_len = 0,
     .watermark = NULL,
@@ -56,6 +90,7 @@ bolt_service_t *service, _service;
 void
 bolt_accept_handler(int sock, short event, void *arg)
 {
+    bolt_reactor_t *r = (bolt_reactor_t *)arg;
     struct sockaddr_in addr;
     socklen_t size = sizeof(addr);
     int nsock;
@@ -74,7 +109,7 @@ bolt_accept_handler(int sock, short event, void *arg)
             return;
         }
 
-        if (bolt_create_connection(nsock) == NULL) {
+        if (bolt_create_connection(r, nsock) == NULL) {
             bolt_log(BOLT_LOG_ERROR,
                      "Failed to create connection object, socket(%d)", nsock);
         }
@@ -84,45 +119,40 @@ bolt_accept_handler(int sock, short event, void *arg)
 void
 bolt_wakeup_handler(int sock, short event, void *arg)
 {
-    char byte;
-    struct list_head *e;
-    bolt_wait_queue_t *waitq;
-    bolt_connection_t *c;
-
-    if (sock != service->wakeup_notify[0]) {
+    bolt_reactor_t *r = (bolt_reactor_t *)arg;
+    bolt_connection_t *list, *c, *next, *prev = NULL;
+#if defined(BOLT_HAVE_EVENTFD)
+    uint64_t count;
+#else
+    char buf[64];
+#endif
+
+    if (sock != r->wakeup_notify[0]) {
         bolt_log(BOLT_LOG_ERROR, "Wakeup handler called by exception");
         return;
     }
 
-    for (;;) {
-
-        if (read(sock, (char *)&byte, 1) != 1) {
-            return;
-        }
-
-again:
-        waitq = NULL;
-
-        LOCK_WAKEUP();
-
-        e = service->wakeup_queue.next;
-        if (e != &service->wakeup_queue) {
-            waitq = list_entry(e, bolt_wait_queue_t, link);
-            list_del(e);
-        }
-
-        UNLOCK_WAKEUP();
-
-        if (waitq) {
-            list_for_each(e, &waitq->wait_conns) {
-                c = list_entry(e, bolt_connection_t, link);
-                bolt_connection_begin_send(c);
-            }
-
-            free(waitq);
+    /* Reset notify before take the stack, workers would notify */
+    /* again when they push to the empty stack */
+#if defined(BOLT_HAVE_EVENTFD)
+    read(sock, &count, sizeof(count));
+#else
+    while (read(sock, buf, sizeof(buf)) > 0);
+#endif
+
+    list = __sync_lock_test_and_set(&r->wakeup_stack, NULL);
+
+    /* Reverse the stack, send by completed order */
+    for (c = list; c; c = next) {
+        next = c->wakeup_next;
+        c->wakeup_next = prev;
+        prev = c;
+    }
 
-            goto again;
-        }
+    for (c = prev; c; c = next) {
+        next = c->wakeup_next;
+        c->wakeup_next = NULL;
+        bolt_connection_wakeup(c);
     }
 }
 
@@ -139,112 +169,203 @@ bolt_clock_handler(int sock, short event, void *arg)
     }
 
     evtimer_set(&service->clock_event, bolt_clock_handler, 0);
-    event_base_set(service->ebase, &service->clock_event);
+    event_base_set(service->reactors[0].ebase, &service->clock_event);
     evtimer_add(&service->clock_event, &tv);
 
     /* Update current time */
     service->current_time = time(NULL);
 
+    /* Evict the caches were expired by cache-life */
+    bolt_cache_expire(service->current_time);
+
+    service->memory_usage = bolt_cache_memory_usage();
+
     if (service->memory_usage >= setting->max_cache) {
         write(service->gc_notify[1], "\0", 1); /* Notify GC thread */
     }
 }
 
-int bolt_init_service()
+int bolt_init_reactor(bolt_reactor_t *r, int id)
 {
-    /* Init cache lock and task lock */
-    if (pthread_mutex_init(&service->cache_lock, NULL) == -1
-        || pthread_mutex_init(&service->task_lock, NULL) == -1
-        || pthread_mutex_init(&service->waitq_lock, NULL) == -1
-        || pthread_mutex_init(&service->wakeup_lock, NULL) == -1)
-    {
-        bolt_log(BOLT_LOG_ERROR,
-                 "Failed to initialize service's locks");
-        return -1;
-    }
+    r->id = id;
+    r->wakeup_stack = NULL;
 
-    /* Init task condition */
-    if (pthread_cond_init(&service->task_cond, NULL) == -1) {
-        bolt_log(BOLT_LOG_ERROR,
-                 "Failed to initialize task's condition");
-        return -1;
+    if (setting->reactor_cpus_num > 0) {
+        r->cpu = setting->reactor_cpus[id % setting->reactor_cpus_num];
+        r->node = bolt_numa_node_of_cpu(r->cpu);
+    } else {
+        r->cpu = -1;
+        r->node = -1;
     }
 
-    /* Create cache HashTable and waiting HashTable */
-    if ((service->cache_htb = jk_hash_new(0, NULL, NULL)) == NULL
-        || (service->waiting_htb = jk_hash_new(0, NULL, NULL)) == NULL)
-    {
-        bolt_log(BOLT_LOG_ERROR,
-                 "Failed to create cache and waiting HashTables");
-        return -1;
+    /* Create listen socket, every reactor owns one by SO_REUSEPORT */
+#if defined(SO_REUSEPORT)
+    r->sock = bolt_listen_socket(setting->host, setting->port, 1,
+                                 service->reactors_num > 1);
+#else
+    if (id > 0) {
+        r->sock = service->reactors[0].sock;
+    } else {
+        r->sock = bolt_listen_socket(setting->host, setting->port, 1, 0);
     }
-
-    INIT_LIST_HEAD(&service->gc_lru);
-    INIT_LIST_HEAD(&service->task_queue);
-    INIT_LIST_HEAD(&service->wakeup_queue);
-
-    /* Create listen socket */
-    service->sock = bolt_listen_socket(setting->host, setting->port, 1);
-    if (service->sock == -1) {
+#endif
+    if (r->sock == -1) {
         bolt_log(BOLT_LOG_ERROR,
                  "Failed to create listen socket");
         return -1;
     }
 
     /* Init wakeup context */
-    if (pipe(service->wakeup_notify) == -1
-        || bolt_set_nonblock(service->wakeup_notify[0]) == -1)
-    {
+#if defined(BOLT_HAVE_EVENTFD)
+    r->wakeup_notify[0] = eventfd(0, EFD_NONBLOCK);
+    r->wakeup_notify[1] = r->wakeup_notify[0];
+
+    if (r->wakeup_notify[0] == -1) {
         bolt_log(BOLT_LOG_ERROR,
-                 "Failed to create wakeup notify pipe");
+                 "Failed to create wakeup notify eventfd");
         return -1;
     }
-
-    if (pipe(service->gc_notify) == -1
-        || bolt_set_nonblock(service->gc_notify[1]) == -1)
+#else
+    if (pipe(r->wakeup_notify) == -1
+        || bolt_set_nonblock(r->wakeup_notify[0]) == -1)
     {
         bolt_log(BOLT_LOG_ERROR,
-                 "Failed to create GC notify pipe");
+                 "Failed to create wakeup notify pipe");
         return -1;
     }
+#endif
 
-    service->ebase = event_base_new();
-    if (service->ebase == NULL) {
+    r->ebase = event_base_new();
+    if (r->ebase == NULL) {
         bolt_log(BOLT_LOG_ERROR,
                  "Failed to create event base object");
         return -1;
     }
 
     /* Add listen socket to libevent */
-    event_set(&service->event, service->sock,
-              EV_READ|EV_PERSIST, bolt_accept_handler, NULL);
+    event_set(&r->event, r->sock,
+              EV_READ|EV_PERSIST, bolt_accept_handler, r);
 
-    event_base_set(service->ebase, &service->event);
+    event_base_set(r->ebase, &r->event);
 
-    if (event_add(&service->event, NULL) == -1) {
+    if (event_add(&r->event, NULL) == -1) {
         bolt_log(BOLT_LOG_ERROR,
                  "Failed to add accept event to libevent");
         return -1;
     }
 
     /* Add wakeup notify fd to libevent */
-    event_set(&service->wakeup_event, service->wakeup_notify[0],
-              EV_READ|EV_PERSIST, bolt_wakeup_handler, NULL);
+    event_set(&r->wakeup_event, r->wakeup_notify[0],
+              EV_READ|EV_PERSIST, bolt_wakeup_handler, r);
 
-    event_base_set(service->ebase, &service->wakeup_event);
+    event_base_set(r->ebase, &r->wakeup_event);
 
-    if (event_add(&service->wakeup_event, NULL) == -1) {
+    if (event_add(&r->wakeup_event, NULL) == -1) {
         bolt_log(BOLT_LOG_ERROR,
                  "Failed to add wakeup event to libevent");
         return -1;
     }
 
+    return 0;
+}
+
+void *
+bolt_reactor_thread(void *arg)
+{
+    bolt_reactor_t *r = (bolt_reactor_t *)arg;
+
+    event_base_dispatch(r->ebase);
+
+    return NULL;
+}
+
+int bolt_init_service()
+{
+    int i;
+
+    /* Init wait queue lock */
+    if (pthread_mutex_init(&service->waitq_lock, NULL) == -1) {
+        bolt_log(BOLT_LOG_ERROR,
+                 "Failed to initialize service's locks");
+        return -1;
+    }
+
+    bolt_numa_init();
+
+    /* Size classes of cache and connection slabs */
+    bolt_init_slab_classes();
+
+    /* Create cache shards and waiting HashTable */
+    if (bolt_init_cache(setting->cache_shards) == -1) {
+        return -1;
+    }
+
+    if ((service->waiting_htb = jk_hash_new(0, NULL, NULL)) == NULL) {
+        bolt_log(BOLT_LOG_ERROR,
+                 "Failed to create waiting HashTable");
+        return -1;
+    }
+
+    if (pipe(service->gc_notify) == -1
+        || bolt_set_nonblock(service->gc_notify[1]) == -1)
+    {
+        bolt_log(BOLT_LOG_ERROR,
+                 "Failed to create GC notify pipe");
+        return -1;
+    }
+
+    /* Create I/O threads context */
+    service->reactors_num = setting->threads;
+    service->reactors = calloc(service->reactors_num,
+                               sizeof(bolt_reactor_t));
+    if (service->reactors == NULL) {
+        bolt_log(BOLT_LOG_ERROR,
+                 "Not enough memory to alloc reactors");
+        return -1;
+    }
+
+    for (i = 0; i < service->reactors_num; i++) {
+        if (bolt_init_reactor(&service->reactors[i], i) == -1) {
+            return -1;
+        }
+    }
+
     service->connections = 0;
     service->memory_usage = 0;
 
     return 0;
 }
 
+int bolt_start_reactors()
+{
+    bolt_reactor_t *r;
+    int i;
+
+    /* The first reactor was run by main thread */
+    service->reactors[0].tid = pthread_self();
+
+    for (i = 1; i < service->reactors_num; i++) {
+
+        r = &service->reactors[i];
+
+        if (pthread_create(&r->tid, NULL, bolt_reactor_thread, r) != 0) {
+            bolt_log(BOLT_LOG_ERROR, "Failed to create I/O thread");
+            return -1;
+        }
+    }
+
+    for (i = 0; i < service->reactors_num; i++) {
+
+        r = &service->reactors[i];
+
+        if (r->cpu >= 0) {
+            bolt_set_affinity(r->tid, r->cpu);
+        }
+    }
+
+    return 0;
+}
+
 void bolt_usage()
 {
     fprintf(stderr, "                                         \n"
@@ -311,13 +432,14 @@ int main(int argc, char *argv[])
     if (bolt_init_log(setting->logfile, setting->logmark) == -1
         || bolt_init_service() == -1
         || bolt_init_connections() == -1
-        || bolt_init_workers(setting->workers) == -1)
+        || bolt_init_workers(setting->workers) == -1
+        || bolt_start_reactors() == -1)
     {
         exit(1);
     }
 
     bolt_clock_handler(0, 0, 0);
-    event_base_dispatch(service->ebase); /* Being run */
+    event_base_dispatch(service->reactors[0].ebase); /* Being run */
 
     bolt_destroy_log();
 
@@ -13,6 +13,17 @@
 #define  BOLT_FILENAME_LENGTH  1024
 #define  BOLT_RBUF_SIZE        2048
 #define  BOLT_WBUF_SIZE        512
+#define  BOLT_MAX_REACTORS     64
+#define  BOLT_MAX_CACHE_SHARDS 1024
+#define  BOLT_MAX_DECODE_CACHE 1024
+#define  BOLT_MAX_CPUS         256
+#define  BOLT_MAX_NUMA_NODES   64
+#define  BOLT_SLAB_PAGE_SIZE   (2 * 1024 * 1024)  /* Same as huge page */
+#define  BOLT_SLAB_CLASSES     64
+#define  BOLT_WHEEL_LEVELS     4
+#define  BOLT_WHEEL_BITS       6   /* 64 slots every level */
+#define  BOLT_WHEEL_SLOTS      (1 << BOLT_WHEEL_BITS)
+#define  BOLT_EXPIRE_PER_TICK  1024  /* Expiring work of every clock tick */
 
 #define  BOLT_LF    '\n'
 #define  BOLT_CR    '\r'
@@ -27,18 +38,45 @@
 #define  BOLT_PARSE_FIELD_START              0
 #define  BOLT_PARSE_FIELD_IF_MODIFIED_SINCE  1
 
-#define  BOLT_SEND_HEADER_STATE    1
-#define  BOLT_SEND_CONTENT_STATE   2
-
 #define  BOLT_WATERMARK_PADDING    10
 
+#define  BOLT_NATIVE_JPEG  0x01  /* Native JPEG pipeline */
+#define  BOLT_NATIVE_WEBP  0x02  /* Native JPEG to WebP pipeline */
+
+#define  BOLT_SCHEDULE_FIFO         0
+#define  BOLT_SCHEDULE_WAITERS      1  /* More waiting clients first */
+#define  BOLT_SCHEDULE_SMALL_FIRST  2  /* Smaller output first */
+
+#define  BOLT_CACHE_POLICY_LRU      0
+#define  BOLT_CACHE_POLICY_TINYLFU  1  /* W-TinyLFU admission */
+#define  BOLT_CACHE_POLICY_GDSF     2  /* GreedyDual-Size-Frequency */
+
+#define  BOLT_ORPHAN_DROP  0  /* Drop task which no client waiting for */
+#define  BOLT_ORPHAN_FILL  1  /* Run it at last to fill the cache */
+
+#define  BOLT_STREAM_BLOCK     16384
+
+#define  BOLT_STREAM_WRITING  0
+#define  BOLT_STREAM_DONE     1
+#define  BOLT_STREAM_FAILED   2
+
+#define  BOLT_STREAM_SEND_NONE   0  /* Not streaming */
+#define  BOLT_STREAM_SEND_CHUNK  1  /* Sending data chunks */
+#define  BOLT_STREAM_SEND_LAST   2  /* Sending the last chunk */
+
 #define  BOLT_DATETIME_LENGTH  sizeof("Mon, 28 Sep 1970 06:00:00 GMT")
 
 #define  BOLT_VERSION  "V1.0"
 
+#if defined(__linux__)
+#define  BOLT_HAVE_SENDFILE  1
+#define  BOLT_HAVE_EVENTFD   1
+#endif
+
 typedef struct {
     char *host;
     short port;
+    int threads;       /* The number of I/O threads */
     int workers;
     char *logfile;
     int logmark;
@@ -46,7 +84,35 @@ typedef struct {
     int max_cache;     /* The max cache size */
     int gc_threshold;  /* The range 1 ~ 100 */
     int cache_life;
+    int cache_shards;  /* The number of cache shards */
     int nocache;
+    int sendfile_size; /* Send cache by sendfile() when bigger than it */
+    int schedule;      /* Tasks schedule policy */
+    int cache_policy;  /* Cache admission and eviction policy */
+    int max_tasks;     /* Max tasks queued and running, 0 is unlimited */
+    int worker_queue;  /* Max tasks queued by one worker, 0 is unlimited */
+    int max_waiters;   /* Max clients waiting for one image */
+    int max_cost;      /* Max pixels of images compressing */
+    int retry_after;   /* Seconds of Retry-After header when overload */
+    int stream_pixels; /* Stream output while encoding when bigger */
+    int orphan_task;   /* What to do with task all clients gone away */
+    int task_timeout;  /* Seconds of task queued at most, 0 is unlimited */
+    int decode_cache;  /* Max decoded source images were kept */
+    int decode_cache_life;
+    int native_formats;  /* Output formats by native pipeline */
+    int cpu_budget;      /* CPU threads for compressing, 0 is all CPUs */
+    int magick_memory;   /* ImageMagick resource limits, 0 is default */
+    int magick_map;
+    int magick_area;
+    int reactor_cpus[BOLT_MAX_CPUS];  /* Pin reactors to the CPUs by turns */
+    int reactor_cpus_num;
+    int worker_cpus[BOLT_MAX_CPUS];   /* Pin workers to the CPUs by turns */
+    int worker_cpus_num;
+    int numa;          /* Alloc cache on node of the reactor */
+    int slab;          /* Alloc cache by slab allocator */
+    int huge_pages;    /* Slab pages were huge pages */
+    char *status_url;
+    int status_len;
     char *path;
     int path_len;
     char *watermark;
@@ -54,28 +120,123 @@ typedef struct {
 } bolt_setting_t;
 
 typedef struct {
-    int sock;
+    struct list_head link;  /* Link partial pages of class */
+    int cls;
+    int used;               /* Items in use */
+    int total;
+    void *free;             /* Freed items */
+    char *next;             /* Items were never used begin here */
+    size_t touched;         /* Bytes were touched from page begin */
+} bolt_slab_page_t;
 
+typedef struct {
+    pthread_mutex_t lock;
+    struct list_head partial[BOLT_SLAB_CLASSES];  /* Pages have free items */
+    bolt_slab_page_t *spare;    /* An empty page kept for reusing */
+    long long mapped;           /* Bytes were mapped, atomic */
+    long long resident;         /* Bytes were touched, atomic */
+} bolt_slab_t;
+
+typedef struct {
+    int id;
+    pthread_t tid;
+    int cpu;           /* Pinned CPU, -1 is not pinned */
+    int node;          /* NUMA node of pinned CPU, -1 is unknown */
+
+    int sock;
     struct event_base *ebase;
     struct event event;
 
-    /* Image cache info */
-    pthread_mutex_t cache_lock;
-    jk_hash_t *cache_htb;
-    struct list_head gc_lru;
-    pthread_mutex_t waitq_lock;
-    jk_hash_t *waiting_htb;
+    /* Wakeup queue info, connections were pushed by workers without */
+    /* lock and taken all at once by reactor */
+    struct bolt_connection_s *wakeup_stack;
+    int wakeup_notify[2];   /* Both are the same eventfd if have eventfd */
+    struct event wakeup_event;
+
+    /* Connection objects and buffers, only used by the reactor */
+    bolt_slab_t slab;
+} bolt_reactor_t;
+
+/*
+ * Count-min sketch of access frequency, counters were saturated at 15
+ * and halved after sample additions, so old popularity fades away.
+ */
+typedef struct {
+    unsigned char *counters;
+    unsigned int mask;
+    unsigned int additions;
+    unsigned int sample;
+} bolt_sketch_t;
+
+/*
+ * Hierarchical timer wheel of cache expiring, the slots of level 0
+ * are seconds, every slot of level N covers all slots of level N-1.
+ * A slot of upper level was moved to cascade list when the lower
+ * level wrapped around, and placed down part by part.
+ */
+typedef struct {
+    struct list_head slots[BOLT_WHEEL_LEVELS][BOLT_WHEEL_SLOTS];
+    struct list_head cascade;
+    time_t now;             /* Next second to be expired */
+    int timers;
+} bolt_timer_wheel_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    jk_hash_t *htb;
+    struct list_head lru;   /* LRU, or probation segment of W-TinyLFU */
+    struct list_head window;     /* W-TinyLFU admission window */
+    struct list_head protected;  /* W-TinyLFU protected segment */
+    int window_size;
+    int protected_size;
+    bolt_sketch_t sketch;
+    struct bolt_cache_s **heap;  /* GDSF min-heap of priority */
+    int heap_size;
+    int heap_cap;
+    double inflation;       /* GDSF priority of the last evicted */
+    bolt_timer_wheel_t wheel;  /* Expiring by cache-life */
+    int memory_usage;
+    bolt_slab_t slab;       /* Cache memory arena of the shard */
+} bolt_cache_shard_t;
+
+typedef struct {
+    int id;
+    pthread_t tid;
+    int cpu;           /* Pinned CPU, -1 is not pinned */
+    int node;          /* NUMA node of pinned CPU, -1 is unknown */
 
     /* Task queue info */
     pthread_mutex_t task_lock;
     pthread_cond_t task_cond;
     struct list_head task_queue;
+    int task_nums;
+    int busy;
+    int idle;          /* Waiting on task_cond */
+} bolt_worker_t;
 
-    /* Wakeup queue info */
-    pthread_mutex_t wakeup_lock;
-    struct list_head wakeup_queue;
-    int wakeup_notify[2];
-    struct event wakeup_event;
+typedef struct {
+    uint64_t tasks;             /* Tasks were taken by workers */
+    uint64_t queue_wait_total;  /* usec */
+    uint64_t queue_wait_max;    /* usec */
+    uint64_t rejected;          /* Requests were rejected by overload */
+    uint64_t cancelled;         /* Tasks were dropped without waiters */
+    uint64_t expired;           /* Tasks were abandoned by task-timeout */
+} bolt_stats_t;
+
+typedef struct {
+    /* I/O threads info */
+    bolt_reactor_t *reactors;
+    int reactors_num;
+
+    /* Image cache info */
+    bolt_cache_shard_t *cache_shards;
+    int cache_shards_num;
+    pthread_mutex_t waitq_lock;
+    jk_hash_t *waiting_htb;
+
+    /* Worker threads info */
+    bolt_worker_t *workers;
+    int workers_num;
 
     int gc_notify[2];
 
@@ -84,81 +245,161 @@ typedef struct {
 
     int connections;
     int memory_usage;
-} bolt_service_t;
+    int node_memory[BOLT_MAX_NUMA_NODES];  /* Cache memory of every node */
 
-#define CACHE_FLAG_INUSED   0
-#define CACHE_FLAG_EXPIRED  1
+    /* Admission control */
+    int tasks_pending;          /* Tasks queued and running */
+    long long cost_pending;     /* Cost of tasks queued and running */
+    int magick_threads;         /* Current thread limit of ImageMagick */
 
-typedef struct {
+    bolt_stats_t stats;
+} bolt_service_t;
+
+/*
+ * Fields of lookup and send path were put in the first cache line,
+ * the key follows the struct and was shared by the shard's index.
+ */
+typedef struct bolt_cache_s {
     struct list_head link;  /* Link LRU */
-    int size;
-    int refcount;
-    int flags;
     void *cache;
     time_t time;
-    time_t last;
     time_t life_time;
-    char datetime[BOLT_DATETIME_LENGTH];
-    char filename[BOLT_FILENAME_LENGTH];
+    time_t last;
+    int refcount;           /* Atomic, the hash table holds one */
+    int size;
     int fnlen;
+    int alloc;              /* Bytes were counted in memory usage */
+
+    bolt_cache_shard_t *shard;
+    uint64_t hashval;
+    struct list_head timer; /* Link slot of timer wheel */
+    double priority;        /* GDSF priority */
+    int heap_index;         /* Index in GDSF heap, -1 when not in */
+    int hits;
+    int cost;               /* usec of CPU time to generate it */
+    int fd;                 /* memfd of cache, -1 when on heap */
+    short node;             /* NUMA node of cache, -1 is unknown */
+    unsigned char inlined;  /* Blob follows the key in one slab item */
+    unsigned char numa;     /* Cache was alloc by bolt_numa_alloc() */
+    unsigned char region;   /* List of cache policy the cache was in */
+    char filename[];        /* Key, NUL terminated */
 } bolt_cache_t;
 
+typedef struct bolt_stream_block_s {
+    struct bolt_stream_block_s *next;
+    char data[BOLT_STREAM_BLOCK];
+} bolt_stream_block_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    int refcount;           /* Atomic */
+    bolt_stream_block_t *head;
+    bolt_stream_block_t *tail;  /* Only used by writer */
+    size_t size;            /* Bytes were written, under lock */
+    int state;              /* Under lock */
+    struct bolt_connection_s *parked;  /* Waiting more data, under lock */
+    time_t time;            /* Last-Modified, same as the cache */
+    char datetime[BOLT_DATETIME_LENGTH];
+} bolt_stream_t;
+
+/*
+ * Buffers were attached to connection when reading request and sending
+ * response, and returned to the reactor's slab while the socket is idle
+ * or waiting for worker.
+ */
 typedef struct {
-    struct list_head link;  /* Link waiting queue/free queue */
+    char rbuf[BOLT_RBUF_SIZE];
+    char wbuf[BOLT_WBUF_SIZE];
+    char filename[BOLT_FILENAME_LENGTH];
+} bolt_connection_buffer_t;
+
+typedef struct bolt_connection_s {
+    struct list_head link;  /* Link waiting queue */
+    struct bolt_connection_s *wakeup_next;  /* Link wakeup stack */
+    struct bolt_wait_queue_s *waitq;  /* Waiting in, NULL when woken up */
+    bolt_reactor_t *reactor;
     int sock;
     int http_code;
     int recv_state;
-    int send_state;
     int keepalive;
     int parse_field;
     int parse_error;
     int header_only;
-    struct event revent;
-    struct event wevent;
+    int chunked;            /* Client supports chunked encoding */
+    struct event event;     /* Read or write event, never both */
     int revset:1;
     int wevset:1;
     struct http_parser hp;
     struct {
         time_t tms;
     } headers;
+    bolt_connection_buffer_t *buf;  /* NULL when idle */
     /* read buffer */
-    char rbuf[BOLT_RBUF_SIZE];
     char *rpos;
     char *rend;
     char *rlast;
     /* write buffer */
-    char wbuf[BOLT_WBUF_SIZE];
     char *wpos;
     char *wend;
+    /* content buffer */
+    char *cpos;
+    char *cend;
     bolt_cache_t *icache;
+    /* streaming content */
+    bolt_stream_t *istream;
+    bolt_stream_block_t *sblock;
+    int soff;               /* Offset in sblock */
+    size_t spos;            /* Bytes of stream were sent */
+    int sstate;             /* BOLT_STREAM_SEND_* */
+    uint64_t hashval;       /* Hash value of filename */
     int fnlen;
-    char filename[BOLT_FILENAME_LENGTH];
 } bolt_connection_t;
 
+typedef struct bolt_wait_queue_s {
+    struct list_head wait_conns;
+    int waiters;            /* Live clients, the gone away were removed */
+    bolt_stream_t *stream;  /* Image is being encoded and streamed */
+} bolt_wait_queue_t;
+
+typedef struct {
+    int  width;
+    int  height;
+    int  quality;
+    char format[32];
+    char path[BOLT_FILENAME_LENGTH];
+} bolt_job_t;
+
 typedef struct {
     struct list_head link;  /* Link all tasks */
+    uint64_t hashval;
+    uint64_t enqueue_time;  /* usec, monotonic */
+    int cost;               /* Estimated cost for admission control */
+    int node;               /* NUMA node of the reactor requested */
+    bolt_wait_queue_t *waitq;
+    int job_valid;
+    int cpu_cost;           /* usec of CPU time to generate the image */
+    bolt_job_t job;
+    uint64_t srchash;       /* Hash value of job's source path */
     int fnlen;
     char filename[BOLT_FILENAME_LENGTH];
 } bolt_task_t;
 
-typedef struct {
-    struct list_head link;  /* Link all wait queue */
-    struct list_head wait_conns;
-} bolt_wait_queue_t;
-
 extern bolt_setting_t *setting;
 extern bolt_service_t *service;
 
-#define LOCK_CACHE()        pthread_mutex_lock(&service->cache_lock)
-#define UNLOCK_CACHE()      pthread_mutex_unlock(&service->cache_lock)
+#define LOCK_CACHE(s)       pthread_mutex_lock(&(s)->lock)
+#define UNLOCK_CACHE(s)     pthread_mutex_unlock(&(s)->lock)
 
 #define LOCK_WAITQUEUE()    pthread_mutex_lock(&service->waitq_lock)
 #define UNLOCK_WAITQUEUE()  pthread_mutex_unlock(&service->waitq_lock)
 
-#define LOCK_TASK()         pthread_mutex_lock(&service->task_lock)
-#define UNLOCK_TASK()       pthread_mutex_unlock(&service->task_lock)
+#define LOCK_STREAM(s)      pthread_mutex_lock(&(s)->lock)
+#define UNLOCK_STREAM(s)    pthread_mutex_unlock(&(s)->lock)
+
+#define LOCK_SLAB(s)        pthread_mutex_lock(&(s)->lock)
+#define UNLOCK_SLAB(s)      pthread_mutex_unlock(&(s)->lock)
 
-#define LOCK_WAKEUP()       pthread_mutex_lock(&service->wakeup_lock)
-#define UNLOCK_WAKEUP()     pthread_mutex_unlock(&service->wakeup_lock)
+#define LOCK_TASK(w)        pthread_mutex_lock(&(w)->task_lock)
+#define UNLOCK_TASK(w)      pthread_mutex_unlock(&(w)->task_lock)
 
 #endif
@@ -0,0 +1,537 @@
+/*
+ * Bolt - The Realtime Image Compress System
+ * Copyright (c) 2015 - 2016, Liexusong <280259971@qq.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include "bolt.h"
+#include "cache.h"
+#include "numa.h"
+#include "slab.h"
+#include "policy.h"
+
+static void
+bolt_cache_init_wheel(bolt_timer_wheel_t *wheel)
+{
+    int i, j;
+
+    for (i = 0; i < BOLT_WHEEL_LEVELS; i++) {
+        for (j = 0; j < BOLT_WHEEL_SLOTS; j++) {
+            INIT_LIST_HEAD(&wheel->slots[i][j]);
+        }
+    }
+
+    INIT_LIST_HEAD(&wheel->cascade);
+
+    wheel->now = 0;
+    wheel->timers = 0;
+}
+
+/*
+ * Put cache into the slot of the lowest level which can hold it,
+ * the expired one was put into the current slot.
+ */
+static void
+bolt_cache_place_timer(bolt_timer_wheel_t *wheel, bolt_cache_t *cache)
+{
+    time_t expire = cache->life_time + 1;  /* Valid through life time */
+    time_t delta, span;
+    int level, slot;
+
+    if (expire < wheel->now) {
+        expire = wheel->now;
+    }
+
+    delta = expire - wheel->now;
+
+    for (level = 0; level < BOLT_WHEEL_LEVELS - 1; level++) {
+        span = (time_t)1 << (BOLT_WHEEL_BITS * (level + 1));
+        if (delta < span) {
+            break;
+        }
+    }
+
+    /* Too far, would be placed again when cascaded */
+
+    span = (time_t)1 << (BOLT_WHEEL_BITS * BOLT_WHEEL_LEVELS);
+    if (delta >= span) {
+        expire = wheel->now + span - 1;
+    }
+
+    slot = (expire >> (BOLT_WHEEL_BITS * level)) & (BOLT_WHEEL_SLOTS - 1);
+
+    list_add_tail(&cache->timer, &wheel->slots[level][slot]);
+}
+
+int
+bolt_init_cache(int shards)
+{
+    bolt_cache_shard_t *shard;
+    int i;
+
+    service->cache_shards = calloc(shards, sizeof(bolt_cache_shard_t));
+    if (service->cache_shards == NULL) {
+        bolt_log(BOLT_LOG_ERROR, "Not enough memory to alloc cache shards");
+        return -1;
+    }
+
+    service->cache_shards_num = shards;
+
+    bolt_init_cache_policy();
+
+    for (i = 0; i < shards; i++) {
+
+        shard = &service->cache_shards[i];
+
+        if (pthread_mutex_init(&shard->lock, NULL) == -1) {
+            bolt_log(BOLT_LOG_ERROR, "Failed to initialize cache shard lock");
+            return -1;
+        }
+
+        shard->htb = jk_hash_new(0, NULL, NULL);
+        if (shard->htb == NULL) {
+            bolt_log(BOLT_LOG_ERROR, "Failed to create cache HashTable");
+            return -1;
+        }
+
+        jk_hash_borrow_keys(shard->htb); /* Keys were in cache objects */
+
+        INIT_LIST_HEAD(&shard->lru);
+
+        shard->memory_usage = 0;
+
+        bolt_cache_init_wheel(&shard->wheel);
+
+        if (bolt_cache_policy->init(shard) == -1) {
+            bolt_log(BOLT_LOG_ERROR, "Failed to initialize cache policy `%s'",
+                     bolt_cache_policy->name);
+            return -1;
+        }
+
+        if (setting->slab && bolt_slab_init(&shard->slab) == -1) {
+            bolt_log(BOLT_LOG_ERROR, "Failed to initialize cache slab");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Find the shard which the key belongs to, use the high bits
+ * of hash value because the low bits were used by hash table.
+ */
+bolt_cache_shard_t *
+bolt_cache_get_shard(uint64_t hashval)
+{
+    unsigned int h = (unsigned int)(hashval >> 32);
+
+    return &service->cache_shards[h % service->cache_shards_num];
+}
+
+/*
+ * Sum memory usage of all shards, read without lock.
+ * Shard's memory usage was changed by atomic operations.
+ */
+int
+bolt_cache_memory_usage()
+{
+    int i, total = 0;
+
+    for (i = 0; i < service->cache_shards_num; i++) {
+        total += service->cache_shards[i].memory_usage;
+    }
+
+    return total;
+}
+
+#if defined(BOLT_HAVE_SENDFILE)
+
+/*
+ * Move blob into a memfd, so the send path can use sendfile()
+ * and the kernel never copies the image through user buffers.
+ */
+static int
+bolt_cache_map_blob(bolt_cache_t *cache, void *blob, int size)
+{
+    char *pos = blob;
+    int remain = size;
+    int nbytes;
+    void *addr;
+    int fd;
+
+    fd = memfd_create("bolt-cache", MFD_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+
+    while (remain > 0) {
+        nbytes = write(fd, pos, remain);
+        if (nbytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            goto failed;
+        }
+        pos += nbytes;
+        remain -= nbytes;
+    }
+
+    addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        goto failed;
+    }
+
+    cache->cache = addr;
+    cache->fd = fd;
+
+    return 0;
+
+failed:
+    close(fd);
+    return -1;
+}
+
+#endif
+
+static int
+bolt_cache_want_memfd(int size)
+{
+#if defined(BOLT_HAVE_SENDFILE)
+    return setting->sendfile_size > 0 && size >= setting->sendfile_size;
+#else
+    return 0;
+#endif
+}
+
+static int
+bolt_cache_want_numa(int node)
+{
+    return setting->numa && node >= 0 && bolt_numa_nodes > 1;
+}
+
+/*
+ * Size of cache struct's memory, includes the key and
+ * the inlined blob
+ */
+static size_t
+bolt_cache_struct_size(bolt_cache_t *cache)
+{
+    return sizeof(*cache) + cache->fnlen + 1
+           + (cache->inlined ? cache->size : 0);
+}
+
+/*
+ * Create cache object for image blob, the blob was owned
+ * by cache object when success. The caller holds the first
+ * reference and must release it by bolt_cache_decref().
+ * The key was copied after the struct, and by slab allocator
+ * the blob was copied after the key unless it would be moved
+ * to memfd or NUMA node.
+ */
+bolt_cache_t *
+bolt_cache_new(bolt_cache_shard_t *shard, char *key, int klen,
+    void *blob, int size, int node)
+{
+    bolt_cache_t *cache;
+    int inlined;
+    size_t head;
+
+    inlined = setting->slab
+              && !bolt_cache_want_memfd(size)
+              && !bolt_cache_want_numa(node);
+
+    head = sizeof(*cache) + klen + 1;
+
+    if (setting->slab) {
+        cache = bolt_slab_alloc(&shard->slab, head + (inlined ? size : 0));
+    } else if (posix_memalign((void **)&cache, 64, head) != 0) {
+        cache = NULL;
+    }
+
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    cache->shard = shard;
+    cache->size = size;
+    cache->refcount = 1;
+    cache->inlined = inlined;
+    cache->cache = blob;
+    cache->fd = -1;
+    cache->node = node;
+    cache->fnlen = klen;
+    cache->heap_index = -1;
+    INIT_LIST_HEAD(&cache->timer);
+    cache->hits = 0;
+    cache->cost = 0;
+    cache->priority = 0;
+
+    memcpy(cache->filename, key, klen);
+    cache->filename[klen] = 0;
+
+    if (inlined) {
+        cache->cache = cache->filename + klen + 1;
+        memcpy(cache->cache, blob, size);
+        free(blob);
+    }
+
+    /* Not pinned, the blob was touched first by current worker */
+    if (cache->node < 0) {
+        cache->node = bolt_numa_current_node();
+    }
+
+    cache->numa = 0;
+
+#if defined(BOLT_HAVE_SENDFILE)
+    if (bolt_cache_want_memfd(size)) {
+        if (bolt_cache_map_blob(cache, blob, size) == 0) {
+            free(blob);
+        } else {
+            bolt_log(BOLT_LOG_ALERT,
+                     "Failed to map cache blob to memfd, use heap instead");
+        }
+    }
+#endif
+
+    /* Move blob to the node of reactor which would send it */
+    if (bolt_cache_want_numa(node) && cache->fd == -1) {
+        void *addr = bolt_numa_alloc(size, node);
+
+        if (addr) {
+            memcpy(addr, blob, size);
+            free(blob);
+
+            cache->cache = addr;
+            cache->numa = 1;
+        }
+    }
+
+    /* Memory usage includes struct, key and the index's bucket, */
+    /* slab counts the rounded size */
+    if (setting->slab) {
+        cache->alloc = bolt_slab_chunk_size(bolt_cache_struct_size(cache))
+                     + (inlined ? 0 : size);
+    } else {
+        cache->alloc = bolt_cache_struct_size(cache) + size;
+    }
+
+    cache->alloc += sizeof(jk_hash_entry_t) + 1;
+
+    __sync_fetch_and_add(&shard->memory_usage, cache->alloc);
+
+    if (cache->node >= 0 && cache->node < BOLT_MAX_NUMA_NODES) {
+        __sync_fetch_and_add(&service->node_memory[cache->node],
+                             cache->alloc);
+    }
+
+    return cache;
+}
+
+void
+bolt_cache_free(bolt_cache_t *cache)
+{
+#if defined(BOLT_HAVE_SENDFILE)
+    if (cache->fd != -1) {
+        munmap(cache->cache, cache->size);
+        close(cache->fd);
+    }
+#endif
+
+    if (cache->numa) {
+        bolt_numa_free(cache->cache, cache->size);
+    } else if (!cache->inlined && cache->fd == -1) {
+        free(cache->cache);
+    }
+
+    if (setting->slab) {
+        bolt_slab_free(&cache->shard->slab, cache,
+                       bolt_cache_struct_size(cache));
+    } else {
+        free(cache);
+    }
+}
+
+/*
+ * Remove cache from shard's policy lists and hash table, and drop
+ * the hash table's reference, the shard must be locked. The cache
+ * used by client would be freed after sent finished.
+ */
+void
+bolt_cache_evict(bolt_cache_shard_t *shard, bolt_cache_t *cache)
+{
+    if (!list_empty(&cache->timer)) {
+        list_del_init(&cache->timer);
+        shard->wheel.timers--;
+    }
+
+    bolt_cache_policy->remove(shard, cache);
+
+    jk_hash_remove_hash(shard->htb, cache->filename,
+                        cache->fnlen, cache->hashval);
+
+    bolt_cache_decref(cache);
+}
+
+/*
+ * Add cache to shard's timer wheel, the shard must be locked
+ */
+void
+bolt_cache_add_timer(bolt_cache_shard_t *shard, bolt_cache_t *cache)
+{
+    bolt_timer_wheel_t *wheel = &shard->wheel;
+
+    if (wheel->timers == 0) { /* Skip the idle seconds */
+        wheel->now = service->current_time;
+    }
+
+    bolt_cache_place_timer(wheel, cache);
+
+    wheel->timers++;
+}
+
+/*
+ * Advance shard's timer wheel to now and evict the expired caches,
+ * every moved, evicted cache and passed second costs one budget.
+ * The rest would be done by the next ticks, return the budget used.
+ */
+static int
+bolt_cache_expire_shard(bolt_cache_shard_t *shard, time_t now, int budget)
+{
+    bolt_timer_wheel_t *wheel = &shard->wheel;
+    struct list_head *slot;
+    bolt_cache_t *cache;
+    int level, index, work = 0;
+
+    LOCK_CACHE(shard);
+
+    while (work < budget) {
+
+        work++;
+
+        if (wheel->timers == 0) {
+            wheel->now = now + 1;
+            break;
+        }
+
+        if (!list_empty(&wheel->cascade)) {
+            cache = list_entry(wheel->cascade.next, bolt_cache_t, timer);
+            list_del(&cache->timer);
+            bolt_cache_place_timer(wheel, cache);
+            continue;
+        }
+
+        if (wheel->now > now) {
+            break;
+        }
+
+        slot = &wheel->slots[0][wheel->now & (BOLT_WHEEL_SLOTS - 1)];
+
+        if (!list_empty(slot)) {
+            cache = list_entry(slot->next, bolt_cache_t, timer);
+            bolt_cache_evict(shard, cache);
+            continue;
+        }
+
+        wheel->now++;
+
+        /* Cascade the upper slots when lower levels wrapped around */
+
+        for (level = 1; level < BOLT_WHEEL_LEVELS; level++) {
+
+            if (wheel->now & (((time_t)1 << (BOLT_WHEEL_BITS * level)) - 1)) {
+                break;
+            }
+
+            index = (wheel->now >> (BOLT_WHEEL_BITS * level))
+                    & (BOLT_WHEEL_SLOTS - 1);
+
+            list_splice(&wheel->slots[level][index], &wheel->cascade);
+            INIT_LIST_HEAD(&wheel->slots[level][index]);
+        }
+    }
+
+    UNLOCK_CACHE(shard);
+
+    return work;
+}
+
+static int bolt_cache_expire_cursor; /* The shard next tick starts at */
+
+/*
+ * Called by clock every second, the work was shared by shards.
+ * Never more than BOLT_EXPIRE_PER_TICK in all, when too many shards
+ * the next tick goes on with the shards this one did not reach.
+ */
+void
+bolt_cache_expire(time_t now)
+{
+    int budget = BOLT_EXPIRE_PER_TICK, share, shards, n, i;
+
+    shards = service->cache_shards_num;
+
+    share = BOLT_EXPIRE_PER_TICK / shards;
+    if (share < 8) {
+        share = 8;
+    }
+
+    for (n = 0; n < shards && budget > 0; n++) {
+        i = (bolt_cache_expire_cursor + n) % shards;
+
+        budget -= bolt_cache_expire_shard(&service->cache_shards[i], now,
+                                          share < budget ? share : budget);
+    }
+
+    bolt_cache_expire_cursor = (bolt_cache_expire_cursor + n) % shards;
+}
+
+/*
+ * Pin cache object, the caller must hold a reference already
+ * (e.g. found it from shard's hash table with shard locked).
+ */
+void
+bolt_cache_incref(bolt_cache_t *cache)
+{
+    __sync_fetch_and_add(&cache->refcount, 1);
+}
+
+/*
+ * Unpin cache object, the last one frees it. Cache was removed
+ * from hash table before the table's reference dropped, so it
+ * was reclaimed exactly once and nobody can find it again.
+ */
+void
+bolt_cache_decref(bolt_cache_t *cache)
+{
+    if (__sync_sub_and_fetch(&cache->refcount, 1) == 0) {
+        __sync_fetch_and_sub(&cache->shard->memory_usage, cache->alloc);
+
+        if (cache->node >= 0 && cache->node < BOLT_MAX_NUMA_NODES) {
+            __sync_fetch_and_sub(&service->node_memory[cache->node],
+                                 cache->alloc);
+        }
+
+        bolt_cache_free(cache);
+    }
+}
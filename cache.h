@@ -0,0 +1,16 @@
+#ifndef __BOLT_CACHE_H
+#define __BOLT_CACHE_H
+
+int bolt_init_cache(int shards);
+bolt_cache_shard_t *bolt_cache_get_shard(uint64_t hashval);
+int bolt_cache_memory_usage();
+bolt_cache_t *bolt_cache_new(bolt_cache_shard_t *shard, char *key, int klen,
+    void *blob, int size, int node);
+void bolt_cache_free(bolt_cache_t *cache);
+void bolt_cache_evict(bolt_cache_shard_t *shard, bolt_cache_t *cache);
+void bolt_cache_add_timer(bolt_cache_shard_t *shard, bolt_cache_t *cache);
+void bolt_cache_expire(time_t now);
+void bolt_cache_incref(bolt_cache_t *cache);
+void bolt_cache_decref(bolt_cache_t *cache);
+
+#endif
@@ -10,6 +10,8 @@
                 MagickCompositeImage(wand, cwand, compose, x, y)
 #define MagickResizeImage(wand, width, height, filter)          \
                 MagickResizeImage(wand, width, height, filter, 1.0)
+#define ThreadResource  ThreadsResource
+#define AreaResource    PixelsResource
 
 #else
 #include <MagickWand/MagickWand.h>
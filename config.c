@@ -25,6 +25,7 @@
 #include "bolt.h"
 #include "log.h"
 #include "utils.h"
+#include "numa.h"
 
 #define  BOLT_LINE_SIZE  1024
 
@@ -37,13 +38,39 @@ typedef struct {
 
 static int bolt_conf_parse_host(char *value, int length);
 static int bolt_conf_parse_port(char *value, int length);
+static int bolt_conf_parse_threads(char *value, int length);
 static int bolt_conf_parse_workers(char *value, int length);
 static int bolt_conf_parse_logfile(char *value, int length);
 static int bolt_conf_parse_logmark(char *value, int length);
 static int bolt_conf_parse_maxcache(char *value, int length);
 static int bolt_conf_parse_gcthreshold(char *value, int length);
 static int bolt_conf_parse_cachelife(char *value, int length);
+static int bolt_conf_parse_cacheshards(char *value, int length);
+static int bolt_conf_parse_cachepolicy(char *value, int length);
 static int bolt_conf_parse_nocache(char *value, int length);
+static int bolt_conf_parse_sendfile(char *value, int length);
+static int bolt_conf_parse_schedule(char *value, int length);
+static int bolt_conf_parse_statusurl(char *value, int length);
+static int bolt_conf_parse_maxtasks(char *value, int length);
+static int bolt_conf_parse_workerqueue(char *value, int length);
+static int bolt_conf_parse_maxwaiters(char *value, int length);
+static int bolt_conf_parse_maxcost(char *value, int length);
+static int bolt_conf_parse_retryafter(char *value, int length);
+static int bolt_conf_parse_stream(char *value, int length);
+static int bolt_conf_parse_orphantask(char *value, int length);
+static int bolt_conf_parse_tasktimeout(char *value, int length);
+static int bolt_conf_parse_decodecache(char *value, int length);
+static int bolt_conf_parse_decodecachelife(char *value, int length);
+static int bolt_conf_parse_native(char *value, int length);
+static int bolt_conf_parse_cpubudget(char *value, int length);
+static int bolt_conf_parse_magickmemory(char *value, int length);
+static int bolt_conf_parse_magickmap(char *value, int length);
+static int bolt_conf_parse_magickarea(char *value, int length);
+static int bolt_conf_parse_reactorcpus(char *value, int length);
+static int bolt_conf_parse_workercpus(char *value, int length);
+static int bolt_conf_parse_numa(char *value, int length);
+static int bolt_conf_parse_slab(char *value, int length);
+static int bolt_conf_parse_hugepages(char *value, int length);
 static int bolt_conf_parse_path(char *value, int length);
 static int bolt_conf_parse_watermark(char *value, int length);
 static int bolt_conf_parse_daemon(char *value, int length);
@@ -51,13 +78,39 @@ static int bolt_conf_parse_daemon(char *value, int length);
 static bolt_conf_item_t bolt_conf_imtes[] = {
     {"host",         bolt_conf_parse_host},
     {"port",         bolt_conf_parse_port},
+    {"threads",      bolt_conf_parse_threads},
     {"workers",      bolt_conf_parse_workers},
     {"logfile",      bolt_conf_parse_logfile},
     {"logmark",      bolt_conf_parse_logmark},
     {"max-cache",    bolt_conf_parse_maxcache},
     {"gc-threshold", bolt_conf_parse_gcthreshold},
     {"cache-life",   bolt_conf_parse_cachelife},
+    {"cache-shards", bolt_conf_parse_cacheshards},
+    {"cache-policy", bolt_conf_parse_cachepolicy},
     {"nocache",      bolt_conf_parse_nocache},
+    {"sendfile",     bolt_conf_parse_sendfile},
+    {"schedule",     bolt_conf_parse_schedule},
+    {"status-url",   bolt_conf_parse_statusurl},
+    {"max-tasks",    bolt_conf_parse_maxtasks},
+    {"worker-queue", bolt_conf_parse_workerqueue},
+    {"max-waiters",  bolt_conf_parse_maxwaiters},
+    {"max-cost",     bolt_conf_parse_maxcost},
+    {"retry-after",  bolt_conf_parse_retryafter},
+    {"stream",       bolt_conf_parse_stream},
+    {"orphan-task",  bolt_conf_parse_orphantask},
+    {"task-timeout", bolt_conf_parse_tasktimeout},
+    {"decode-cache", bolt_conf_parse_decodecache},
+    {"decode-cache-life", bolt_conf_parse_decodecachelife},
+    {"native",       bolt_conf_parse_native},
+    {"cpu-budget",   bolt_conf_parse_cpubudget},
+    {"magick-memory", bolt_conf_parse_magickmemory},
+    {"magick-map",   bolt_conf_parse_magickmap},
+    {"magick-area",  bolt_conf_parse_magickarea},
+    {"reactor-cpus", bolt_conf_parse_reactorcpus},
+    {"worker-cpus",  bolt_conf_parse_workercpus},
+    {"numa",         bolt_conf_parse_numa},
+    {"slab",         bolt_conf_parse_slab},
+    {"huge-pages",   bolt_conf_parse_hugepages},
     {"path",         bolt_conf_parse_path},
     {"watermark",    bolt_conf_parse_watermark},
     {"daemon",       bolt_conf_parse_daemon},
@@ -219,6 +272,26 @@ bolt_conf_parse_port(char *value, int length)
     return 0;
 }
 
+static int
+bolt_conf_parse_threads(char *value, int length)
+{
+    int retval;
+
+    retval = bolt_atoi(value, length, &setting->threads);
+    if (retval == -1) {
+        return -1;
+    }
+
+    if (setting->threads <= 0) {
+        setting->threads = 1;
+
+    } else if (setting->threads > BOLT_MAX_REACTORS) {
+        setting->threads = BOLT_MAX_REACTORS;
+    }
+
+    return 0;
+}
+
 static int
 bolt_conf_parse_workers(char *value, int length)
 {
@@ -264,7 +337,7 @@ bolt_conf_parse_logmark(char *value, int length)
 }
 
 static int
-bolt_conf_parse_maxcache(char *value, int length)
+bolt_conf_parse_size(char *value, int length, int *size)
 {
     int retval;
     int result;
@@ -293,7 +366,17 @@ bolt_conf_parse_maxcache(char *value, int length)
         return -1;
     }
 
-    setting->max_cache = result * unit;
+    *size = result * unit;
+
+    return 0;
+}
+
+static int
+bolt_conf_parse_maxcache(char *value, int length)
+{
+    if (bolt_conf_parse_size(value, length, &setting->max_cache) == -1) {
+        return -1;
+    }
 
     if (setting->max_cache < BOLT_MIN_CACHE_SIZE) {
         setting->max_cache = BOLT_MIN_CACHE_SIZE;
@@ -338,6 +421,45 @@ bolt_conf_parse_cachelife(char *value, int length)
     return 0;
 }
 
+static int
+bolt_conf_parse_cacheshards(char *value, int length)
+{
+    int retval;
+
+    retval = bolt_atoi(value, length, &setting->cache_shards);
+    if (retval == -1) {
+        return -1;
+    }
+
+    if (setting->cache_shards <= 0) {
+        setting->cache_shards = 16;
+
+    } else if (setting->cache_shards > BOLT_MAX_CACHE_SHARDS) {
+        setting->cache_shards = BOLT_MAX_CACHE_SHARDS;
+    }
+
+    return 0;
+}
+
+static int
+bolt_conf_parse_cachepolicy(char *value, int length)
+{
+    if (!strncasecmp(value, "LRU", length)) {
+        setting->cache_policy = BOLT_CACHE_POLICY_LRU;
+
+    } else if (!strncasecmp(value, "TINYLFU", length)) {
+        setting->cache_policy = BOLT_CACHE_POLICY_TINYLFU;
+
+    } else if (!strncasecmp(value, "GDSF", length)) {
+        setting->cache_policy = BOLT_CACHE_POLICY_GDSF;
+
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
 static int
 bolt_conf_parse_nocache(char *value, int length)
 {
@@ -353,6 +475,369 @@ bolt_conf_parse_nocache(char *value, int length)
     return 0;
 }
 
+static int
+bolt_conf_parse_sendfile(char *value, int length)
+{
+    if (!strncasecmp(value, "NO", length)
+        || !strncasecmp(value, "OFF", length))
+    {
+        setting->sendfile_size = 0;
+        return 0;
+    }
+
+    if (bolt_conf_parse_size(value, length, &setting->sendfile_size) == -1) {
+        return -1;
+    }
+
+    if (setting->sendfile_size < 0) {
+        setting->sendfile_size = 0;
+    }
+
+    return 0;
+}
+
+static int
+bolt_conf_parse_schedule(char *value, int length)
+{
+    if (!strncasecmp(value, "FIFO", length)) {
+        setting->schedule = BOLT_SCHEDULE_FIFO;
+
+    } else if (!strncasecmp(value, "WAITERS", length)) {
+        setting->schedule = BOLT_SCHEDULE_WAITERS;
+
+    } else if (!strncasecmp(value, "SMALL-FIRST", length)) {
+        setting->schedule = BOLT_SCHEDULE_SMALL_FIRST;
+
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+bolt_conf_parse_statusurl(char *value, int length)
+{
+    while (length > 0 && *value == '/') { /* Same as request filename */
+        value++;
+        length--;
+    }
+
+    if (length <= 0 || length + 1 > BOLT_FILENAME_LENGTH) {
+        return -1;
+    }
+
+    setting->status_url = malloc(length + 2);
+    if (!setting->status_url) {
+        return -1;
+    }
+
+    setting->status_url[0] = '/';
+    memcpy(setting->status_url + 1, value, length);
+    setting->status_url[length + 1] = 0;
+
+    setting->status_len = length + 1;
+
+    return 0;
+}
+
+static int
+bolt_conf_parse_maxtasks(char *value, int length)
+{
+    if (bolt_atoi(value, length, &setting->max_tasks) == -1) {
+        return -1;
+    }
+
+    if (setting->max_tasks < 0) {
+        setting->max_tasks = 0;
+    }
+
+    return 0;
+}
+
+static int
+bolt_conf_parse_workerqueue(char *value, int length)
+{
+    if (bolt_atoi(value, length, &setting->worker_queue) == -1) {
+        return -1;
+    }
+
+    if (setting->worker_queue < 0) {
+        setting->worker_queue = 0;
+    }
+
+    return 0;
+}
+
+static int
+bolt_conf_parse_maxwaiters(char *value, int length)
+{
+    if (bolt_atoi(value, length, &setting->max_waiters) == -1) {
+        return -1;
+    }
+
+    if (setting->max_waiters < 0) {
+        setting->max_waiters = 0;
+    }
+
+    return 0;
+}
+
+static int
+bolt_conf_parse_maxcost(char *value, int length)
+{
+    if (bolt_conf_parse_size(value, length, &setting->max_cost) == -1) {
+        return -1;
+    }
+
+    if (setting->max_cost < 0) {
+        setting->max_cost = 0;
+    }
+
+    return 0;
+}
+
+static int
+bolt_conf_parse_retryafter(char *value, int length)
+{
+    if (bolt_atoi(value, length, &setting->retry_after) == -1) {
+        return -1;
+    }
+
+    if (setting->retry_after <= 0) {
+        setting->retry_after = 1;
+    }
+
+    return 0;
+}
+
+static int
+bolt_conf_parse_stream(char *value, int length)
+{
+    if (!strncasecmp(value, "NO", length)
+        || !strncasecmp(value, "OFF", length))
+    {
+        setting->stream_pixels = 0;
+        return 0;
+    }
+
+    if (bolt_conf_parse_size(value, length, &setting->stream_pixels) == -1) {
+        return -1;
+    }
+
+    if (setting->stream_pixels < 0) {
+        setting->stream_pixels = 0;
+    }
+
+    return 0;
+}
+
+static int
+bolt_conf_parse_orphantask(char *value, int length)
+{
+    if (!strncasecmp(value, "DROP", length)) {
+        setting->orphan_task = BOLT_ORPHAN_DROP;
+
+    } else if (!strncasecmp(value, "FILL", length)) {
+        setting->orphan_task = BOLT_ORPHAN_FILL;
+
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+bolt_conf_parse_tasktimeout(char *value, int length)
+{
+    if (bolt_atoi(value, length, &setting->task_timeout) == -1) {
+        return -1;
+    }
+
+    if (setting->task_timeout < 0) {
+        setting->task_timeout = 0;
+    }
+
+    return 0;
+}
+
+static int
+bolt_conf_parse_decodecache(char *value, int length)
+{
+    if (bolt_atoi(value, length, &setting->decode_cache) == -1) {
+        return -1;
+    }
+
+    if (setting->decode_cache < 0) {
+        setting->decode_cache = 0;
+
+    } else if (setting->decode_cache > BOLT_MAX_DECODE_CACHE) {
+        setting->decode_cache = BOLT_MAX_DECODE_CACHE;
+    }
+
+    return 0;
+}
+
+static int
+bolt_conf_parse_decodecachelife(char *value, int length)
+{
+    if (bolt_atoi(value, length, &setting->decode_cache_life) == -1) {
+        return -1;
+    }
+
+    if (setting->decode_cache_life <= 0) {
+        setting->decode_cache_life = 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Output formats by native pipeline, like: "jpg,webp" or "off"
+ */
+static int
+bolt_conf_parse_native(char *value, int length)
+{
+    char *start = value, *end = value + length, *next;
+    int len;
+
+    setting->native_formats = 0;
+
+    while (start < end) {
+
+        for (next = start; next < end && *next != ','; next++);
+
+        len = next - start;
+
+        if (len == 0) {
+            /* empty item */
+
+        } else if (!strncasecmp(start, "JPG", len)
+                   || !strncasecmp(start, "JPEG", len))
+        {
+            setting->native_formats |= BOLT_NATIVE_JPEG;
+
+        } else if (!strncasecmp(start, "WEBP", len)) {
+#if defined(BOLT_HAVE_WEBP)
+            setting->native_formats |= BOLT_NATIVE_WEBP;
+#else
+            bolt_log(BOLT_LOG_ERROR,
+                     "Native WebP pipeline was not compiled (make WEBP=1)");
+#endif
+
+        } else if (!strncasecmp(start, "OFF", len)
+                   || !strncasecmp(start, "NO", len))
+        {
+            setting->native_formats = 0;
+
+        } else {
+            return -1;
+        }
+
+        start = next + 1;
+    }
+
+    return 0;
+}
+
+static int
+bolt_conf_parse_cpubudget(char *value, int length)
+{
+    if (bolt_atoi(value, length, &setting->cpu_budget) == -1) {
+        return -1;
+    }
+
+    if (setting->cpu_budget < 0) {
+        setting->cpu_budget = 0;
+    }
+
+    return 0;
+}
+
+static int
+bolt_conf_parse_magickmemory(char *value, int length)
+{
+    return bolt_conf_parse_size(value, length, &setting->magick_memory);
+}
+
+static int
+bolt_conf_parse_magickmap(char *value, int length)
+{
+    return bolt_conf_parse_size(value, length, &setting->magick_map);
+}
+
+static int
+bolt_conf_parse_magickarea(char *value, int length)
+{
+    return bolt_conf_parse_size(value, length, &setting->magick_area);
+}
+
+static int
+bolt_conf_parse_reactorcpus(char *value, int length)
+{
+    setting->reactor_cpus_num = bolt_parse_cpus(value, length,
+                                                setting->reactor_cpus,
+                                                BOLT_MAX_CPUS);
+
+    return setting->reactor_cpus_num == -1 ? -1 : 0;
+}
+
+static int
+bolt_conf_parse_workercpus(char *value, int length)
+{
+    setting->worker_cpus_num = bolt_parse_cpus(value, length,
+                                               setting->worker_cpus,
+                                               BOLT_MAX_CPUS);
+
+    return setting->worker_cpus_num == -1 ? -1 : 0;
+}
+
+static int
+bolt_conf_parse_numa(char *value, int length)
+{
+    if (!strncasecmp(value, "YES", length)
+        || !strncasecmp(value, "1", length)
+        || !strncasecmp(value, "ON", length))
+    {
+        setting->numa = 1;
+    } else {
+        setting->numa = 0;
+    }
+
+    return 0;
+}
+
+static int
+bolt_conf_parse_slab(char *value, int length)
+{
+    if (!strncasecmp(value, "YES", length)
+        || !strncasecmp(value, "1", length)
+        || !strncasecmp(value, "ON", length))
+    {
+        setting->slab = 1;
+    } else {
+        setting->slab = 0;
+    }
+
+    return 0;
+}
+
+static int
+bolt_conf_parse_hugepages(char *value, int length)
+{
+    if (!strncasecmp(value, "YES", length)
+        || !strncasecmp(value, "1", length)
+        || !strncasecmp(value, "ON", length))
+    {
+        setting->huge_pages = 1;
+    } else {
+        setting->huge_pages = 0;
+    }
+
+    return 0;
+}
+
 static int
 bolt_conf_parse_path(char *value, int length)
 {
@@ -24,12 +24,22 @@
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
 #include "bolt.h"
+#include "cache.h"
 #include "connection.h"
 #include "worker.h"
 #include "time.h"
+#include "stats.h"
+#include "stream.h"
+#include "slab.h"
+#include "policy.h"
 
-#define BOLT_MAX_FREE_CONNECTIONS  1024
+#if defined(BOLT_HAVE_SENDFILE)
+#include <sys/sendfile.h>
+#endif
 
 static int
 bolt_connection_process_request(bolt_connection_t *c);
@@ -46,9 +56,10 @@ void
 bolt_connection_recv_handler(int sock, short event, void *arg);
 void
 bolt_connection_send_handler(int sock, short event, void *arg);
-
-static int freeconn_count;
-static void *freeconn_list[BOLT_MAX_FREE_CONNECTIONS];
+void
+bolt_connection_wait_handler(int sock, short event, void *arg);
+static void
+bolt_connection_stream_send(bolt_connection_t *c);
 
 static struct http_parser_settings http_parser_callbacks = {
     .on_message_begin    = NULL,
@@ -78,6 +89,15 @@ char bolt_error_404_page[] =
 "</body>"
 "</html>";
 
+char bolt_error_503_page[] =
+"<html>"
+"<head><title>503 Service Unavailable</title></head>"
+"<body bgcolor=\"white\">"
+"<center><h1>503 Service Unavailable</h1></center>"
+"<hr><div align=\"center\">Bolt " BOLT_VERSION "</div>"
+"</body>"
+"</html>";
+
 char bolt_error_500_page[] =
 "<html>"
 "<head><title>500 Internal Server Error</title></head>"
@@ -90,22 +110,56 @@ char bolt_error_500_page[] =
 int
 bolt_init_connections()
 {
-    freeconn_count = 0;
+    int i;
+
+    for (i = 0; i < service->reactors_num; i++) {
+        if (bolt_slab_init(&service->reactors[i].slab) == -1) {
+            bolt_log(BOLT_LOG_ERROR, "Failed to initialize connection slab");
+            return -1;
+        }
+    }
+
     return 0;
 }
 
+void
+bolt_connection_remove_revent(bolt_connection_t *c)
+{
+    if (c->revset) {
+        if (event_del(&c->event) == 0) {
+            c->revset = 0;
+        }
+    }
+}
+
+void
+bolt_connection_remove_wevent(bolt_connection_t *c)
+{
+    if (c->wevset) {
+        if (event_del(&c->event) == 0) {
+            c->wevset = 0;
+        }
+    }
+}
+
+/*
+ * Read and write share one event, the connection only reads when
+ * it is idle or waiting, and only writes when sending response.
+ */
 int
 bolt_connection_install_revent(bolt_connection_t *c,
     void (*handler)(int, short, void *))
 {
     if (!c->revset) {
 
-        event_set(&c->revent, c->sock,
+        bolt_connection_remove_wevent(c);
+
+        event_set(&c->event, c->sock,
                   EV_READ|EV_PERSIST, handler, c);
 
-        event_base_set(service->ebase, &c->revent);
+        event_base_set(c->reactor->ebase, &c->event);
 
-        if (event_add(&c->revent, NULL) == -1) {
+        if (event_add(&c->event, NULL) == -1) {
             bolt_log(BOLT_LOG_ERROR,
                      "Failed to install read event, socket(%d)", c->sock);
             return -1;
@@ -123,12 +177,14 @@ bolt_connection_install_wevent(bolt_connection_t *c,
 {
     if (!c->wevset) {
 
-        event_set(&c->wevent, c->sock,
+        bolt_connection_remove_revent(c);
+
+        event_set(&c->event, c->sock,
                   EV_WRITE|EV_PERSIST, handler, c);
 
-        event_base_set(service->ebase, &c->wevent);
+        event_base_set(c->reactor->ebase, &c->event);
 
-        if (event_add(&c->wevent, NULL) == -1) {
+        if (event_add(&c->event, NULL) == -1) {
             bolt_log(BOLT_LOG_ERROR,
                      "Failed to install write event, socket(%d)", c->sock);
             return -1;
@@ -140,44 +196,61 @@ bolt_connection_install_wevent(bolt_connection_t *c,
     return 0;
 }
 
-void
-bolt_connection_remove_revent(bolt_connection_t *c)
+/*
+ * Attach buffers from the reactor's slab, the read buffer was empty
+ */
+static int
+bolt_connection_attach_buffer(bolt_connection_t *c)
 {
-    if (c->revset) {
-        if (event_del(&c->revent) == 0) {
-            c->revset = 0;
-        }
+    if (c->buf) {
+        return 0;
+    }
+
+    c->buf = bolt_slab_alloc(&c->reactor->slab, sizeof(*c->buf));
+    if (c->buf == NULL) {
+        bolt_log(BOLT_LOG_ERROR,
+                 "Not enough memory to alloc connection buffer, socket(%d)",
+                 c->sock);
+        return -1;
     }
+
+    c->rpos = c->buf->rbuf;
+    c->rend = c->buf->rbuf + BOLT_RBUF_SIZE;
+    c->rlast = c->buf->rbuf;
+
+    return 0;
 }
 
-void
-bolt_connection_remove_wevent(bolt_connection_t *c)
+static void
+bolt_connection_detach_buffer(bolt_connection_t *c)
 {
-    if (c->wevset) {
-        if (event_del(&c->wevent) == 0) {
-            c->wevset = 0;
-        }
+    if (c->buf) {
+        bolt_slab_free(&c->reactor->slab, c->buf, sizeof(*c->buf));
+
+        c->buf = NULL;
+        c->rpos = NULL;
+        c->rend = NULL;
+        c->rlast = NULL;
     }
 }
 
 bolt_connection_t *
-bolt_create_connection(int sock)
+bolt_create_connection(bolt_reactor_t *r, int sock)
 {
     bolt_connection_t *c;
     int retval;
 
-    if (freeconn_count > 0) {
-        c = freeconn_list[--freeconn_count];
-
-    } else {
-        c = malloc(sizeof(*c));
-        if (c == NULL) {
-            bolt_log(BOLT_LOG_ERROR,
-                     "Not enough memory to alloc connection object");
-            return NULL;
-        }
+    c = bolt_slab_alloc(&r->slab, sizeof(*c));
+    if (c == NULL) {
+        bolt_log(BOLT_LOG_ERROR,
+                 "Not enough memory to alloc connection object");
+        return NULL;
     }
 
+    /* Reactors create and free connections at the same time */
+    __sync_fetch_and_add(&service->connections, 1);
+
+    c->reactor = r;
     c->sock = sock;
     c->http_code = 200;
     c->recv_state = BOLT_HTTP_STATE_START;
@@ -187,10 +260,14 @@ bolt_create_connection(int sock)
     c->parse_field = BOLT_PARSE_FIELD_START;
     c->parse_error = 0;
     c->header_only = 0;
-    c->rpos = c->rbuf;
-    c->rend = c->rbuf + BOLT_RBUF_SIZE;
-    c->rlast = c->rbuf;
+    c->buf = NULL;
+    c->rpos = NULL;
+    c->rend = NULL;
+    c->rlast = NULL;
     c->icache = NULL;
+    c->waitq = NULL;
+    c->istream = NULL;
+    c->sstate = BOLT_STREAM_SEND_NONE;
 
     c->headers.tms = 0;
 
@@ -212,6 +289,8 @@ bolt_create_connection(int sock)
 void
 bolt_free_connection(bolt_connection_t *c)
 {
+    bolt_reactor_t *r = c->reactor;
+
     bolt_connection_remove_revent(c);
     bolt_connection_remove_wevent(c);
 
@@ -222,24 +301,19 @@ bolt_free_connection(bolt_connection_t *c)
 
         c->icache = NULL;
 
-        cache->refcount--;
+        bolt_cache_decref(cache);
+    }
 
-        if (!cache->refcount && cache->flags == CACHE_FLAG_EXPIRED) {
+    if (c->istream) {
+        bolt_stream_decref(c->istream);
+        c->istream = NULL;
+    }
 
-            LOCK_CACHE();
-            service->memory_usage -= cache->size;
-            UNLOCK_CACHE();
+    bolt_connection_detach_buffer(c);
 
-            free(cache->cache);
-            free(cache);
-        }
-    }
+    bolt_slab_free(&r->slab, c, sizeof(*c));
 
-    if (freeconn_count < BOLT_MAX_FREE_CONNECTIONS) {
-        freeconn_list[freeconn_count++] = c;
-    } else {
-        free(c);
-    }
+    __sync_fetch_and_sub(&service->connections, 1);
 }
 
 void
@@ -250,30 +324,28 @@ bolt_connection_keepalive(bolt_connection_t *c)
 
         c->icache = NULL;
 
-        cache->refcount--;
-
-        if (!cache->refcount && cache->flags == CACHE_FLAG_EXPIRED) {
-
-            LOCK_CACHE();
-            service->memory_usage -= cache->size;
-            UNLOCK_CACHE();
+        bolt_cache_decref(cache);
+    }
 
-            free(cache->cache);
-            free(cache);
-        }
+    if (c->istream) {
+        bolt_stream_decref(c->istream);
+        c->istream = NULL;
     }
 
+    c->sstate = BOLT_STREAM_SEND_NONE;
+
     c->http_code = 200;
     c->recv_state = BOLT_HTTP_STATE_START;
     c->parse_field = BOLT_PARSE_FIELD_START;
     c->keepalive = 0;
     c->parse_error = 0;
     c->header_only = 0;
-    c->rpos = c->rbuf;
-    c->rlast = c->rbuf;
 
     c->headers.tms = 0;
 
+    /* Idle keep-alive connection holds no buffer */
+    bolt_connection_detach_buffer(c);
+
     http_parser_init(&c->hp, HTTP_REQUEST);
     c->hp.data = c;
 
@@ -348,6 +420,11 @@ bolt_connection_recv_handler(int sock, short event, void *arg)
         return;
     }
 
+    if (bolt_connection_attach_buffer(c) == -1) {
+        bolt_free_connection(c);
+        return;
+    }
+
     remain = c->rend - c->rpos;
     if (remain <= 0) {
         bolt_free_connection(c);
@@ -363,6 +440,9 @@ bolt_connection_recv_handler(int sock, short event, void *arg)
             bolt_log(BOLT_LOG_ERROR,
                      "Connection read error, socket(%d), errno(%d)",
                      sock, errno);
+
+        } else if (c->rpos == c->buf->rbuf) { /* Nothing was read */
+            bolt_connection_detach_buffer(c);
         }
         return;
 
@@ -376,7 +456,7 @@ bolt_connection_recv_handler(int sock, short event, void *arg)
     if (bolt_connection_recv_completed(c) == 0) {
 
         retval = http_parser_execute(&c->hp, &http_parser_callbacks,
-                                     c->rbuf, c->rlast - c->rbuf);
+                                     c->buf->rbuf, c->rlast - c->buf->rbuf);
 
         if (c->hp.method != HTTP_GET) {
             bolt_free_connection(c);
@@ -387,6 +467,8 @@ bolt_connection_recv_handler(int sock, short event, void *arg)
         }
 
         c->keepalive = http_should_keep_alive(&c->hp);
+        c->chunked = c->hp.http_major > 1
+                     || (c->hp.http_major == 1 && c->hp.http_minor >= 1);
 
         /* Process connection request */
         if (bolt_connection_process_request(c) == -1) {
@@ -395,141 +477,479 @@ bolt_connection_recv_handler(int sock, short event, void *arg)
     }
 }
 
+#if defined(EV_CLOSED)
+
+/*
+ * Pipelined bytes keep the socket readable, so only watch for the
+ * client closing (EPOLLRDHUP), the bytes were read after response.
+ */
+static int
+bolt_connection_watch_close(bolt_connection_t *c)
+{
+    if (!(event_base_get_features(c->reactor->ebase)
+          & EV_FEATURE_EARLY_CLOSE))
+    {
+        return -1;
+    }
+
+    bolt_connection_remove_revent(c);
+
+    event_set(&c->event, c->sock, EV_CLOSED|EV_PERSIST,
+              bolt_connection_wait_handler, c);
+
+    event_base_set(c->reactor->ebase, &c->event);
+
+    if (event_add(&c->event, NULL) == -1) {
+        return -1;
+    }
+
+    c->revset = 1;
+
+    return 0;
+}
+
+#endif
+
+/*
+ * Watch the waiting client, when it was gone away remove it from
+ * the wait queue, so the task can be cancelled if nobody waits.
+ */
 void
-bolt_connection_send_handler(int sock, short event, void *arg)
+bolt_connection_wait_handler(int sock, short event, void *arg)
 {
     bolt_connection_t *c = (bolt_connection_t *)arg;
-    int nsend, nbytes;
+    bolt_wait_queue_t *waitq;
+    char byte;
+    int nbytes = 0;
 
     if (!c || c->sock != sock) {
         bolt_log(BOLT_LOG_ERROR, "Connection was broken, address `%p'", c);
         return;
     }
 
-    nsend = c->wend - c->wpos;
+#if defined(EV_CLOSED)
+    if (!(event & EV_CLOSED))
+#endif
+    {
+        nbytes = recv(c->sock, &byte, 1, MSG_PEEK);
+    }
+
+    if (nbytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+    }
+
+    if (nbytes > 0) { /* Pipelined request, read it after response */
+#if defined(EV_CLOSED)
+        if (bolt_connection_watch_close(c) == 0) {
+            return;
+        }
+#endif
+        /* Can not know the client was gone, it would be freed */
+        /* after send failed */
+        bolt_connection_remove_revent(c);
+        return;
+    }
+
+    LOCK_WAITQUEUE();
+
+    waitq = c->waitq;
+
+    if (waitq) {
+        list_del(&c->link);
+        waitq->waiters--;
+        c->waitq = NULL;
+    }
+
+    UNLOCK_WAITQUEUE();
+
+    if (waitq) {
+        bolt_log(BOLT_LOG_DEBUG,
+                 "Client was gone away when waiting, socket(%d)", c->sock);
+        bolt_free_connection(c);
+
+    } else { /* Woken up already, would be freed after send failed */
+        bolt_connection_remove_revent(c);
+    }
+}
+
+/*
+ * Send header and content to client, the header and content are
+ * gathered by writev(). Content which cached in memfd was sent by
+ * sendfile(). Return 0 when all data sent, 1 when socket was full.
+ */
+static int
+bolt_connection_send(bolt_connection_t *c)
+{
+    struct iovec iov[2];
+    int hsize, csize, nbytes, iovcnt;
+
+    for (;;) {
+
+        hsize = c->wend - c->wpos;
+        csize = c->cend - c->cpos;
+
+        if (hsize == 0 && csize == 0) {
+            return 0;
+        }
+
+#if defined(BOLT_HAVE_SENDFILE)
+        if (c->icache && c->icache->fd != -1 && csize > 0) {
+
+            if (hsize > 0) {
+                nbytes = send(c->sock, c->wpos, hsize, MSG_MORE);
+
+            } else {
+                off_t offset = c->cpos - (char *)c->icache->cache;
+
+                nbytes = sendfile(c->sock, c->icache->fd, &offset, csize);
+            }
+
+            goto sent;
+        }
+#endif
+
+        iovcnt = 0;
+
+        if (hsize > 0) {
+            iov[iovcnt].iov_base = c->wpos;
+            iov[iovcnt].iov_len = hsize;
+            iovcnt++;
+        }
+
+        if (csize > 0) {
+            iov[iovcnt].iov_base = c->cpos;
+            iov[iovcnt].iov_len = csize;
+            iovcnt++;
+        }
+
+        nbytes = writev(c->sock, iov, iovcnt);
+
+#if defined(BOLT_HAVE_SENDFILE)
+sent:
+#endif
+        if (nbytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1;
+            }
 
-    nbytes = write(c->sock, c->wpos, nsend);
-    if (nbytes < 0) {
-        if (errno != EAGAIN && errno != EWOULDBLOCK) {
-            bolt_free_connection(c);
             bolt_log(BOLT_LOG_ERROR,
                      "Connection write error, socket(%d), errno(%d)",
-                     sock, errno);
+                     c->sock, errno);
+            return -1;
+
+        } else if (nbytes == 0) {
+            return -1;
         }
 
-        return;
+        if (nbytes >= hsize) {
+            c->wpos = c->wend;
+            c->cpos += nbytes - hsize;
+        } else {
+            c->wpos += nbytes;
+        }
+    }
+}
 
-    } else if (nbytes == 0) {
+static void
+bolt_connection_send_finish(bolt_connection_t *c, int retval)
+{
+    switch (retval) {
+    case 0: /* Finished sent data to client */
+        if (c->keepalive) { /* Do keepalive */
+            bolt_connection_keepalive(c);
+        } else {
+            bolt_free_connection(c);
+        }
+        break;
+
+    case 1: /* Wait socket writable */
+        bolt_connection_install_wevent(c, bolt_connection_send_handler);
+        break;
+
+    default:
         bolt_free_connection(c);
+        break;
+    }
+}
+
+void
+bolt_connection_send_handler(int sock, short event, void *arg)
+{
+    bolt_connection_t *c = (bolt_connection_t *)arg;
+
+    if (!c || c->sock != sock) {
+        bolt_log(BOLT_LOG_ERROR, "Connection was broken, address `%p'", c);
+        return;
+    }
+
+    if (c->sstate != BOLT_STREAM_SEND_NONE) {
+        bolt_connection_stream_send(c);
         return;
     }
 
-    c->wpos += nbytes;
+    bolt_connection_send_finish(c, bolt_connection_send(c));
+}
+
+/*
+ * Send the streaming image by chunked encoding, every chunk is a part
+ * of one block, so it can be sent as content directly. Connection was
+ * parked on the stream when all written data were sent, and would be
+ * woken up by worker when more data come.
+ */
+static void
+bolt_connection_stream_send(bolt_connection_t *c)
+{
+    bolt_stream_t *stream = c->istream;
+    size_t avail, nbytes;
+    int state, retval, nsend;
+
+    for (;;) {
 
-    if (c->wpos >= c->wend) { /* Finished sent data to client */
+        retval = bolt_connection_send(c);
 
-        if (c->send_state == BOLT_SEND_HEADER_STATE && !c->header_only) {
+        if (retval != 0 || c->sstate == BOLT_STREAM_SEND_LAST) {
+            bolt_connection_send_finish(c, retval);
+            return;
+        }
 
-            switch (c->http_code) {
-            case 200:
-                c->wpos = (char *)c->icache->cache;
-                c->wend = c->wpos + c->icache->size;
-                break;
+        LOCK_STREAM(stream);
 
-            case 400:
-                c->wpos = bolt_error_400_page;
-                c->wend = c->wpos + sizeof(bolt_error_400_page) - 1;
-                break;
+        avail = stream->size - c->spos;
+        state = stream->state;
 
-            case 404:
-                c->wpos = bolt_error_404_page;
-                c->wend = c->wpos + sizeof(bolt_error_404_page) - 1;
-                break;
+        if (avail == 0 && state == BOLT_STREAM_WRITING) {
+            c->wakeup_next = stream->parked;
+            stream->parked = c;
+        }
 
-            case 500:
-            default:
-                c->wpos = bolt_error_500_page;
-                c->wend = c->wpos + sizeof(bolt_error_500_page) - 1;
-                break;
-            }
+        UNLOCK_STREAM(stream);
+
+        if (avail == 0 && state == BOLT_STREAM_WRITING) {
+            bolt_connection_remove_wevent(c);
+            return;
+        }
 
-            c->send_state = BOLT_SEND_CONTENT_STATE;
+        if (avail == 0 && state == BOLT_STREAM_FAILED) {
+            bolt_log(BOLT_LOG_ERROR,
+                     "Stream was broken by encoder, socket(%d)", c->sock);
+            bolt_free_connection(c); /* Client sees an incomplete body */
+            return;
+        }
+
+        if (avail == 0) { /* The last chunk */
+            nsend = snprintf(c->buf->wbuf, BOLT_WBUF_SIZE, "%s0" BOLT_CRLF BOLT_CRLF,
+                             c->spos > 0 ? BOLT_CRLF : "");
+
+            c->cpos = NULL;
+            c->cend = NULL;
+
+            c->sstate = BOLT_STREAM_SEND_LAST;
 
         } else {
-            if (c->keepalive) { /* Do keepalive */
-                bolt_connection_keepalive(c);
-            } else {
-                bolt_free_connection(c);
+            if (c->sblock == NULL) {
+                c->sblock = stream->head;
+
+            } else if (c->soff == BOLT_STREAM_BLOCK) {
+                c->sblock = c->sblock->next;
+                c->soff = 0;
+            }
+
+            nbytes = BOLT_STREAM_BLOCK - c->soff;
+            if (nbytes > avail) {
+                nbytes = avail;
             }
+
+            nsend = snprintf(c->buf->wbuf, BOLT_WBUF_SIZE, "%s%x" BOLT_CRLF,
+                             c->spos > 0 ? BOLT_CRLF : "", (int)nbytes);
+
+            c->cpos = c->sblock->data + c->soff;
+            c->cend = c->cpos + nbytes;
+
+            c->soff += nbytes;
+            c->spos += nbytes;
         }
+
+        c->wpos = c->buf->wbuf;
+        c->wend = c->buf->wbuf + nsend;
+    }
+}
+
+/*
+ * Connection was woken up by worker, to send the result or more
+ * data of the stream.
+ */
+void
+bolt_connection_wakeup(bolt_connection_t *c)
+{
+    /* Stop watching the client's liveness */
+    bolt_connection_remove_revent(c);
+
+    if (bolt_connection_attach_buffer(c) == -1) {
+        bolt_free_connection(c);
+        return;
+    }
+
+    if (c->sstate != BOLT_STREAM_SEND_NONE) {
+        bolt_connection_stream_send(c);
+    } else {
+        bolt_connection_begin_send(c);
     }
 }
 
 void
 bolt_connection_begin_send(bolt_connection_t *c)
 {
+    char datetime[BOLT_DATETIME_LENGTH];
     int nsend;
 
+    c->cpos = NULL;
+    c->cend = NULL;
+
     switch (c->http_code) {
     case 200:
-        nsend = snprintf(c->wbuf, BOLT_WBUF_SIZE,
+        if (c->istream) {
+            nsend = snprintf(c->buf->wbuf, BOLT_WBUF_SIZE,
+                             "HTTP/1.1 200 OK" BOLT_CRLF
+                             "Content-Type: image/jpeg" BOLT_CRLF
+                             "Transfer-Encoding: chunked" BOLT_CRLF
+                             "Last-Modified: %s" BOLT_CRLF
+                             "Server: Bolt" BOLT_CRLF BOLT_CRLF,
+                             c->istream->datetime);
+            break;
+        }
+
+        bolt_format_time(datetime, c->icache->time);
+
+        nsend = snprintf(c->buf->wbuf, BOLT_WBUF_SIZE,
                          "HTTP/1.1 200 OK" BOLT_CRLF
                          "Content-Type: image/jpeg" BOLT_CRLF
                          "Content-Length: %d" BOLT_CRLF
                          "Last-Modified: %s" BOLT_CRLF
                          "Server: Bolt" BOLT_CRLF BOLT_CRLF,
-                         c->icache->size,
-                         c->icache->datetime);
+                         c->icache->size, datetime);
+        c->cpos = (char *)c->icache->cache;
+        c->cend = c->cpos + c->icache->size;
         break;
 
     case 304:
-        nsend = snprintf(c->wbuf, BOLT_WBUF_SIZE,
+        nsend = snprintf(c->buf->wbuf, BOLT_WBUF_SIZE,
                          "HTTP/1.1 304 Not Modified" BOLT_CRLF
                          "Server: Bolt" BOLT_CRLF BOLT_CRLF);
         break;
 
     case 400:
-        nsend = snprintf(c->wbuf, BOLT_WBUF_SIZE,
+        nsend = snprintf(c->buf->wbuf, BOLT_WBUF_SIZE,
                          "HTTP/1.1 400 Bad Request" BOLT_CRLF
                          "Content-Type: text/html" BOLT_CRLF
                          "Content-Length: %d" BOLT_CRLF
                          "Server: Bolt" BOLT_CRLF BOLT_CRLF,
                          (int)(sizeof(bolt_error_400_page) - 1));
+        c->cpos = bolt_error_400_page;
+        c->cend = c->cpos + sizeof(bolt_error_400_page) - 1;
         break;
 
     case 404:
-        nsend = snprintf(c->wbuf, BOLT_WBUF_SIZE,
+        nsend = snprintf(c->buf->wbuf, BOLT_WBUF_SIZE,
                          "HTTP/1.1 404 Not Found" BOLT_CRLF
                          "Content-Type: text/html" BOLT_CRLF
                          "Content-Length: %d" BOLT_CRLF
                          "Server: Bolt" BOLT_CRLF BOLT_CRLF,
                          (int)(sizeof(bolt_error_404_page) - 1));
+        c->cpos = bolt_error_404_page;
+        c->cend = c->cpos + sizeof(bolt_error_404_page) - 1;
+        break;
+
+    case 503:
+        nsend = snprintf(c->buf->wbuf, BOLT_WBUF_SIZE,
+                         "HTTP/1.1 503 Service Unavailable" BOLT_CRLF
+                         "Content-Type: text/html" BOLT_CRLF
+                         "Content-Length: %d" BOLT_CRLF
+                         "Retry-After: %d" BOLT_CRLF
+                         "Server: Bolt" BOLT_CRLF BOLT_CRLF,
+                         (int)(sizeof(bolt_error_503_page) - 1),
+                         setting->retry_after);
+        c->cpos = bolt_error_503_page;
+        c->cend = c->cpos + sizeof(bolt_error_503_page) - 1;
         break;
 
     case 500:
     default:
-        nsend = snprintf(c->wbuf, BOLT_WBUF_SIZE,
+        nsend = snprintf(c->buf->wbuf, BOLT_WBUF_SIZE,
                          "HTTP/1.1 500 Internal Server Error" BOLT_CRLF
                          "Content-Type: text/html" BOLT_CRLF
                          "Content-Length: %d" BOLT_CRLF
                          "Server: Bolt" BOLT_CRLF BOLT_CRLF,
                          (int)(sizeof(bolt_error_500_page) - 1));
+        c->cpos = bolt_error_500_page;
+        c->cend = c->cpos + sizeof(bolt_error_500_page) - 1;
         break;
     }
 
-    c->wpos = c->wbuf;
-    c->wend = c->wbuf + nsend;
-    c->send_state = BOLT_SEND_HEADER_STATE;
+    if (c->header_only) {
+        c->cpos = NULL;
+        c->cend = NULL;
+    }
+
+    c->wpos = c->buf->wbuf;
+    c->wend = c->buf->wbuf + nsend;
 
-    bolt_connection_install_wevent(c, bolt_connection_send_handler);
+    if (c->istream && c->http_code == 200) {
+        c->sstate = BOLT_STREAM_SEND_CHUNK;
+        c->sblock = NULL;
+        c->soff = 0;
+        c->spos = 0;
+
+        bolt_connection_stream_send(c);
+        return;
+    }
+
+    /* Try to send directly, socket is writable in most case */
+    bolt_connection_send_finish(c, bolt_connection_send(c));
+}
+
+/*
+ * Send service status, the body was saved in read buffer
+ * because the request was parsed finish
+ */
+static void
+bolt_connection_send_status(bolt_connection_t *c)
+{
+    int nbody, nsend;
+
+    nbody = bolt_stats_format(c->buf->rbuf, BOLT_RBUF_SIZE);
+    if (nbody >= BOLT_RBUF_SIZE) {
+        nbody = BOLT_RBUF_SIZE - 1;
+    }
+
+    nsend = snprintf(c->buf->wbuf, BOLT_WBUF_SIZE,
+                     "HTTP/1.1 200 OK" BOLT_CRLF
+                     "Content-Type: text/plain" BOLT_CRLF
+                     "Content-Length: %d" BOLT_CRLF
+                     "Cache-Control: no-cache" BOLT_CRLF
+                     "Server: Bolt" BOLT_CRLF BOLT_CRLF,
+                     nbody);
+
+    c->http_code = 200;
+
+    c->cpos = c->buf->rbuf;
+    c->cend = c->buf->rbuf + nbody;
+
+    c->wpos = c->buf->wbuf;
+    c->wend = c->buf->wbuf + nsend;
+
+    bolt_connection_send_finish(c, bolt_connection_send(c));
 }
 
 static int
 bolt_connection_process_request(bolt_connection_t *c)
 {
+    bolt_cache_shard_t *shard;
     bolt_cache_t *cache;
     bolt_wait_queue_t *waitq;
-    int dopass = 0;
     int retval;
 
     if (c->parse_error != 0) {
@@ -540,16 +960,28 @@ bolt_connection_process_request(bolt_connection_t *c)
 
     bolt_connection_remove_revent(c);
 
+    if (setting->status_url
+        && c->fnlen == setting->status_len
+        && !memcmp(c->buf->filename, setting->status_url, c->fnlen))
+    {
+        bolt_connection_send_status(c);
+        return 0;
+    }
+
     if (setting->nocache) { /* For testing no cache feature */
         goto nocache;
     }
 
     /* First: get image from cache */
 
-    LOCK_CACHE(); /* Lock cache */
+    shard = bolt_cache_get_shard(c->hashval);
+
+    LOCK_CACHE(shard); /* Lock cache shard */
 
-    retval = jk_hash_find(service->cache_htb,
-                          c->filename, c->fnlen, (void **)&cache);
+    bolt_cache_policy->access(shard, c->hashval);
+
+    retval = jk_hash_find_hash(shard->htb, c->buf->filename, c->fnlen,
+                               c->hashval, (void **)&cache);
 
     if (retval == JK_HASH_OK) {
 
@@ -558,27 +990,14 @@ bolt_connection_process_request(bolt_connection_t *c)
         /* Cache expired*/
         if (cache->life_time < service->current_time) {
 
-            /* Delete from LRU list */
-            list_del(&cache->link);
-            /* Delete from cache hash table */
-            jk_hash_remove(service->cache_htb, c->filename, c->fnlen);
-
-            /* Cache was used by client and set it expired */
-            /* After sent image cache finished and free it */
-            if (cache->refcount > 0) {
-                cache->flags = CACHE_FLAG_EXPIRED;
-            } else {
-                service->memory_usage -= cache->size;
-                free(cache->cache);
-                free(cache);
-            }
+            /* Delete from policy lists and hash table, if cache */
+            /* was used by client, it would be freed after sent */
+            bolt_cache_evict(shard, cache);
 
             found_cache = 0;
 
         } else {
-            /* Move cache to LRU tail */
-            list_del(&cache->link);
-            list_add_tail(&cache->link, &service->gc_lru);
+            bolt_cache_policy->hit(shard, cache);
 
             if (cache->time == c->headers.tms) {
                 c->http_code = 304;
@@ -586,28 +1005,28 @@ bolt_connection_process_request(bolt_connection_t *c)
             } else {
                 c->http_code = 200;
                 c->icache = cache;
-                cache->refcount++;
+                bolt_cache_incref(cache);
                 cache->last = service->current_time;
             }
         }
 
         if (found_cache) {
-            UNLOCK_CACHE();
+            UNLOCK_CACHE(shard);
             bolt_connection_begin_send(c);
             return 0;
         }
     }
 
-    UNLOCK_CACHE();
+    UNLOCK_CACHE(shard);
 
 nocache:
 
     LOCK_WAITQUEUE(); /* Lock wait queue */
 
-    retval = jk_hash_find(service->waiting_htb,
-                          c->filename, c->fnlen, (void **)&waitq);
+    retval = jk_hash_find_hash(service->waiting_htb, c->buf->filename, c->fnlen,
+                               c->hashval, (void **)&waitq);
 
-    if (retval == JK_HASH_ERR) { /* Free by bolt_wakeup_handler() */
+    if (retval == JK_HASH_ERR) { /* Free by bolt_wakeup_cache() */
 
         waitq = malloc(sizeof(*waitq));
 
@@ -618,21 +1037,83 @@ nocache:
         }
 
         INIT_LIST_HEAD(&waitq->wait_conns);
+        waitq->waiters = 0;
+        waitq->stream = NULL;
+
+        /* The worker finds wait queue by the table, so insert it */
+        /* before the task was queued, both under wait queue lock */
+
+        if (jk_hash_insert_hash(service->waiting_htb, c->buf->filename,
+                                c->fnlen, c->hashval, waitq, 0) != JK_HASH_OK)
+        {
+            UNLOCK_WAITQUEUE();
+            free(waitq);
+            bolt_log(BOLT_LOG_ERROR, "Failed to insert wait queue");
+
+            c->http_code = 500;
+            bolt_connection_begin_send(c);
+
+            return 0;
+        }
+
+        retval = bolt_worker_pass_task(c, waitq);
 
-        jk_hash_insert(service->waiting_htb,
-                       c->filename, c->fnlen, waitq, 0);
+        if (retval != 0) {
+            jk_hash_remove_hash(service->waiting_htb, c->buf->filename,
+                                c->fnlen, c->hashval);
+            UNLOCK_WAITQUEUE();
+            free(waitq);
+            goto overload;
+        }
+
+    } else if (waitq->stream && c->chunked) {
+
+        /* Image is being encoded, receive it from the stream */
+
+        c->istream = waitq->stream;
+        bolt_stream_incref(c->istream);
 
-        dopass = 1;
+        UNLOCK_WAITQUEUE();
+
+        c->http_code = 200;
+        bolt_connection_begin_send(c);
+
+        return 0;
+
+    } else if (setting->max_waiters > 0
+               && waitq->waiters >= setting->max_waiters)
+    {
+        UNLOCK_WAITQUEUE();
+        retval = BOLT_TASK_REJECTED;
+        goto overload;
     }
 
     list_add(&c->link, &waitq->wait_conns);
+    waitq->waiters++;
+
+    c->waitq = waitq;
 
     UNLOCK_WAITQUEUE();
 
-    if (dopass) {
-        return bolt_worker_pass_task(c);
+    /* Buffer was not used until woken up */
+    bolt_connection_detach_buffer(c);
+
+    /* Wakeup would be handled by this reactor later, so it's safe */
+    bolt_connection_install_revent(c, bolt_connection_wait_handler);
+
+    return 0;
+
+overload:
+
+    if (retval != BOLT_TASK_REJECTED) {
+        return -1;
     }
 
+    __sync_fetch_and_add(&service->stats.rejected, 1);
+
+    c->http_code = 503;
+    bolt_connection_begin_send(c);
+
     return 0;
 }
 
@@ -659,13 +1140,16 @@ bolt_connection_http_parse_url(struct http_parser *p,
         return -1;
     }
 
-    memcpy(c->filename, "/", 1);
-    memcpy(c->filename + 1, start, len);
+    memcpy(c->buf->filename, "/", 1);
+    memcpy(c->buf->filename + 1, start, len);
 
-    c->filename[len+1] = 0;
+    c->buf->filename[len+1] = 0;
 
     c->fnlen = len + 1;
 
+    /* Hash once, carried by cache, wait queue and task */
+    c->hashval = jk_hash_calc(c->buf->filename, c->fnlen);
+
     return 0;
 }
 
@@ -2,8 +2,9 @@
 #define __BOLT_CONNECTION_H
 
 int bolt_init_connections();
-bolt_connection_t *bolt_create_connection(int sock);
+bolt_connection_t *bolt_create_connection(bolt_reactor_t *r, int sock);
 void bolt_free_connection(bolt_connection_t *c);
 void bolt_connection_begin_send(bolt_connection_t *c);
+void bolt_connection_wakeup(bolt_connection_t *c);
 
 #endif
@@ -20,49 +20,264 @@
 
 #include <stdlib.h>
 #include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include "hash.h"
 
 
-static unsigned int jk_hash_buckets_size[] = {
-    7,          13,         31,         61,         127,        251,
-    509,        1021,       2039,       4093,       8191,       16381,
-    32749,      65521,      131071,     262143,     524287,     1048575,
-    2097151,    4194303,    8388607,    16777211,   33554431,   67108863,
-    134217727,  268435455,  536870911,  1073741823, 2147483647, 0
-};
+#define  JK_HASH_CTRL_EMPTY     0x80
+#define  JK_HASH_CTRL_DELETED   0xFE
 
+#define  JK_HASH_H1(h)          ((unsigned int)((h) >> 7))
+#define  JK_HASH_H2(h)          ((unsigned char)((h) & 0x7F))
 
-static void jk_hash_rehash(jk_hash_t *o);
 
+static int jk_hash_rehash(jk_hash_t *o, unsigned int buckets_size);
+static void jk_hash_rehash_step(jk_hash_t *o, unsigned int buckets);
 
-static long jk_hash_default_hash(char *key, int klen)
+
+/*
+ * MurmurHash64A, by Austin Appleby
+ */
+static uint64_t jk_hash_default_hash(char *key, int klen)
 {
-    long h = 0, g;
-    char *kend = key + klen;
-
-    while (key < kend) {
-        h = (h << 4) + *key++;
-        if ((g = (h & 0xF0000000))) {
-            h = h ^ (g >> 24);
-            h = h ^ g;
-        }
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+    const unsigned char *data = (const unsigned char *)key;
+    const unsigned char *end = data + (klen & ~7);
+    uint64_t h = 0x9747b28cULL ^ ((uint64_t)klen * m);
+    uint64_t k;
+
+    while (data != end) {
+        memcpy(&k, data, 8);
+
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+
+        h ^= k;
+        h *= m;
+
+        data += 8;
+    }
+
+    switch (klen & 7) {
+    case 7: h ^= (uint64_t)data[6] << 48;
+    case 6: h ^= (uint64_t)data[5] << 40;
+    case 5: h ^= (uint64_t)data[4] << 32;
+    case 4: h ^= (uint64_t)data[3] << 24;
+    case 3: h ^= (uint64_t)data[2] << 16;
+    case 2: h ^= (uint64_t)data[1] << 8;
+    case 1: h ^= (uint64_t)data[0];
+            h *= m;
     }
+
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+
     return h;
 }
 
 
-int jk_hash_init(jk_hash_t *o, unsigned int init_buckets,
-    jk_hash_hash_fn *hash, jk_hash_free_fn *free)
+/*
+ * Return bit mask of the control bytes in group which equal to byte
+ */
+static unsigned int jk_hash_group_match(unsigned char *group,
+    unsigned char byte)
+{
+#if defined(__SSE2__)
+    __m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(byte)));
+#else
+    unsigned int bits = 0;
+    int i;
+
+    for (i = 0; i < JK_HASH_GROUP_SIZE; i++) {
+        if (group[i] == byte) {
+            bits |= 1 << i;
+        }
+    }
+
+    return bits;
+#endif
+}
+
+
+/*
+ * Return bit mask of the empty or deleted buckets in group
+ */
+static unsigned int jk_hash_group_match_free(unsigned char *group)
+{
+#if defined(__SSE2__)
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group));
+#else
+    unsigned int bits = 0;
+    int i;
+
+    for (i = 0; i < JK_HASH_GROUP_SIZE; i++) {
+        if (group[i] & 0x80) {
+            bits |= 1 << i;
+        }
+    }
+
+    return bits;
+#endif
+}
+
+
+/*
+ * Probe groups by triangular sequence, it would visit
+ * every group because the number of groups is power of two.
+ */
+#define jk_hash_probe_start(t, hashval, pos, step) do {                   \
+    (step) = 0;                                                           \
+    (pos) = JK_HASH_H1(hashval) & ((t)->buckets_size - 1)                 \
+          & ~(JK_HASH_GROUP_SIZE - 1);                                    \
+} while (0)
+
+#define jk_hash_probe_next(t, pos, step) do {                             \
+    (step) += JK_HASH_GROUP_SIZE;                                         \
+    (pos) = ((pos) + (step)) & ((t)->buckets_size - 1);                   \
+} while (0)
+
+
+static int jk_hash_lookup(jk_hash_table_t *t, uint64_t hashval,
+    char *key, int klen)
+{
+    unsigned char h2 = JK_HASH_H2(hashval);
+    unsigned int pos, step, bits, index;
+    jk_hash_entry_t *e;
+
+    jk_hash_probe_start(t, hashval, pos, step);
+
+    for (;;) {
+
+        bits = jk_hash_group_match(t->ctrls + pos, h2);
+
+        while (bits) {
+            index = pos + __builtin_ctz(bits);
+            e = &t->buckets[index];
+
+            if (e->hashval == hashval && e->klen == klen &&
+                !memcmp(e->key, key, klen))
+            {
+                return index;
+            }
+
+            bits &= bits - 1;
+        }
+
+        if (jk_hash_group_match(t->ctrls + pos, JK_HASH_CTRL_EMPTY)) {
+            return -1;
+        }
+
+        jk_hash_probe_next(t, pos, step);
+    }
+}
+
+
+static unsigned int jk_hash_find_free(jk_hash_table_t *t, uint64_t hashval)
+{
+    unsigned int pos, step, bits;
+
+    jk_hash_probe_start(t, hashval, pos, step);
+
+    for (;;) {
+
+        bits = jk_hash_group_match_free(t->ctrls + pos);
+        if (bits) {
+            return pos + __builtin_ctz(bits);
+        }
+
+        jk_hash_probe_next(t, pos, step);
+    }
+}
+
+
+/*
+ * Find the key from both tables, return the table holds it
+ */
+static jk_hash_table_t *jk_hash_locate(jk_hash_t *o, uint64_t hashval,
+    char *key, int klen, int *index)
+{
+    if (o->rehash_idx != -1) {
+        jk_hash_rehash_step(o, JK_HASH_REHASH_STEP);
+    }
+
+    *index = jk_hash_lookup(&o->ht[0], hashval, key, klen);
+    if (*index != -1) {
+        return &o->ht[0];
+    }
+
+    if (o->rehash_idx != -1) {
+        *index = jk_hash_lookup(&o->ht[1], hashval, key, klen);
+        if (*index != -1) {
+            return &o->ht[1];
+        }
+    }
+
+    return NULL;
+}
+
+
+static int jk_hash_table_init(jk_hash_table_t *t, unsigned int init_buckets)
+{
+    unsigned int buckets_size = JK_HASH_BUCKETS_MIN_SIZE;
+
+    while (buckets_size < init_buckets
+           && buckets_size < JK_HASH_BUCKETS_MAX_SIZE)
+    {
+        buckets_size <<= 1;
+    }
+
+    t->ctrls = malloc(buckets_size);
+    t->buckets = malloc(sizeof(jk_hash_entry_t) * buckets_size);
+
+    if (NULL == t->ctrls || NULL == t->buckets) {
+        if (t->ctrls) free(t->ctrls);
+        if (t->buckets) free(t->buckets);
+        return -1;
+    }
+
+    memset(t->ctrls, JK_HASH_CTRL_EMPTY, buckets_size);
+
+    t->buckets_size = buckets_size;
+
+    return 0;
+}
+
+
+static void jk_hash_table_destroy(jk_hash_t *o, jk_hash_table_t *t)
 {
-    if (init_buckets < JK_HASH_BUCKETS_MIN_SIZE) {
-        init_buckets = JK_HASH_BUCKETS_MIN_SIZE;
+    unsigned int i;
+
+    for (i = 0; i < t->buckets_size; i++) {
 
-    } else if (init_buckets > JK_HASH_BUCKETS_MAX_SIZE) {
-        init_buckets = JK_HASH_BUCKETS_MAX_SIZE;
+        if (t->ctrls[i] & 0x80) { /* empty or deleted */
+            continue;
+        }
+
+        if (o->free) {
+            o->free(t->buckets[i].data);
+        }
+
+        if (!o->borrow_keys) {
+            free(t->buckets[i].key);
+        }
     }
 
-    o->buckets = calloc(1, sizeof(void *) * init_buckets);
-    if (NULL == o->buckets) {
+    free(t->ctrls);
+    free(t->buckets);
+}
+
+
+int jk_hash_init(jk_hash_t *o, unsigned int init_buckets,
+    jk_hash_hash_fn *hash, jk_hash_free_fn *free)
+{
+    if (jk_hash_table_init(&o->ht[0], init_buckets) == -1) {
         return -1;
     }
 
@@ -72,8 +287,10 @@ int jk_hash_init(jk_hash_t *o, unsigned int init_buckets,
 
     o->hash = hash;
     o->free = free;
-    o->buckets_size = init_buckets;
+    o->borrow_keys = 0;
     o->elm_nums = 0;
+    o->del_nums = 0;
+    o->rehash_idx = -1;
 
     return 0;
 }
@@ -98,187 +315,268 @@ jk_hash_t *jk_hash_new(unsigned int init_buckets,
 }
 
 
+/*
+ * Store the caller's key pointer instead of a copy, the key must
+ * live until the entry was removed (e.g. the key was embedded in
+ * the value). Must be called before any insertion.
+ */
+void jk_hash_borrow_keys(jk_hash_t *o)
+{
+    o->borrow_keys = 1;
+}
+
+
+/*
+ * Calculate hash value by default hash function, so the caller
+ * can carry it through the *_hash() functions.
+ */
+uint64_t jk_hash_calc(char *key, int klen)
+{
+    return jk_hash_default_hash(key, klen);
+}
+
+
 int jk_hash_find(jk_hash_t *o, char *key, int klen, void **ret)
 {
-    jk_hash_entry_t *e;
-    long hashval = o->hash(key, klen);
-    int index = hashval % o->buckets_size;
+    return jk_hash_find_hash(o, key, klen, o->hash(key, klen), ret);
+}
 
-    e = o->buckets[index];
-    while (e) {
-        if (e->hashval == hashval && e->klen == klen &&
-            !strncmp(e->key, key, klen))
-        {
-            if (ret) {
-                *ret = e->data;
-            }
-            return JK_HASH_OK;
-        }
-        e = e->next;
+
+int jk_hash_find_hash(jk_hash_t *o, char *key, int klen,
+    uint64_t hashval, void **ret)
+{
+    jk_hash_table_t *t;
+    int index;
+
+    t = jk_hash_locate(o, hashval, key, klen, &index);
+    if (t == NULL) {
+        return JK_HASH_ERR;
     }
-    return JK_HASH_ERR;
+
+    if (ret) {
+        *ret = t->buckets[index].data;
+    }
+
+    return JK_HASH_OK;
 }
 
 
 int jk_hash_insert(jk_hash_t *o, char *key, int klen, void *data, int replace)
 {
-    jk_hash_entry_t *en, **ei;
-    long hashval = o->hash(key, klen);
-    int index = hashval % o->buckets_size;
+    return jk_hash_insert_hash(o, key, klen, o->hash(key, klen),
+                               data, replace);
+}
 
-    ei = (jk_hash_entry_t **)&o->buckets[index];
 
-    while (*ei) {
-        if ((*ei)->hashval == hashval && (*ei)->klen == klen &&
-            !strncmp((*ei)->key, key, klen)) /* found the key */
-        {
-            if (replace) {
-                if (o->free) {
-                    o->free((*ei)->data);
-                }
-                (*ei)->data = data;
-                return JK_HASH_OK;
+int jk_hash_insert_hash(jk_hash_t *o, char *key, int klen,
+    uint64_t hashval, void *data, int replace)
+{
+    jk_hash_table_t *t;
+    jk_hash_entry_t *e;
+    unsigned int size;
+    int index;
+    char *nkey;
+
+    t = jk_hash_locate(o, hashval, key, klen, &index);
+
+    if (t != NULL) { /* found the key */
+        e = &t->buckets[index];
+
+        if (replace) {
+            if (o->free) {
+                o->free(e->data);
             }
-            return JK_HASH_DUPLICATE_KEY;
+            e->data = data;
+            if (o->borrow_keys) { /* Old key may go with old value */
+                e->key = key;
+            }
+            return JK_HASH_OK;
         }
-        ei = &((*ei)->next);
+        return JK_HASH_DUPLICATE_KEY;
     }
 
-    en = malloc(sizeof(*en) + klen);
-    if (NULL == en) {
-        return JK_HASH_ERR;
+    t = &o->ht[0];
+
+    /* Keep load factor (include deleted buckets) under 7/8 */
+    if ((o->elm_nums + o->del_nums + 1) * 8 > t->buckets_size * 7) {
+
+        size = t->buckets_size;
+
+        /* Grow when half full, otherwise only clean deleted buckets */
+        if ((o->elm_nums + 1) * 2 > size) {
+            size <<= 1;
+        }
+
+        if (size > JK_HASH_BUCKETS_MAX_SIZE
+            || jk_hash_rehash(o, size) == -1)
+        {
+            return JK_HASH_ERR;
+        }
     }
 
-    en->hashval = hashval;
-    en->klen = klen;
-    en->data = data;
-    en->next = NULL;
+    if (o->borrow_keys) {
+        nkey = key;
 
-    memcpy(en->key, key, klen);
+    } else {
+        nkey = malloc(klen);
+        if (NULL == nkey) {
+            return JK_HASH_ERR;
+        }
 
-    *ei = en; /* append to the last of hash list */
+        memcpy(nkey, key, klen);
+    }
 
-    o->elm_nums++;
+    index = jk_hash_find_free(t, hashval);
 
-    if (o->elm_nums * 1.5 > o->buckets_size) {
-        jk_hash_rehash(o);
+    if (t->ctrls[index] == JK_HASH_CTRL_DELETED) {
+        o->del_nums--;
     }
 
+    t->ctrls[index] = JK_HASH_H2(hashval);
+
+    e = &t->buckets[index];
+
+    e->hashval = hashval;
+    e->klen = klen;
+    e->key = nkey;
+    e->data = data;
+
+    o->elm_nums++;
+
     return JK_HASH_OK;
 }
 
 
 int jk_hash_remove(jk_hash_t *o, char *key, int klen)
 {
-    jk_hash_entry_t *e, *p;
-    long hashval = o->hash(key, klen);
-    int index = hashval % o->buckets_size;
+    return jk_hash_remove_hash(o, key, klen, o->hash(key, klen));
+}
 
-    p = NULL;
-    e = o->buckets[index];
 
-    while (e) {
-        if (e->hashval == hashval && e->klen == klen &&
-            !strncmp(e->key, key, klen))
-        {
-            break;
-        }
-        p = e;
-        e = e->next;
-    }
+int jk_hash_remove_hash(jk_hash_t *o, char *key, int klen,
+    uint64_t hashval)
+{
+    jk_hash_table_t *t;
+    jk_hash_entry_t *e;
+    unsigned char *group;
+    int index;
 
-    if (!e) { /* not found */
+    t = jk_hash_locate(o, hashval, key, klen, &index);
+    if (t == NULL) { /* not found */
         return JK_HASH_ERR;
     }
 
-    if (!p) {
-        o->buckets[index] = e->next;
-    } else {
-        p->next = e->next;
-    }
+    e = &t->buckets[index];
 
     if (o->free) {
         o->free(e->data);
     }
 
-    free(e);
+    if (!o->borrow_keys) {
+        free(e->key);
+    }
+
     o->elm_nums--;
 
+    /* The old table only needs to keep probe chains */
+    if (t == &o->ht[1]) {
+        t->ctrls[index] = JK_HASH_CTRL_DELETED;
+        return JK_HASH_OK;
+    }
+
+    /* If the group has empty bucket, no probe passed through it */
+    group = t->ctrls + (index & ~(JK_HASH_GROUP_SIZE - 1));
+
+    if (jk_hash_group_match(group, JK_HASH_CTRL_EMPTY)) {
+        t->ctrls[index] = JK_HASH_CTRL_EMPTY;
+    } else {
+        t->ctrls[index] = JK_HASH_CTRL_DELETED;
+        o->del_nums++;
+    }
+
     return JK_HASH_OK;
 }
 
 
-static void jk_hash_rehash(jk_hash_t *o)
+/*
+ * Move buckets from old table to new table. The moved buckets
+ * were marked deleted (not empty) to keep the probe chains of
+ * old table unbroken.
+ */
+static void jk_hash_rehash_step(jk_hash_t *o, unsigned int buckets)
 {
-    jk_hash_t new_htb;
-    unsigned int buckets_size;
-    jk_hash_entry_t *e, *next;
-    int i, index;
-
-    /* find new buckets size */
-    for (i = 0; jk_hash_buckets_size[i] != 0; i++) {
-        if (jk_hash_buckets_size[i] > o->buckets_size) {
-            break;
-        }
+    jk_hash_table_t *nt = &o->ht[0], *ot = &o->ht[1];
+    unsigned int i, end, index;
+
+    end = o->rehash_idx + buckets;
+    if (end > ot->buckets_size) {
+        end = ot->buckets_size;
     }
 
-    if (jk_hash_buckets_size[i] > 0) {
-        buckets_size = jk_hash_buckets_size[i];
-    } else {
-        buckets_size = jk_hash_buckets_size[i-1];
+    for (i = o->rehash_idx; i < end; i++) {
+
+        if (ot->ctrls[i] & 0x80) { /* empty or deleted */
+            continue;
+        }
+
+        index = jk_hash_find_free(nt, ot->buckets[i].hashval);
+
+        if (nt->ctrls[index] == JK_HASH_CTRL_DELETED) {
+            o->del_nums--;
+        }
+
+        nt->ctrls[index] = ot->ctrls[i];
+        nt->buckets[index] = ot->buckets[i];
+
+        ot->ctrls[i] = JK_HASH_CTRL_DELETED;
     }
 
-    /* if new buckets size equls old buckets size,
-     * or init new hashtable failed, return. */
-    if (buckets_size == o->buckets_size ||
-        jk_hash_init(&new_htb, buckets_size, NULL, NULL) == -1) {
-        return;
+    o->rehash_idx = end;
+
+    if (end == ot->buckets_size) { /* Rehash finished */
+        free(ot->ctrls);
+        free(ot->buckets);
+        o->rehash_idx = -1;
     }
+}
 
-    for (i = 0; i < o->buckets_size; i++) {
 
-        e = o->buckets[i];
-        while (e) {
-            next = e->next; /* next process entry */
+/*
+ * Begin to rehash. The new table has room for all entries
+ * of old table, so the migration always finished before
+ * the new table was full.
+ */
+static int jk_hash_rehash(jk_hash_t *o, unsigned int buckets_size)
+{
+    jk_hash_table_t nt;
 
-            index = e->hashval % new_htb.buckets_size;
-            e->next = new_htb.buckets[index];
-            new_htb.buckets[index] = e;
+    /* Previous rehash was not finished (not often) */
+    if (o->rehash_idx != -1) {
+        jk_hash_rehash_step(o, o->ht[1].buckets_size);
+    }
 
-            e = next;
-        }
+    if (jk_hash_table_init(&nt, buckets_size) == -1) {
+        return -1;
     }
 
-    free(o->buckets); /* free old buckets */
+    o->ht[1] = o->ht[0];
+    o->ht[0] = nt;
 
-    o->buckets = new_htb.buckets;
-    o->buckets_size = new_htb.buckets_size;
+    o->del_nums = 0;
+    o->rehash_idx = 0;
 
-    return;
+    return 0;
 }
 
 
 void jk_hash_destroy(jk_hash_t *o)
 {
-    jk_hash_entry_t *e, *next;
-    int i;
-
-    for (i = 0; i < o->buckets_size; i++) {
+    jk_hash_table_destroy(o, &o->ht[0]);
 
-        e = o->buckets[i];
-
-        while (e) {
-            next = e->next;
-            if (o->free) {
-                o->free(e->data);
-            }
-            free(e);
-            e = next;
-        }
+    if (o->rehash_idx != -1) {
+        jk_hash_table_destroy(o, &o->ht[1]);
     }
 
-    free(o->buckets);
-
     return;
 }
 
@@ -21,42 +21,69 @@
 #ifndef __JK_HASH_H
 #define __JK_HASH_H
 
+#include <stdint.h>
+
 #define  JK_HASH_OK              (0)
 #define  JK_HASH_ERR             (-1)
 #define  JK_HASH_DUPLICATE_KEY   (-2)
 
-#define  JK_HASH_BUCKETS_MIN_SIZE   7
-#define  JK_HASH_BUCKETS_MAX_SIZE   2147483647
+#define  JK_HASH_GROUP_SIZE         16
+#define  JK_HASH_REHASH_STEP        32  /* Buckets migrated per operation */
+#define  JK_HASH_BUCKETS_MIN_SIZE   16
+#define  JK_HASH_BUCKETS_MAX_SIZE   1073741824
 
-typedef long jk_hash_hash_fn(char *, int);
+typedef uint64_t jk_hash_hash_fn(char *, int);
 typedef void jk_hash_free_fn(void *);
 
+typedef struct jk_hash_entry_s {
+    uint64_t hashval;
+    int klen;
+    char *key;
+    void *data;
+} jk_hash_entry_t;
+
+typedef struct jk_hash_table_s {
+    unsigned char *ctrls;
+    jk_hash_entry_t *buckets;
+    unsigned int buckets_size;  /* Power of two */
+} jk_hash_table_t;
+
+/*
+ * Open addressing hash table, every bucket has a control byte
+ * which holds the low 7 bits of hash value (or empty/deleted),
+ * buckets were probed by group of 16 control bytes.
+ *
+ * When growing, ht[0] is the new table and ht[1] is the old one,
+ * every operation moves a few buckets from ht[1] to ht[0].
+ */
 typedef struct jk_hash_s {
     jk_hash_hash_fn *hash;
     jk_hash_free_fn *free;
-    void **buckets;
-    unsigned int buckets_size;
+    int borrow_keys;            /* Keys were owned by values, not copied */
+    jk_hash_table_t ht[2];
     unsigned int elm_nums;
+    unsigned int del_nums;      /* Deleted buckets of ht[0] */
+    int rehash_idx;             /* -1 when not rehashing */
 } jk_hash_t;
 
-typedef struct jk_hash_entry_s jk_hash_entry_t;
-
-struct jk_hash_entry_s {
-    int hashval;
-    int klen;
-    void *data;
-    jk_hash_entry_t *next;
-    char key[0];
-};
-
 
 int jk_hash_init(jk_hash_t *o, unsigned int init_buckets, jk_hash_hash_fn *hash,
     jk_hash_free_fn *free);
 jk_hash_t *jk_hash_new(unsigned int init_buckets, jk_hash_hash_fn *hash,
     jk_hash_free_fn *free);
+uint64_t jk_hash_calc(char *key, int klen);
 int jk_hash_find(jk_hash_t *o, char *key, int klen, void **ret);
 int jk_hash_insert(jk_hash_t *o, char *key, int klen, void *data, int replace);
 int jk_hash_remove(jk_hash_t *o, char *key, int klen);
+
+/* The hash value must be calculated by the table's hash function */
+int jk_hash_find_hash(jk_hash_t *o, char *key, int klen,
+    uint64_t hashval, void **ret);
+int jk_hash_insert_hash(jk_hash_t *o, char *key, int klen,
+    uint64_t hashval, void *data, int replace);
+int jk_hash_remove_hash(jk_hash_t *o, char *key, int klen,
+    uint64_t hashval);
+void jk_hash_borrow_keys(jk_hash_t *o);
 void jk_hash_destroy(jk_hash_t *o);
 void jk_hash_free(jk_hash_t *o);
 
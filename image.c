@@ -0,0 +1,934 @@
+/*
+ * Bolt - The Realtime Image Compress System
+ * Copyright (c) 2015 - 2016, Liexusong <280259971@qq.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+#include <jerror.h>
+#include "bolt.h"
+#include "image.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) \
+    && defined(__GNUC__) && !defined(BOLT_NO_SIMD)
+#define BOLT_HAVE_SIMD  1
+#include <immintrin.h>
+#endif
+
+#define BOLT_FILTER_BITS   14  /* Fixed-point precision of filter weights */
+#define BOLT_FILTER_CACHE  16  /* Filter tables were cached by every thread */
+#define BOLT_JPEG_FLUSH    16384  /* Encoded bytes were passed to writer */
+
+#if defined(BOLT_HAVE_WEBP)
+#include <webp/encode.h>
+#endif
+
+/*
+ * Native image pipeline, decode JPEG by libjpeg(-turbo) with DCT
+ * scaling, resize RGB pixels and encode directly, for the common
+ * conversions which need not pay the cost of MagickWand.
+ */
+
+typedef struct {
+    struct jpeg_error_mgr pub;
+    jmp_buf jump;
+    char *path;
+} bolt_jpeg_error_t;
+
+static void
+bolt_jpeg_error_exit(j_common_ptr cinfo)
+{
+    bolt_jpeg_error_t *err = (bolt_jpeg_error_t *)cinfo->err;
+    char buf[JMSG_LENGTH_MAX];
+
+    (*cinfo->err->format_message)(cinfo, buf);
+
+    bolt_log(BOLT_LOG_DEBUG, "libjpeg error `%s': %s",
+             err->path ? err->path : "-", buf);
+
+    longjmp(err->jump, 1);
+}
+
+static void
+bolt_jpeg_output_message(j_common_ptr cinfo)
+{
+    /* Warnings of corrupt data were ignored like ImageMagick does */
+}
+
+int
+bolt_image_decode_jpeg(char *path, int hint_width, int hint_height,
+    bolt_image_t *img)
+{
+    struct jpeg_decompress_struct cinfo;
+    bolt_jpeg_error_t jerr;
+    JSAMPROW row;
+    FILE *fp;
+    int denom;
+
+    img->pixels = NULL;
+
+    fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return -1;
+    }
+
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = bolt_jpeg_error_exit;
+    jerr.pub.output_message = bolt_jpeg_output_message;
+    jerr.path = path;
+
+    if (setjmp(jerr.jump)) {
+        jpeg_destroy_decompress(&cinfo);
+        fclose(fp);
+        if (img->pixels) {
+            free(img->pixels);
+            img->pixels = NULL;
+        }
+        return -1;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_stdio_src(&cinfo, fp);
+    jpeg_read_header(&cinfo, TRUE);
+
+    /* CMYK images were left to ImageMagick */
+    if (cinfo.jpeg_color_space != JCS_YCbCr
+        && cinfo.jpeg_color_space != JCS_GRAYSCALE
+        && cinfo.jpeg_color_space != JCS_RGB)
+    {
+        jpeg_destroy_decompress(&cinfo);
+        fclose(fp);
+        return -1;
+    }
+
+    cinfo.out_color_space = JCS_RGB;
+
+    /* DCT scaling, largest 1/denom keeps image not smaller than hint */
+
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = 1;
+
+    if (hint_width > 0 && hint_height > 0) {
+        for (denom = 8; denom > 1; denom >>= 1) {
+            if ((int)((cinfo.image_width + denom - 1) / denom) >= hint_width
+                && (int)((cinfo.image_height + denom - 1) / denom)
+                   >= hint_height)
+            {
+                cinfo.scale_denom = denom;
+                break;
+            }
+        }
+    }
+
+    jpeg_start_decompress(&cinfo);
+
+    img->width = cinfo.output_width;
+    img->height = cinfo.output_height;
+    img->channels = cinfo.output_components;
+
+    img->pixels = malloc((size_t)img->width * img->height * img->channels
+                         + BOLT_IMAGE_PADDING);
+    if (img->pixels == NULL) {
+        jpeg_destroy_decompress(&cinfo);
+        fclose(fp);
+        return -1;
+    }
+
+    while (cinfo.output_scanline < cinfo.output_height) {
+        row = img->pixels
+            + (size_t)cinfo.output_scanline * img->width * img->channels;
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+
+    fclose(fp);
+
+    return 0;
+}
+
+/*
+ * Catmull-Rom filter, the same as CatromFilter of ImageMagick
+ */
+static float
+bolt_image_catrom(float x)
+{
+    if (x < 0.0f) {
+        x = -x;
+    }
+
+    if (x < 1.0f) {
+        return (1.5f * x - 2.5f) * x * x + 1.0f;
+    }
+
+    if (x < 2.0f) {
+        return ((-0.5f * x + 2.5f) * x - 4.0f) * x + 2.0f;
+    }
+
+    return 0.0f;
+}
+
+/*
+ * Fixed-point contributions of source pixels for every output pixel in
+ * one axis. The taps out of image were folded into the edge pixels, so
+ * start + taps never exceeds in_size and passes need not clamp.
+ */
+typedef struct {
+    int in_size;
+    int out_size;
+    int taps;           /* Source pixels of one output pixel */
+    int *start;         /* out_size */
+    short *weights;     /* out_size * taps, sum is 1 << BITS */
+    unsigned long last; /* LRU clock */
+} bolt_filter_t;
+
+static __thread bolt_filter_t bolt_filter_cache[BOLT_FILTER_CACHE];
+static __thread unsigned long bolt_filter_clock;
+
+static int
+bolt_image_filter_init(bolt_filter_t *f, int in_size, int out_size)
+{
+    float scale = (float)in_size / (float)out_size;
+    float fscale = scale > 1.0f ? scale : 1.0f;
+    float center, sum, *fw;
+    int i, j, k, left, start, ntaps, taps, total, maxk;
+    short *w;
+
+    ntaps = (int)(2.0f * fscale) * 2 + 2;
+    taps = ntaps < in_size ? ntaps : in_size;
+
+    f->start = malloc(out_size * sizeof(int));
+    f->weights = calloc((size_t)out_size * taps, sizeof(short));
+    fw = malloc(taps * sizeof(float));
+
+    if (!f->start || !f->weights || !fw) {
+        free(f->start);
+        free(f->weights);
+        free(fw);
+        return -1;
+    }
+
+    for (i = 0; i < out_size; i++) {
+
+        center = ((float)i + 0.5f) * scale - 0.5f;
+        left = (int)floorf(center - 2.0f * fscale + 1.0f);
+
+        start = left < 0 ? 0 : left;
+        if (start > in_size - taps) {
+            start = in_size - taps;
+        }
+
+        for (j = 0; j < taps; j++) {
+            fw[j] = 0.0f;
+        }
+
+        sum = 0.0f;
+
+        for (j = 0; j < ntaps; j++) {
+            float v = bolt_image_catrom(((float)(left + j) - center) / fscale);
+
+            k = left + j;
+            k = k < 0 ? 0 : (k >= in_size ? in_size - 1 : k);
+
+            fw[k - start] += v;
+            sum += v;
+        }
+
+        /* Quantize, the rounding error goes to the biggest tap */
+
+        w = f->weights + (size_t)i * taps;
+        total = 0;
+        maxk = 0;
+
+        for (j = 0; j < taps; j++) {
+            w[j] = (short)lrintf(fw[j] / sum * (1 << BOLT_FILTER_BITS));
+            total += w[j];
+
+            if (w[j] > w[maxk]) {
+                maxk = j;
+            }
+        }
+
+        w[maxk] += (1 << BOLT_FILTER_BITS) - total;
+
+        f->start[i] = start;
+    }
+
+    free(fw);
+
+    f->in_size = in_size;
+    f->out_size = out_size;
+    f->taps = taps;
+
+    return 0;
+}
+
+/*
+ * Get filter table from thread's cache, the same sizes were
+ * requested again and again by thumbnails.
+ */
+static bolt_filter_t *
+bolt_image_get_filter(int in_size, int out_size)
+{
+    bolt_filter_t *f, *victim = NULL;
+    int i;
+
+    for (i = 0; i < BOLT_FILTER_CACHE; i++) {
+
+        f = &bolt_filter_cache[i];
+
+        if (f->weights && f->in_size == in_size && f->out_size == out_size) {
+            f->last = ++bolt_filter_clock;
+            return f;
+        }
+
+        if (victim == NULL || f->last < victim->last) {
+            victim = f;
+        }
+    }
+
+    if (victim->weights) {
+        free(victim->start);
+        free(victim->weights);
+        victim->weights = NULL;
+    }
+
+    if (bolt_image_filter_init(victim, in_size, out_size) == -1) {
+        victim->weights = NULL;
+        return NULL;
+    }
+
+    victim->last = ++bolt_filter_clock;
+
+    return victim;
+}
+
+static inline unsigned char
+bolt_image_pixel(int v)
+{
+    v = (v + (1 << (BOLT_FILTER_BITS - 1))) >> BOLT_FILTER_BITS;
+
+    return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+/*
+ * Horizontal pass of rows, src is src_w pixels each row
+ * and dst is f->out_size pixels each row
+ */
+static void
+bolt_resample_h_c(unsigned char *src, int src_w, int rows,
+    unsigned char *dst, int ch, bolt_filter_t *f)
+{
+    unsigned char *srow, *drow, *p;
+    short *w;
+    int x, y, j, k, acc;
+
+    for (y = 0; y < rows; y++) {
+
+        srow = src + (size_t)y * src_w * ch;
+        drow = dst + (size_t)y * f->out_size * ch;
+
+        for (x = 0; x < f->out_size; x++) {
+
+            w = f->weights + (size_t)x * f->taps;
+            p = srow + f->start[x] * ch;
+
+            for (k = 0; k < ch; k++) {
+                acc = 0;
+                for (j = 0; j < f->taps; j++) {
+                    acc += w[j] * p[j * ch + k];
+                }
+                drow[x * ch + k] = bolt_image_pixel(acc);
+            }
+        }
+    }
+}
+
+/*
+ * Vertical pass, every row of src and dst is stride bytes
+ */
+static void
+bolt_resample_v_c(unsigned char *src, int stride,
+    unsigned char *dst, bolt_filter_t *f)
+{
+    unsigned char *p, *drow;
+    short *w;
+    int x, y, j, acc;
+
+    for (y = 0; y < f->out_size; y++) {
+
+        drow = dst + (size_t)y * stride;
+        w = f->weights + (size_t)y * f->taps;
+        p = src + (size_t)f->start[y] * stride;
+
+        for (x = 0; x < stride; x++) {
+            acc = 0;
+            for (j = 0; j < f->taps; j++) {
+                acc += w[j] * p[(size_t)j * stride + x];
+            }
+            drow[x] = bolt_image_pixel(acc);
+        }
+    }
+}
+
+#if defined(BOLT_HAVE_SIMD)
+
+static inline int
+bolt_load32(unsigned char *p)
+{
+    int v;
+
+    memcpy(&v, p, 4); /* Read one more byte of RGB, see BOLT_IMAGE_PADDING */
+
+    return v;
+}
+
+static inline int
+bolt_weight_pair(short w0, short w1)
+{
+    return (unsigned short)w0 | ((unsigned int)(unsigned short)w1 << 16);
+}
+
+/*
+ * SSE2 horizontal pass, pixels of two taps were interleaved to
+ * 16 bits (r0 r1 g0 g1 b0 b1 a0 a1) and multiplied by pmaddwd.
+ */
+__attribute__((target("sse2")))
+static inline __m128i
+bolt_resample_h_pixel_sse2(unsigned char *p, short *w, int taps, int ch)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i acc = _mm_set1_epi32(1 << (BOLT_FILTER_BITS - 1));
+    __m128i p0, p1, pp;
+    int j;
+
+    for (j = 0; j + 1 < taps; j += 2) {
+        p0 = _mm_cvtsi32_si128(bolt_load32(p + j * ch));
+        p1 = _mm_cvtsi32_si128(bolt_load32(p + (j + 1) * ch));
+        pp = _mm_unpacklo_epi8(_mm_unpacklo_epi8(p0, p1), zero);
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(pp,
+                  _mm_set1_epi32(bolt_weight_pair(w[j], w[j + 1]))));
+    }
+
+    if (j < taps) {
+        p0 = _mm_cvtsi32_si128(bolt_load32(p + j * ch));
+        pp = _mm_unpacklo_epi8(_mm_unpacklo_epi8(p0, zero), zero);
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(pp,
+                  _mm_set1_epi32(bolt_weight_pair(w[j], 0))));
+    }
+
+    return _mm_srai_epi32(acc, BOLT_FILTER_BITS);
+}
+
+__attribute__((target("sse2")))
+static void
+bolt_resample_h_sse2(unsigned char *src, int src_w, int rows,
+    unsigned char *dst, int ch, bolt_filter_t *f)
+{
+    unsigned char *srow, *drow;
+    __m128i acc;
+    int x, y, v;
+
+    for (y = 0; y < rows; y++) {
+
+        srow = src + (size_t)y * src_w * ch;
+        drow = dst + (size_t)y * f->out_size * ch;
+
+        for (x = 0; x < f->out_size; x++) {
+            acc = bolt_resample_h_pixel_sse2(srow + f->start[x] * ch,
+                                             f->weights + (size_t)x * f->taps,
+                                             f->taps, ch);
+            acc = _mm_packs_epi32(acc, acc);
+            v = _mm_cvtsi128_si32(_mm_packus_epi16(acc, acc));
+            memcpy(drow + x * ch, &v, ch);
+        }
+    }
+}
+
+/*
+ * SSE2 vertical pass, 8 bytes of two rows each loop
+ */
+__attribute__((target("sse2")))
+static void
+bolt_resample_v_sse2(unsigned char *src, int stride,
+    unsigned char *dst, bolt_filter_t *f)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i round = _mm_set1_epi32(1 << (BOLT_FILTER_BITS - 1));
+    __m128i lo, hi, a, b, ab, ww;
+    unsigned char *p, *drow;
+    short *w;
+    int x, y, j, acc;
+
+    for (y = 0; y < f->out_size; y++) {
+
+        drow = dst + (size_t)y * stride;
+        w = f->weights + (size_t)y * f->taps;
+        p = src + (size_t)f->start[y] * stride;
+
+        for (x = 0; x + 8 <= stride; x += 8) {
+
+            lo = round;
+            hi = round;
+
+            for (j = 0; j < f->taps; j += 2) {
+                a = _mm_loadl_epi64((__m128i *)(p + (size_t)j * stride + x));
+
+                if (j + 1 < f->taps) {
+                    b = _mm_loadl_epi64((__m128i *)
+                                        (p + (size_t)(j + 1) * stride + x));
+                    ww = _mm_set1_epi32(bolt_weight_pair(w[j], w[j + 1]));
+                } else {
+                    b = zero;
+                    ww = _mm_set1_epi32(bolt_weight_pair(w[j], 0));
+                }
+
+                ab = _mm_unpacklo_epi8(a, b);
+                lo = _mm_add_epi32(lo,
+                         _mm_madd_epi16(_mm_unpacklo_epi8(ab, zero), ww));
+                hi = _mm_add_epi32(hi,
+                         _mm_madd_epi16(_mm_unpackhi_epi8(ab, zero), ww));
+            }
+
+            lo = _mm_srai_epi32(lo, BOLT_FILTER_BITS);
+            hi = _mm_srai_epi32(hi, BOLT_FILTER_BITS);
+            lo = _mm_packs_epi32(lo, hi);
+
+            _mm_storel_epi64((__m128i *)(drow + x),
+                             _mm_packus_epi16(lo, lo));
+        }
+
+        for (; x < stride; x++) {
+            acc = 0;
+            for (j = 0; j < f->taps; j++) {
+                acc += w[j] * p[(size_t)j * stride + x];
+            }
+            drow[x] = bolt_image_pixel(acc);
+        }
+    }
+}
+
+/*
+ * AVX2 horizontal pass, two output pixels each loop, one per lane
+ */
+__attribute__((target("avx2")))
+static void
+bolt_resample_h_avx2(unsigned char *src, int src_w, int rows,
+    unsigned char *dst, int ch, bolt_filter_t *f)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i acc, pp, ww;
+    __m128i p0, p1, q0, q1, r;
+    unsigned char *srow, *drow, *pa, *pb;
+    short *wa, *wb;
+    int x, y, j, v;
+
+    for (y = 0; y < rows; y++) {
+
+        srow = src + (size_t)y * src_w * ch;
+        drow = dst + (size_t)y * f->out_size * ch;
+
+        for (x = 0; x + 2 <= f->out_size; x += 2) {
+
+            pa = srow + f->start[x] * ch;
+            pb = srow + f->start[x + 1] * ch;
+            wa = f->weights + (size_t)x * f->taps;
+            wb = wa + f->taps;
+
+            acc = _mm256_set1_epi32(1 << (BOLT_FILTER_BITS - 1));
+
+            for (j = 0; j < f->taps; j += 2) {
+
+                p0 = _mm_cvtsi32_si128(bolt_load32(pa + j * ch));
+                q0 = _mm_cvtsi32_si128(bolt_load32(pb + j * ch));
+
+                if (j + 1 < f->taps) {
+                    p1 = _mm_cvtsi32_si128(bolt_load32(pa + (j + 1) * ch));
+                    q1 = _mm_cvtsi32_si128(bolt_load32(pb + (j + 1) * ch));
+                    ww = _mm256_setr_epi32(
+                        bolt_weight_pair(wa[j], wa[j + 1]),
+                        bolt_weight_pair(wa[j], wa[j + 1]),
+                        bolt_weight_pair(wa[j], wa[j + 1]),
+                        bolt_weight_pair(wa[j], wa[j + 1]),
+                        bolt_weight_pair(wb[j], wb[j + 1]),
+                        bolt_weight_pair(wb[j], wb[j + 1]),
+                        bolt_weight_pair(wb[j], wb[j + 1]),
+                        bolt_weight_pair(wb[j], wb[j + 1]));
+                } else {
+                    p1 = _mm_setzero_si128();
+                    q1 = _mm_setzero_si128();
+                    ww = _mm256_setr_epi32(
+                        bolt_weight_pair(wa[j], 0), bolt_weight_pair(wa[j], 0),
+                        bolt_weight_pair(wa[j], 0), bolt_weight_pair(wa[j], 0),
+                        bolt_weight_pair(wb[j], 0), bolt_weight_pair(wb[j], 0),
+                        bolt_weight_pair(wb[j], 0), bolt_weight_pair(wb[j], 0));
+                }
+
+                pp = _mm256_inserti128_si256(
+                         _mm256_castsi128_si256(_mm_unpacklo_epi8(p0, p1)),
+                         _mm_unpacklo_epi8(q0, q1), 1);
+                pp = _mm256_unpacklo_epi8(pp, zero);
+
+                acc = _mm256_add_epi32(acc, _mm256_madd_epi16(pp, ww));
+            }
+
+            acc = _mm256_srai_epi32(acc, BOLT_FILTER_BITS);
+            acc = _mm256_packs_epi32(acc, acc);
+            acc = _mm256_packus_epi16(acc, acc);
+
+            r = _mm256_castsi256_si128(acc);
+            v = _mm_cvtsi128_si32(r);
+            memcpy(drow + x * ch, &v, ch);
+
+            r = _mm256_extracti128_si256(acc, 1);
+            v = _mm_cvtsi128_si32(r);
+            memcpy(drow + (x + 1) * ch, &v, ch);
+        }
+
+        for (; x < f->out_size; x++) {
+            r = bolt_resample_h_pixel_sse2(srow + f->start[x] * ch,
+                                           f->weights + (size_t)x * f->taps,
+                                           f->taps, ch);
+            r = _mm_packs_epi32(r, r);
+            v = _mm_cvtsi128_si32(_mm_packus_epi16(r, r));
+            memcpy(drow + x * ch, &v, ch);
+        }
+    }
+}
+
+/*
+ * AVX2 vertical pass, 16 bytes of two rows each loop
+ */
+__attribute__((target("avx2")))
+static void
+bolt_resample_v_avx2(unsigned char *src, int stride,
+    unsigned char *dst, bolt_filter_t *f)
+{
+    __m256i round = _mm256_set1_epi32(1 << (BOLT_FILTER_BITS - 1));
+    __m256i lo, hi, ww;
+    __m128i a, b;
+    unsigned char *p, *drow;
+    short *w;
+    int x, y, j, acc;
+
+    for (y = 0; y < f->out_size; y++) {
+
+        drow = dst + (size_t)y * stride;
+        w = f->weights + (size_t)y * f->taps;
+        p = src + (size_t)f->start[y] * stride;
+
+        for (x = 0; x + 16 <= stride; x += 16) {
+
+            lo = round;
+            hi = round;
+
+            for (j = 0; j < f->taps; j += 2) {
+                a = _mm_loadu_si128((__m128i *)(p + (size_t)j * stride + x));
+
+                if (j + 1 < f->taps) {
+                    b = _mm_loadu_si128((__m128i *)
+                                        (p + (size_t)(j + 1) * stride + x));
+                    ww = _mm256_set1_epi32(bolt_weight_pair(w[j], w[j + 1]));
+                } else {
+                    b = _mm_setzero_si128();
+                    ww = _mm256_set1_epi32(bolt_weight_pair(w[j], 0));
+                }
+
+                lo = _mm256_add_epi32(lo, _mm256_madd_epi16(
+                         _mm256_cvtepu8_epi16(_mm_unpacklo_epi8(a, b)), ww));
+                hi = _mm256_add_epi32(hi, _mm256_madd_epi16(
+                         _mm256_cvtepu8_epi16(_mm_unpackhi_epi8(a, b)), ww));
+            }
+
+            lo = _mm256_srai_epi32(lo, BOLT_FILTER_BITS);
+            hi = _mm256_srai_epi32(hi, BOLT_FILTER_BITS);
+
+            /* packs works in lanes, fix the order after it */
+            lo = _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xd8);
+
+            _mm_storeu_si128((__m128i *)(drow + x),
+                             _mm_packus_epi16(_mm256_castsi256_si128(lo),
+                                              _mm256_extracti128_si256(lo, 1)));
+        }
+
+        for (; x < stride; x++) {
+            acc = 0;
+            for (j = 0; j < f->taps; j++) {
+                acc += w[j] * p[(size_t)j * stride + x];
+            }
+            drow[x] = bolt_image_pixel(acc);
+        }
+    }
+}
+
+#endif /* BOLT_HAVE_SIMD */
+
+typedef void (*bolt_resample_h_t)(unsigned char *, int, int,
+    unsigned char *, int, bolt_filter_t *);
+typedef void (*bolt_resample_v_t)(unsigned char *, int,
+    unsigned char *, bolt_filter_t *);
+
+static bolt_resample_h_t bolt_resample_h = bolt_resample_h_c;
+static bolt_resample_v_t bolt_resample_v = bolt_resample_v_c;
+static pthread_once_t bolt_resample_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Select resample passes by CPU features
+ */
+static void
+bolt_resample_init(void)
+{
+#if defined(BOLT_HAVE_SIMD)
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2")) {
+        bolt_resample_h = bolt_resample_h_avx2;
+        bolt_resample_v = bolt_resample_v_avx2;
+        bolt_log(BOLT_LOG_DEBUG, "Resample by AVX2");
+
+    } else if (__builtin_cpu_supports("sse2")) {
+        bolt_resample_h = bolt_resample_h_sse2;
+        bolt_resample_v = bolt_resample_v_sse2;
+        bolt_log(BOLT_LOG_DEBUG, "Resample by SSE2");
+    }
+#endif
+}
+
+/*
+ * Separable resize, horizontal pass into a temporary image
+ * and then vertical pass into destination image
+ */
+int
+bolt_image_resize(bolt_image_t *src, bolt_image_t *dst,
+    int width, int height)
+{
+    bolt_filter_t *hf, *vf;
+    unsigned char *tmp;
+    int ch = src->channels;
+
+    pthread_once(&bolt_resample_once, bolt_resample_init);
+
+    dst->width = width;
+    dst->height = height;
+    dst->channels = ch;
+    dst->pixels = malloc((size_t)width * height * ch + BOLT_IMAGE_PADDING);
+
+    tmp = malloc((size_t)src->height * width * ch + BOLT_IMAGE_PADDING);
+
+    hf = bolt_image_get_filter(src->width, width);
+    vf = bolt_image_get_filter(src->height, height);
+
+    if (!dst->pixels || !tmp || !hf || !vf) {
+        free(dst->pixels);
+        free(tmp);
+        dst->pixels = NULL;
+        return -1;
+    }
+
+    if (ch == 3 || ch == 4) {
+        bolt_resample_h(src->pixels, src->width, src->height, tmp, ch, hf);
+    } else {
+        bolt_resample_h_c(src->pixels, src->width, src->height, tmp, ch, hf);
+    }
+
+    bolt_resample_v(tmp, width * ch, dst->pixels, vf);
+
+    free(tmp);
+
+    return 0;
+}
+
+/*
+ * Destination of encoder, output was saved in a growing buffer which
+ * would be the cache blob, and passed to writer every BOLT_JPEG_FLUSH
+ * bytes, so the clients can receive it while encoding.
+ */
+typedef struct {
+    struct jpeg_destination_mgr pub;
+    unsigned char *buf;
+    size_t size;
+    size_t flushed;
+    bolt_image_writer_t writer;
+    void *arg;
+} bolt_jpeg_dest_t;
+
+static void
+bolt_jpeg_init_destination(j_compress_ptr cinfo)
+{
+    bolt_jpeg_dest_t *dest = (bolt_jpeg_dest_t *)cinfo->dest;
+
+    dest->pub.next_output_byte = dest->buf;
+    dest->pub.free_in_buffer = BOLT_JPEG_FLUSH;
+}
+
+static void
+bolt_jpeg_flush_destination(bolt_jpeg_dest_t *dest, size_t used)
+{
+    if (dest->writer && used > dest->flushed) {
+        dest->writer(dest->arg, (char *)dest->buf + dest->flushed,
+                     used - dest->flushed);
+    }
+
+    dest->flushed = used;
+}
+
+/*
+ * Called when the window was full, next_output_byte may be not
+ * updated by encoder, so the whole window was taken as used.
+ */
+static boolean
+bolt_jpeg_empty_output_buffer(j_compress_ptr cinfo)
+{
+    bolt_jpeg_dest_t *dest = (bolt_jpeg_dest_t *)cinfo->dest;
+    unsigned char *buf;
+    size_t used;
+
+    used = dest->flushed + BOLT_JPEG_FLUSH;
+
+    bolt_jpeg_flush_destination(dest, used);
+
+    if (dest->size - used < BOLT_JPEG_FLUSH) {
+        buf = realloc(dest->buf, dest->size * 2);
+        if (!buf) {
+            ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 10);
+        }
+
+        dest->buf = buf;
+        dest->size *= 2;
+    }
+
+    dest->pub.next_output_byte = dest->buf + used;
+    dest->pub.free_in_buffer = BOLT_JPEG_FLUSH;
+
+    return TRUE;
+}
+
+static void
+bolt_jpeg_term_destination(j_compress_ptr cinfo)
+{
+    bolt_jpeg_dest_t *dest = (bolt_jpeg_dest_t *)cinfo->dest;
+
+    bolt_jpeg_flush_destination(dest,
+        dest->flushed + BOLT_JPEG_FLUSH - dest->pub.free_in_buffer);
+}
+
+char *
+bolt_image_encode_jpeg(bolt_image_t *img, int quality, size_t *size,
+    bolt_image_writer_t writer, void *arg)
+{
+    struct jpeg_compress_struct cinfo;
+    bolt_jpeg_error_t jerr;
+    bolt_jpeg_dest_t dest;
+    JSAMPROW row;
+
+    dest.size = BOLT_JPEG_FLUSH * 4;
+    dest.buf = malloc(dest.size);
+    dest.flushed = 0;
+    dest.writer = writer;
+    dest.arg = arg;
+
+    if (!dest.buf) {
+        return NULL;
+    }
+
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = bolt_jpeg_error_exit;
+    jerr.pub.output_message = bolt_jpeg_output_message;
+    jerr.path = NULL;
+
+    if (setjmp(jerr.jump)) {
+        jpeg_destroy_compress(&cinfo);
+        free(dest.buf);
+        return NULL;
+    }
+
+    jpeg_create_compress(&cinfo);
+
+    dest.pub.init_destination = bolt_jpeg_init_destination;
+    dest.pub.empty_output_buffer = bolt_jpeg_empty_output_buffer;
+    dest.pub.term_destination = bolt_jpeg_term_destination;
+
+    cinfo.dest = &dest.pub;
+
+    cinfo.image_width = img->width;
+    cinfo.image_height = img->height;
+    cinfo.input_components = img->channels;
+    cinfo.in_color_space = img->channels == 1 ? JCS_GRAYSCALE : JCS_RGB;
+
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality > 100 ? 100 : quality, TRUE);
+
+    jpeg_start_compress(&cinfo, TRUE);
+
+    while (cinfo.next_scanline < cinfo.image_height) {
+        row = img->pixels
+            + (size_t)cinfo.next_scanline * img->width * img->channels;
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+
+    *size = dest.flushed;
+
+    return (char *)dest.buf;
+}
+
+#if defined(BOLT_HAVE_WEBP)
+char *
+bolt_image_encode_webp(bolt_image_t *img, int quality, size_t *size)
+{
+    uint8_t *out = NULL;
+    char *blob;
+
+    if (img->channels != 3) {
+        return NULL;
+    }
+
+    *size = WebPEncodeRGB(img->pixels, img->width, img->height,
+                          img->width * 3, (float)quality, &out);
+    if (*size == 0) {
+        return NULL;
+    }
+
+    /* Cache blob was freed by free() */
+    blob = malloc(*size);
+    if (blob) {
+        memcpy(blob, out, *size);
+    }
+
+    WebPFree(out);
+
+    return blob;
+}
+#endif
+
+void
+bolt_image_free(bolt_image_t *img)
+{
+    if (img->pixels) {
+        free(img->pixels);
+        img->pixels = NULL;
+    }
+}
@@ -0,0 +1,28 @@
+#ifndef __BOLT_IMAGE_H
+#define __BOLT_IMAGE_H
+
+/* Pixels buffer has padding bytes, so 4 bytes of RGB pixel can be loaded */
+#define BOLT_IMAGE_PADDING  4
+
+typedef struct {
+    int width;
+    int height;
+    int channels;   /* 3 is RGB, 1 is gray */
+    unsigned char *pixels;
+} bolt_image_t;
+
+int bolt_image_decode_jpeg(char *path, int hint_width, int hint_height,
+    bolt_image_t *img);
+int bolt_image_resize(bolt_image_t *src, bolt_image_t *dst,
+    int width, int height);
+/* Receive encoded data while encoding, the data was not owned by it */
+typedef void (*bolt_image_writer_t)(void *arg, char *data, size_t size);
+
+char *bolt_image_encode_jpeg(bolt_image_t *img, int quality, size_t *size,
+    bolt_image_writer_t writer, void *arg);
+#if defined(BOLT_HAVE_WEBP)
+char *bolt_image_encode_webp(bolt_image_t *img, int quality, size_t *size);
+#endif
+void bolt_image_free(bolt_image_t *img);
+
+#endif
@@ -45,10 +45,10 @@ int bolt_set_nonblock(int fd)
 /************************
  * create listen socket *
  ************************/
-int bolt_listen_socket(char *addr, short port, int nonblock)
+int bolt_listen_socket(char *addr, short port, int nonblock, int reuseport)
 {
     int sock;
-    int flags;
+    int flags = 1;
     struct linger ln = {0, 0};
     struct sockaddr_in si;
 
@@ -60,6 +60,14 @@ int bolt_listen_socket(char *addr, short port, int nonblock)
     setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &flags, sizeof(flags));
     setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &flags, sizeof(flags));
     setsockopt(sock, SOL_SOCKET, SO_LINGER, &ln, sizeof(ln));
+#if defined(SO_REUSEPORT)
+    if (reuseport
+        && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT,
+                      &flags, sizeof(flags)) == -1)
+    {
+        goto err;
+    }
+#endif
 #if !defined(TCP_NOPUSH) && defined(TCP_NODELAY)
     setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &flags, sizeof(flags));
 #endif
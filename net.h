@@ -2,6 +2,6 @@
 #define __BOLT_NET_H
 
 int bolt_set_nonblock(int fd);
-int bolt_listen_socket(char *addr, short port, int nonblock);
+int bolt_listen_socket(char *addr, short port, int nonblock, int reuseport);
 
 #endif
@@ -0,0 +1,205 @@
+/*
+ * Bolt - The Realtime Image Compress System
+ * Copyright (c) 2015 - 2016, Liexusong <280259971@qq.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "bolt.h"
+#include "utils.h"
+#include "numa.h"
+
+#define BOLT_MPOL_PREFERRED  1  /* MPOL_PREFERRED of <numaif.h> */
+
+static int bolt_cpu_node[BOLT_MAX_CPUS];
+
+int bolt_numa_nodes = 1;
+
+/*
+ * Parse CPU list like: "0-3,8,10-11", return number of CPUs
+ */
+int
+bolt_parse_cpus(char *value, int length, int *cpus, int max)
+{
+    char *start = value, *end = value + length, *next, *dash;
+    int first, last, nums = 0;
+
+    while (start < end) {
+
+        for (next = start; next < end && *next != ','; next++);
+
+        for (dash = start; dash < next && *dash != '-'; dash++);
+
+        if (bolt_atoi(start, dash - start, &first) == -1) {
+            return -1;
+        }
+
+        last = first;
+
+        if (dash < next
+            && bolt_atoi(dash + 1, next - dash - 1, &last) == -1)
+        {
+            return -1;
+        }
+
+        if (first < 0 || last < first || last >= BOLT_MAX_CPUS) {
+            return -1;
+        }
+
+        for (; first <= last && nums < max; first++) {
+            cpus[nums++] = first;
+        }
+
+        start = next + 1;
+    }
+
+    return nums;
+}
+
+/*
+ * Read CPUs of every node from sysfs
+ */
+int
+bolt_numa_init()
+{
+    char path[128], buf[1024];
+    int cpus[BOLT_MAX_CPUS];
+    int node, nums, i, len;
+    FILE *fp;
+
+    for (i = 0; i < BOLT_MAX_CPUS; i++) {
+        bolt_cpu_node[i] = 0;
+    }
+
+    bolt_numa_nodes = 1;
+
+    for (node = 0; node < BOLT_MAX_NUMA_NODES; node++) {
+
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/node/node%d/cpulist", node);
+
+        fp = fopen(path, "r");
+        if (fp == NULL) {
+            break;
+        }
+
+        len = 0;
+        if (fgets(buf, sizeof(buf), fp)) {
+            len = strlen(buf);
+            while (len > 0 && (buf[len-1] == '\n' || buf[len-1] == ' ')) {
+                len--;
+            }
+        }
+
+        fclose(fp);
+
+        nums = len > 0 ? bolt_parse_cpus(buf, len, cpus, BOLT_MAX_CPUS) : 0;
+
+        for (i = 0; i < nums; i++) {
+            bolt_cpu_node[cpus[i]] = node;
+        }
+
+        bolt_numa_nodes = node + 1;
+    }
+
+    return 0;
+}
+
+int
+bolt_numa_node_of_cpu(int cpu)
+{
+    if (cpu < 0 || cpu >= BOLT_MAX_CPUS) {
+        return -1;
+    }
+
+    return bolt_cpu_node[cpu];
+}
+
+/*
+ * Node of the CPU which current thread running on
+ */
+int
+bolt_numa_current_node()
+{
+    return bolt_numa_node_of_cpu(sched_getcpu());
+}
+
+int
+bolt_set_affinity(pthread_t tid, int cpu)
+{
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    if (pthread_setaffinity_np(tid, sizeof(set), &set) != 0) {
+        bolt_log(BOLT_LOG_ERROR, "Failed to bind thread to CPU(%d)", cpu);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Alloc memory prefer to the node, it is used by reactors
+ * of the node to send, so kept away from cross node traffic.
+ */
+void *
+bolt_numa_alloc(size_t size, int node)
+{
+    unsigned long mask;
+    void *addr;
+
+    addr = mmap(NULL, size, PROT_READ|PROT_WRITE,
+                MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+        return NULL;
+    }
+
+#if defined(SYS_mbind)
+    /* Unknown node or out of the mask, leave it to the kernel */
+    if (node < 0 || node >= bolt_numa_nodes
+        || node >= (int)(sizeof(mask) * 8))
+    {
+        return addr;
+    }
+
+    mask = 1UL << node;
+
+    if (syscall(SYS_mbind, addr, size, BOLT_MPOL_PREFERRED,
+                &mask, sizeof(mask) * 8, 0) == -1)
+    {
+        bolt_log(BOLT_LOG_DEBUG, "Failed to bind memory to node(%d)", node);
+    }
+#endif
+
+    return addr;
+}
+
+void
+bolt_numa_free(void *addr, size_t size)
+{
+    munmap(addr, size);
+}
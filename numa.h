@@ -0,0 +1,14 @@
+#ifndef __BOLT_NUMA_H
+#define __BOLT_NUMA_H
+
+extern int bolt_numa_nodes;
+
+int bolt_parse_cpus(char *value, int length, int *cpus, int max);
+int bolt_numa_init();
+int bolt_numa_node_of_cpu(int cpu);
+int bolt_numa_current_node();
+int bolt_set_affinity(pthread_t tid, int cpu);
+void *bolt_numa_alloc(size_t size, int node);
+void bolt_numa_free(void *addr, size_t size);
+
+#endif
@@ -0,0 +1,533 @@
+/*
+ * Bolt - The Realtime Image Compress System
+ * Copyright (c) 2015 - 2016, Liexusong <280259971@qq.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdlib.h>
+#include <stdint.h>
+#include "bolt.h"
+#include "cache.h"
+#include "policy.h"
+
+#define BOLT_REGION_NONE       0
+#define BOLT_REGION_WINDOW     1
+#define BOLT_REGION_PROBATION  2
+#define BOLT_REGION_PROTECTED  3
+
+#define BOLT_SKETCH_ITEM_SIZE  16384  /* Expected size of cache */
+#define BOLT_SKETCH_MAX_COUNT  15
+
+/*
+ * Bytes every shard keeps, same as what GC would free to
+ */
+int
+bolt_cache_shard_capacity()
+{
+    return (long long)setting->max_cache * setting->gc_threshold
+           / 100 / service->cache_shards_num;
+}
+
+/* LRU policy */
+
+static int
+bolt_lru_init(bolt_cache_shard_t *shard)
+{
+    return 0;
+}
+
+static void
+bolt_lru_access(bolt_cache_shard_t *shard, uint64_t hashval)
+{
+}
+
+static void
+bolt_lru_insert(bolt_cache_shard_t *shard, bolt_cache_t *cache)
+{
+    list_add_tail(&cache->link, &shard->lru);
+}
+
+static void
+bolt_lru_hit(bolt_cache_shard_t *shard, bolt_cache_t *cache)
+{
+    list_del(&cache->link);
+    list_add_tail(&cache->link, &shard->lru);
+}
+
+static void
+bolt_lru_remove(bolt_cache_shard_t *shard, bolt_cache_t *cache)
+{
+    list_del(&cache->link);
+}
+
+static bolt_cache_t *
+bolt_lru_victim(bolt_cache_shard_t *shard)
+{
+    if (list_empty(&shard->lru)) {
+        return NULL;
+    }
+
+    return list_entry(shard->lru.next, bolt_cache_t, link);
+}
+
+static bolt_cache_policy_t bolt_lru_policy = {
+    "lru",
+    bolt_lru_init,
+    bolt_lru_access,
+    bolt_lru_insert,
+    bolt_lru_hit,
+    bolt_lru_remove,
+    bolt_lru_victim,
+};
+
+/*
+ * W-TinyLFU policy: new caches enter a small LRU window (1% of shard),
+ * the one pushed out of window must be accessed more often than the
+ * victim of main region to be admitted when shard is full. Main region
+ * is a segmented LRU, the probation segment is shard->lru and caches
+ * hit there were promoted to the protected segment (80% of shard).
+ */
+
+static int
+bolt_sketch_init(bolt_sketch_t *sketch, int capacity)
+{
+    unsigned int items = capacity / BOLT_SKETCH_ITEM_SIZE;
+    unsigned int width = 64;
+
+    if (items < 16) {
+        items = 16;
+    }
+
+    while (width < items * 4 && width < (1U << 24)) {
+        width <<= 1;
+    }
+
+    sketch->counters = calloc(width, 1);
+    if (sketch->counters == NULL) {
+        return -1;
+    }
+
+    sketch->mask = width - 1;
+    sketch->additions = 0;
+    sketch->sample = items * 10;
+
+    return 0;
+}
+
+static void
+bolt_sketch_indexes(bolt_sketch_t *sketch, uint64_t hashval,
+    unsigned int *indexes)
+{
+    uint64_t h = hashval * 0x9e3779b97f4a7c15ULL;
+    unsigned int h1 = (unsigned int)h;
+    unsigned int h2 = (unsigned int)(h >> 32) | 1;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        indexes[i] = (h1 + i * h2) & sketch->mask;
+    }
+}
+
+static void
+bolt_sketch_increment(bolt_sketch_t *sketch, uint64_t hashval)
+{
+    unsigned int indexes[4], i;
+    int added = 0;
+
+    bolt_sketch_indexes(sketch, hashval, indexes);
+
+    for (i = 0; i < 4; i++) {
+        if (sketch->counters[indexes[i]] < BOLT_SKETCH_MAX_COUNT) {
+            sketch->counters[indexes[i]]++;
+            added = 1;
+        }
+    }
+
+    if (added && ++sketch->additions >= sketch->sample) {
+
+        for (i = 0; i <= sketch->mask; i++) {
+            sketch->counters[i] >>= 1;
+        }
+
+        sketch->additions >>= 1;
+    }
+}
+
+static int
+bolt_sketch_frequency(bolt_sketch_t *sketch, uint64_t hashval)
+{
+    unsigned int indexes[4], i;
+    int freq = BOLT_SKETCH_MAX_COUNT;
+
+    bolt_sketch_indexes(sketch, hashval, indexes);
+
+    for (i = 0; i < 4; i++) {
+        if (sketch->counters[indexes[i]] < freq) {
+            freq = sketch->counters[indexes[i]];
+        }
+    }
+
+    return freq;
+}
+
+static int
+bolt_tinylfu_init(bolt_cache_shard_t *shard)
+{
+    INIT_LIST_HEAD(&shard->window);
+    INIT_LIST_HEAD(&shard->protected);
+
+    shard->window_size = 0;
+    shard->protected_size = 0;
+
+    return bolt_sketch_init(&shard->sketch, bolt_cache_shard_capacity());
+}
+
+static void
+bolt_tinylfu_access(bolt_cache_shard_t *shard, uint64_t hashval)
+{
+    bolt_sketch_increment(&shard->sketch, hashval);
+}
+
+static bolt_cache_t *
+bolt_tinylfu_main_victim(bolt_cache_shard_t *shard)
+{
+    if (!list_empty(&shard->lru)) {
+        return list_entry(shard->lru.next, bolt_cache_t, link);
+    }
+
+    if (!list_empty(&shard->protected)) {
+        return list_entry(shard->protected.next, bolt_cache_t, link);
+    }
+
+    return NULL;
+}
+
+static bolt_cache_t *
+bolt_tinylfu_victim(bolt_cache_shard_t *shard)
+{
+    bolt_cache_t *victim = bolt_tinylfu_main_victim(shard);
+
+    if (victim == NULL && !list_empty(&shard->window)) {
+        victim = list_entry(shard->window.next, bolt_cache_t, link);
+    }
+
+    return victim;
+}
+
+static void
+bolt_tinylfu_insert(bolt_cache_shard_t *shard, bolt_cache_t *cache)
+{
+    int capacity = bolt_cache_shard_capacity();
+    bolt_cache_t *candidate, *victim;
+
+    cache->region = BOLT_REGION_WINDOW;
+    list_add_tail(&cache->link, &shard->window);
+    shard->window_size += cache->alloc;
+
+    /* The newest one always stays in window */
+
+    while (shard->window_size > capacity / 100
+           && shard->window.next != &cache->link)
+    {
+        candidate = list_entry(shard->window.next, bolt_cache_t, link);
+
+        list_del(&candidate->link);
+        shard->window_size -= candidate->alloc;
+
+        if (shard->memory_usage > capacity) {
+
+            victim = bolt_tinylfu_main_victim(shard);
+
+            if (victim != NULL
+                && bolt_sketch_frequency(&shard->sketch, candidate->hashval)
+                   <= bolt_sketch_frequency(&shard->sketch, victim->hashval))
+            {
+                candidate->region = BOLT_REGION_NONE;
+                bolt_cache_evict(shard, candidate);
+                continue;
+            }
+
+            if (victim != NULL) {
+                bolt_cache_evict(shard, victim);
+            }
+        }
+
+        candidate->region = BOLT_REGION_PROBATION;
+        list_add_tail(&candidate->link, &shard->lru);
+    }
+}
+
+static void
+bolt_tinylfu_hit(bolt_cache_shard_t *shard, bolt_cache_t *cache)
+{
+    int capacity = bolt_cache_shard_capacity();
+    bolt_cache_t *demoted;
+
+    list_del(&cache->link);
+
+    switch (cache->region) {
+    case BOLT_REGION_WINDOW:
+        list_add_tail(&cache->link, &shard->window);
+        return;
+
+    case BOLT_REGION_PROTECTED:
+        list_add_tail(&cache->link, &shard->protected);
+        return;
+    }
+
+    /* Promote to protected segment, and demote the oldest ones */
+
+    cache->region = BOLT_REGION_PROTECTED;
+    list_add_tail(&cache->link, &shard->protected);
+    shard->protected_size += cache->alloc;
+
+    while (shard->protected_size > capacity / 100 * 80
+           && shard->protected.next != &cache->link)
+    {
+        demoted = list_entry(shard->protected.next, bolt_cache_t, link);
+
+        list_del(&demoted->link);
+        shard->protected_size -= demoted->alloc;
+
+        demoted->region = BOLT_REGION_PROBATION;
+        list_add_tail(&demoted->link, &shard->lru);
+    }
+}
+
+static void
+bolt_tinylfu_remove(bolt_cache_shard_t *shard, bolt_cache_t *cache)
+{
+    switch (cache->region) {
+    case BOLT_REGION_NONE: /* Refused, in no list */
+        return;
+
+    case BOLT_REGION_WINDOW:
+        shard->window_size -= cache->alloc;
+        break;
+
+    case BOLT_REGION_PROTECTED:
+        shard->protected_size -= cache->alloc;
+        break;
+    }
+
+    list_del(&cache->link);
+}
+
+static bolt_cache_policy_t bolt_tinylfu_policy = {
+    "tinylfu",
+    bolt_tinylfu_init,
+    bolt_tinylfu_access,
+    bolt_tinylfu_insert,
+    bolt_tinylfu_hit,
+    bolt_tinylfu_remove,
+    bolt_tinylfu_victim,
+};
+
+/*
+ * GreedyDual-Size-Frequency policy: priority of cache is
+ * L + hits * cost / size, the cache of lowest priority was evicted
+ * and L was raised to its priority, so the caches not hit for long
+ * would be evicted at last. Caches were kept in a min-heap.
+ */
+
+static int
+bolt_gdsf_init(bolt_cache_shard_t *shard)
+{
+    shard->heap = NULL;
+    shard->heap_size = 0;
+    shard->heap_cap = 0;
+    shard->inflation = 0;
+
+    return 0;
+}
+
+static void
+bolt_gdsf_access(bolt_cache_shard_t *shard, uint64_t hashval)
+{
+}
+
+static void
+bolt_gdsf_priority(bolt_cache_shard_t *shard, bolt_cache_t *cache)
+{
+    int cost = cache->cost > 0 ? cache->cost : 1;
+
+    cache->priority = shard->inflation
+                      + (double)cache->hits * cost / cache->alloc;
+}
+
+static void
+bolt_gdsf_set(bolt_cache_shard_t *shard, int index, bolt_cache_t *cache)
+{
+    shard->heap[index] = cache;
+    cache->heap_index = index;
+}
+
+static void
+bolt_gdsf_sift_up(bolt_cache_shard_t *shard, int index)
+{
+    bolt_cache_t *cache = shard->heap[index];
+    int parent;
+
+    while (index > 0) {
+        parent = (index - 1) / 2;
+
+        if (shard->heap[parent]->priority <= cache->priority) {
+            break;
+        }
+
+        bolt_gdsf_set(shard, index, shard->heap[parent]);
+        index = parent;
+    }
+
+    bolt_gdsf_set(shard, index, cache);
+}
+
+static void
+bolt_gdsf_sift_down(bolt_cache_shard_t *shard, int index)
+{
+    bolt_cache_t *cache = shard->heap[index];
+    int child;
+
+    for (;;) {
+        child = index * 2 + 1;
+
+        if (child >= shard->heap_size) {
+            break;
+        }
+
+        if (child + 1 < shard->heap_size
+            && shard->heap[child+1]->priority < shard->heap[child]->priority)
+        {
+            child++;
+        }
+
+        if (cache->priority <= shard->heap[child]->priority) {
+            break;
+        }
+
+        bolt_gdsf_set(shard, index, shard->heap[child]);
+        index = child;
+    }
+
+    bolt_gdsf_set(shard, index, cache);
+}
+
+static void
+bolt_gdsf_insert(bolt_cache_shard_t *shard, bolt_cache_t *cache)
+{
+    bolt_cache_t **heap;
+    int cap;
+
+    if (shard->heap_size == shard->heap_cap) {
+
+        cap = shard->heap_cap ? shard->heap_cap * 2 : 64;
+
+        heap = realloc(shard->heap, cap * sizeof(bolt_cache_t *));
+        if (heap == NULL) { /* Can not be tracked, drop it */
+            bolt_log(BOLT_LOG_ERROR, "Not enough memory to grow GDSF heap");
+            bolt_cache_evict(shard, cache);
+            return;
+        }
+
+        shard->heap = heap;
+        shard->heap_cap = cap;
+    }
+
+    cache->hits = 1;
+    bolt_gdsf_priority(shard, cache);
+
+    bolt_gdsf_set(shard, shard->heap_size++, cache);
+    bolt_gdsf_sift_up(shard, cache->heap_index);
+}
+
+static void
+bolt_gdsf_hit(bolt_cache_shard_t *shard, bolt_cache_t *cache)
+{
+    cache->hits++;
+    bolt_gdsf_priority(shard, cache);
+
+    bolt_gdsf_sift_down(shard, cache->heap_index);
+}
+
+static void
+bolt_gdsf_remove(bolt_cache_shard_t *shard, bolt_cache_t *cache)
+{
+    int index = cache->heap_index;
+    bolt_cache_t *last;
+
+    if (index == -1) {
+        return;
+    }
+
+    cache->heap_index = -1;
+
+    last = shard->heap[--shard->heap_size];
+
+    if (last == cache) {
+        return;
+    }
+
+    bolt_gdsf_set(shard, index, last);
+
+    bolt_gdsf_sift_up(shard, index);
+    bolt_gdsf_sift_down(shard, last->heap_index);
+}
+
+/*
+ * The victim was always evicted by caller, so raise L here
+ */
+static bolt_cache_t *
+bolt_gdsf_victim(bolt_cache_shard_t *shard)
+{
+    if (shard->heap_size == 0) {
+        return NULL;
+    }
+
+    shard->inflation = shard->heap[0]->priority;
+
+    return shard->heap[0];
+}
+
+static bolt_cache_policy_t bolt_gdsf_policy = {
+    "gdsf",
+    bolt_gdsf_init,
+    bolt_gdsf_access,
+    bolt_gdsf_insert,
+    bolt_gdsf_hit,
+    bolt_gdsf_remove,
+    bolt_gdsf_victim,
+};
+
+bolt_cache_policy_t *bolt_cache_policy = &bolt_lru_policy;
+
+void
+bolt_init_cache_policy()
+{
+    switch (setting->cache_policy) {
+    case BOLT_CACHE_POLICY_TINYLFU:
+        bolt_cache_policy = &bolt_tinylfu_policy;
+        break;
+    case BOLT_CACHE_POLICY_GDSF:
+        bolt_cache_policy = &bolt_gdsf_policy;
+        break;
+    default:
+        bolt_cache_policy = &bolt_lru_policy;
+        break;
+    }
+}
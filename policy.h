@@ -0,0 +1,25 @@
+#ifndef __BOLT_POLICY_H
+#define __BOLT_POLICY_H
+
+/*
+ * Cache admission and eviction policy, all hooks were called with
+ * the shard locked. insert() may evict other caches (or refuse the
+ * new one) by bolt_cache_evict(), victim() picks the next cache
+ * which GC thread would evict.
+ */
+typedef struct {
+    char *name;
+    int (*init)(bolt_cache_shard_t *shard);
+    void (*access)(bolt_cache_shard_t *shard, uint64_t hashval);
+    void (*insert)(bolt_cache_shard_t *shard, bolt_cache_t *cache);
+    void (*hit)(bolt_cache_shard_t *shard, bolt_cache_t *cache);
+    void (*remove)(bolt_cache_shard_t *shard, bolt_cache_t *cache);
+    bolt_cache_t *(*victim)(bolt_cache_shard_t *shard);
+} bolt_cache_policy_t;
+
+extern bolt_cache_policy_t *bolt_cache_policy;
+
+void bolt_init_cache_policy();
+int bolt_cache_shard_capacity();
+
+#endif
@@ -0,0 +1,335 @@
+/*
+ * Bolt - The Realtime Image Compress System
+ * Copyright (c) 2015 - 2016, Liexusong <280259971@qq.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include "bolt.h"
+#include "slab.h"
+
+/*
+ * Slab allocator of cache memory. Every cache shard has its own arena,
+ * memory was mapped by pages of huge page size, every page was split
+ * into the items of one size class. Pages were aligned by its size,
+ * so the page of an item can be found by address. Items were carved
+ * lazily, so the untouched part of page was not in RSS, and the empty
+ * pages were returned to system. Items bigger than a quarter of page
+ * were mapped alone.
+ */
+
+#define BOLT_SLAB_MIN_ITEM  128
+#define BOLT_SLAB_FACTOR    1.25
+#define BOLT_SLAB_ALIGN     64  /* Cache line, see bolt_cache_t */
+#define BOLT_SLAB_HEADER \
+    ((sizeof(bolt_slab_page_t) + 63) & ~((size_t)63))
+
+#define BOLT_SLAB_ROUNDUP(size, align) \
+    (((size) + (align) - 1) & ~((size_t)(align) - 1))
+
+static size_t bolt_slab_sizes[BOLT_SLAB_CLASSES];
+static int bolt_slab_classes;
+static size_t bolt_slab_max_item;
+
+void
+bolt_init_slab_classes()
+{
+    double size = BOLT_SLAB_MIN_ITEM;
+    size_t item;
+    int n = 0;
+
+    bolt_slab_max_item = ((BOLT_SLAB_PAGE_SIZE - BOLT_SLAB_HEADER) / 4)
+                       & ~((size_t)BOLT_SLAB_ALIGN - 1);
+
+    while (n < BOLT_SLAB_CLASSES - 1 && size < bolt_slab_max_item) {
+        item = BOLT_SLAB_ROUNDUP((size_t)size, BOLT_SLAB_ALIGN);
+        if (n == 0 || item > bolt_slab_sizes[n-1]) {
+            bolt_slab_sizes[n++] = item;
+        }
+        size *= BOLT_SLAB_FACTOR;
+    }
+
+    bolt_slab_sizes[n++] = bolt_slab_max_item;
+
+    bolt_slab_classes = n;
+}
+
+int
+bolt_slab_init(bolt_slab_t *slab)
+{
+    int i;
+
+    if (pthread_mutex_init(&slab->lock, NULL) != 0) {
+        return -1;
+    }
+
+    for (i = 0; i < BOLT_SLAB_CLASSES; i++) {
+        INIT_LIST_HEAD(&slab->partial[i]);
+    }
+
+    slab->spare = NULL;
+    slab->mapped = 0;
+    slab->resident = 0;
+
+    return 0;
+}
+
+static int
+bolt_slab_class(size_t size)
+{
+    int low = 0, high = bolt_slab_classes - 1, mid;
+
+    while (low < high) {
+        mid = (low + high) / 2;
+
+        if (bolt_slab_sizes[mid] < size) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+/*
+ * Bytes were taken from system for the item of size
+ */
+size_t
+bolt_slab_chunk_size(size_t size)
+{
+    if (size > bolt_slab_max_item) {
+        return BOLT_SLAB_ROUNDUP(size, 4096);
+    }
+
+    return bolt_slab_sizes[bolt_slab_class(size)];
+}
+
+static void *
+bolt_slab_map(size_t size)
+{
+    void *addr;
+
+#if defined(MAP_HUGETLB)
+    if (setting->huge_pages && size % BOLT_SLAB_PAGE_SIZE == 0) {
+        addr = mmap(NULL, size, PROT_READ|PROT_WRITE,
+                    MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+        if (addr != MAP_FAILED) {
+            return addr;
+        }
+    }
+#endif
+
+    addr = mmap(NULL, size, PROT_READ|PROT_WRITE,
+                MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+        return NULL;
+    }
+
+#if defined(MADV_HUGEPAGE)
+    if (setting->huge_pages && size >= BOLT_SLAB_PAGE_SIZE) {
+        madvise(addr, size, MADV_HUGEPAGE); /* Transparent huge pages */
+    }
+#endif
+
+    return addr;
+}
+
+/*
+ * Map a page aligned by its size, huge page is aligned already,
+ * otherwise map twice the size and trim the both sides.
+ */
+static bolt_slab_page_t *
+bolt_slab_map_page()
+{
+    char *addr, *aligned;
+
+#if defined(MAP_HUGETLB)
+    if (setting->huge_pages) {
+        addr = mmap(NULL, BOLT_SLAB_PAGE_SIZE, PROT_READ|PROT_WRITE,
+                    MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+        if (addr != MAP_FAILED) {
+            /* Huge page was resident as a whole */
+            ((bolt_slab_page_t *)addr)->touched = BOLT_SLAB_PAGE_SIZE;
+            return (bolt_slab_page_t *)addr;
+        }
+    }
+#endif
+
+    addr = mmap(NULL, BOLT_SLAB_PAGE_SIZE * 2, PROT_READ|PROT_WRITE,
+                MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+        return NULL;
+    }
+
+    aligned = (char *)BOLT_SLAB_ROUNDUP((uintptr_t)addr, BOLT_SLAB_PAGE_SIZE);
+
+    if (aligned > addr) {
+        munmap(addr, aligned - addr);
+    }
+
+    munmap(aligned + BOLT_SLAB_PAGE_SIZE,
+           addr + BOLT_SLAB_PAGE_SIZE - aligned);
+
+#if defined(MADV_HUGEPAGE)
+    if (setting->huge_pages) {
+        madvise(aligned, BOLT_SLAB_PAGE_SIZE, MADV_HUGEPAGE);
+    }
+#endif
+
+    ((bolt_slab_page_t *)aligned)->touched = BOLT_SLAB_HEADER;
+
+    return (bolt_slab_page_t *)aligned;
+}
+
+void *
+bolt_slab_alloc(bolt_slab_t *slab, size_t size)
+{
+    bolt_slab_page_t *page;
+    size_t end;
+    void *item;
+    int cls;
+
+    if (size > bolt_slab_max_item) {
+        size = BOLT_SLAB_ROUNDUP(size, 4096);
+
+        item = bolt_slab_map(size);
+        if (item) {
+            __sync_fetch_and_add(&slab->mapped, size);
+            __sync_fetch_and_add(&slab->resident, size);
+        }
+
+        return item;
+    }
+
+    cls = bolt_slab_class(size);
+
+    LOCK_SLAB(slab);
+
+    if (list_empty(&slab->partial[cls])) {
+
+        page = slab->spare;
+
+        if (page) {
+            slab->spare = NULL;
+
+        } else {
+            page = bolt_slab_map_page();
+            if (!page) {
+                UNLOCK_SLAB(slab);
+                return NULL;
+            }
+
+            __sync_fetch_and_add(&slab->mapped, BOLT_SLAB_PAGE_SIZE);
+            __sync_fetch_and_add(&slab->resident, page->touched);
+        }
+
+        page->cls = cls;
+        page->used = 0;
+        page->total = (BOLT_SLAB_PAGE_SIZE - BOLT_SLAB_HEADER)
+                    / bolt_slab_sizes[cls];
+        page->free = NULL;
+        page->next = (char *)page + BOLT_SLAB_HEADER;
+
+        list_add(&page->link, &slab->partial[cls]);
+    }
+
+    page = list_entry(slab->partial[cls].next, bolt_slab_page_t, link);
+
+    if (page->free) {
+        item = page->free;
+        page->free = *(void **)item;
+
+    } else {
+        item = page->next;
+        page->next += bolt_slab_sizes[cls];
+
+        /* Spare page may be touched by the other class before */
+        end = page->next - (char *)page;
+
+        if (end > page->touched) {
+            __sync_fetch_and_add(&slab->resident, end - page->touched);
+            page->touched = end;
+        }
+    }
+
+    if (++page->used == page->total) { /* Full page was not in list */
+        list_del(&page->link);
+    }
+
+    UNLOCK_SLAB(slab);
+
+    return item;
+}
+
+/*
+ * Free the item, size must be the same as allocated. The empty
+ * page was returned to system, but one was kept for reusing.
+ */
+void
+bolt_slab_free(bolt_slab_t *slab, void *item, size_t size)
+{
+    bolt_slab_page_t *page;
+    int release = 0;
+
+    if (size > bolt_slab_max_item) {
+        size = BOLT_SLAB_ROUNDUP(size, 4096);
+
+        munmap(item, size);
+
+        __sync_fetch_and_sub(&slab->mapped, size);
+        __sync_fetch_and_sub(&slab->resident, size);
+
+        return;
+    }
+
+    page = (bolt_slab_page_t *)((uintptr_t)item
+                                & ~((uintptr_t)BOLT_SLAB_PAGE_SIZE - 1));
+
+    LOCK_SLAB(slab);
+
+    *(void **)item = page->free;
+    page->free = item;
+
+    if (page->used-- == page->total) {
+        list_add_tail(&page->link, &slab->partial[page->cls]);
+    }
+
+    if (page->used == 0) {
+        list_del(&page->link);
+
+        if (slab->spare == NULL) {
+            slab->spare = page;
+        } else {
+            release = 1;
+        }
+    }
+
+    UNLOCK_SLAB(slab);
+
+    if (release) {
+        __sync_fetch_and_sub(&slab->mapped, BOLT_SLAB_PAGE_SIZE);
+        __sync_fetch_and_sub(&slab->resident, page->touched);
+
+        munmap(page, BOLT_SLAB_PAGE_SIZE);
+    }
+}
@@ -0,0 +1,10 @@
+#ifndef __BOLT_SLAB_H
+#define __BOLT_SLAB_H
+
+void bolt_init_slab_classes();
+int bolt_slab_init(bolt_slab_t *slab);
+size_t bolt_slab_chunk_size(size_t size);
+void *bolt_slab_alloc(bolt_slab_t *slab, size_t size);
+void bolt_slab_free(bolt_slab_t *slab, void *item, size_t size);
+
+#endif
@@ -0,0 +1,132 @@
+/*
+ * Bolt - The Realtime Image Compress System
+ * Copyright (c) 2015 - 2016, Liexusong <280259971@qq.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include "bolt.h"
+#include "stats.h"
+#include "time.h"
+#include "numa.h"
+
+/*
+ * Called by worker when it takes a task from queue
+ */
+void
+bolt_stats_task_start(uint64_t enqueue_time)
+{
+    bolt_stats_t *stats = &service->stats;
+    uint64_t wait, max;
+
+    wait = bolt_usec_now() - enqueue_time;
+
+    __sync_fetch_and_add(&stats->tasks, 1);
+    __sync_fetch_and_add(&stats->queue_wait_total, wait);
+
+    for (max = stats->queue_wait_max; wait > max;
+         max = stats->queue_wait_max)
+    {
+        if (__sync_bool_compare_and_swap(&stats->queue_wait_max, max, wait)) {
+            break;
+        }
+    }
+}
+
+/*
+ * Format stats as "key: value" lines
+ */
+int
+bolt_stats_format(char *buf, int size)
+{
+    bolt_stats_t *stats = &service->stats;
+    uint64_t tasks, total;
+    int queued = 0, busy = 0;
+    long long mapped = 0, resident = 0, connmem = 0;
+    int nbytes, i;
+
+    for (i = 0; i < service->workers_num; i++) { /* Read without lock */
+        queued += service->workers[i].task_nums;
+        busy += service->workers[i].busy;
+    }
+
+    for (i = 0; i < service->cache_shards_num && setting->slab; i++) {
+        mapped += service->cache_shards[i].slab.mapped;
+        resident += service->cache_shards[i].slab.resident;
+    }
+
+    for (i = 0; i < service->reactors_num; i++) {
+        connmem += service->reactors[i].slab.resident;
+    }
+
+    tasks = stats->tasks;
+    total = stats->queue_wait_total;
+
+    nbytes = snprintf(buf, size,
+                    "connections: %d" BOLT_CRLF
+                    "connection_memory: %lld" BOLT_CRLF
+                    "memory_usage: %d" BOLT_CRLF
+                    "workers: %d" BOLT_CRLF
+                    "workers_busy: %d" BOLT_CRLF
+                    "cpu_budget: %d" BOLT_CRLF
+                    "magick_threads: %d" BOLT_CRLF
+                    "tasks_queued: %d" BOLT_CRLF
+                    "tasks_pending: %d" BOLT_CRLF
+                    "cost_pending: %lld" BOLT_CRLF
+                    "rejected: %llu" BOLT_CRLF
+                    "cancelled: %llu" BOLT_CRLF
+                    "expired: %llu" BOLT_CRLF
+                    "tasks_total: %llu" BOLT_CRLF
+                    "queue_wait_avg_us: %llu" BOLT_CRLF
+                    "queue_wait_max_us: %llu" BOLT_CRLF,
+                    service->connections,
+                    connmem,
+                    service->memory_usage,
+                    service->workers_num,
+                    busy,
+                    setting->cpu_budget,
+                    service->magick_threads,
+                    queued,
+                    service->tasks_pending,
+                    service->cost_pending,
+                    (unsigned long long)stats->rejected,
+                    (unsigned long long)stats->cancelled,
+                    (unsigned long long)stats->expired,
+                    (unsigned long long)tasks,
+                    (unsigned long long)(tasks ? total / tasks : 0),
+                    (unsigned long long)stats->queue_wait_max);
+
+    /* Memory of cache slabs, the touched part is resident */
+
+    if (setting->slab && nbytes < size) {
+        nbytes += snprintf(buf + nbytes, size - nbytes,
+                           "slab_mapped: %lld" BOLT_CRLF
+                           "slab_resident: %lld" BOLT_CRLF,
+                           mapped, resident);
+    }
+
+    /* Cache memory of every NUMA node */
+
+    for (i = 0; i < bolt_numa_nodes && nbytes < size; i++) {
+        nbytes += snprintf(buf + nbytes, size - nbytes,
+                           "memory_node%d: %d" BOLT_CRLF,
+                           i, service->node_memory[i]);
+    }
+
+    return nbytes;
+}
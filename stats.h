@@ -0,0 +1,7 @@
+#ifndef __BOLT_STATS_H
+#define __BOLT_STATS_H
+
+void bolt_stats_task_start(uint64_t enqueue_time);
+int bolt_stats_format(char *buf, int size);
+
+#endif
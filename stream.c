@@ -0,0 +1,166 @@
+/*
+ * Bolt - The Realtime Image Compress System
+ * Copyright (c) 2015 - 2016, Liexusong <280259971@qq.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include "bolt.h"
+#include "stream.h"
+
+/*
+ * Streaming output of the image being encoded. Worker appends data to
+ * a list of fixed size blocks which never moved, so reactors can send
+ * them without copy while more data was appended. Data was published
+ * by size under the stream lock.
+ */
+
+bolt_stream_t *
+bolt_stream_new()
+{
+    bolt_stream_t *stream;
+
+    stream = malloc(sizeof(*stream));
+    if (!stream) {
+        return NULL;
+    }
+
+    if (pthread_mutex_init(&stream->lock, NULL) != 0) {
+        free(stream);
+        return NULL;
+    }
+
+    stream->refcount = 1;
+    stream->head = NULL;
+    stream->tail = NULL;
+    stream->size = 0;
+    stream->state = BOLT_STREAM_WRITING;
+    stream->parked = NULL;
+
+    return stream;
+}
+
+/*
+ * Append data to stream, return the parked connections which
+ * should be woken up to send the new data.
+ */
+bolt_connection_t *
+bolt_stream_write(bolt_stream_t *stream, char *data, size_t size)
+{
+    bolt_stream_block_t *block;
+    bolt_connection_t *parked;
+    size_t offset, nbytes;
+
+    if (stream->state != BOLT_STREAM_WRITING) {
+        return NULL;
+    }
+
+    offset = stream->size % BOLT_STREAM_BLOCK;
+
+    while (size > 0) {
+
+        /* Only writer changes the blocks list, so no lock here */
+
+        if (stream->tail == NULL || offset == 0) {
+            block = malloc(sizeof(*block));
+            if (!block) {
+                return bolt_stream_finish(stream, 0);
+            }
+
+            block->next = NULL;
+
+            if (stream->tail) {
+                stream->tail->next = block;
+            } else {
+                stream->head = block;
+            }
+
+            stream->tail = block;
+        }
+
+        nbytes = BOLT_STREAM_BLOCK - offset;
+        if (nbytes > size) {
+            nbytes = size;
+        }
+
+        memcpy(stream->tail->data + offset, data, nbytes);
+
+        LOCK_STREAM(stream);
+        stream->size += nbytes;
+        UNLOCK_STREAM(stream);
+
+        offset = (offset + nbytes) % BOLT_STREAM_BLOCK;
+        data += nbytes;
+        size -= nbytes;
+    }
+
+    LOCK_STREAM(stream);
+    parked = stream->parked;
+    stream->parked = NULL;
+    UNLOCK_STREAM(stream);
+
+    return parked;
+}
+
+/*
+ * Finish the stream, return the parked connections which should be
+ * woken up to send the last chunk (or closed when failed).
+ */
+bolt_connection_t *
+bolt_stream_finish(bolt_stream_t *stream, int success)
+{
+    bolt_connection_t *parked;
+
+    LOCK_STREAM(stream);
+
+    if (stream->state == BOLT_STREAM_WRITING) {
+        stream->state = success ? BOLT_STREAM_DONE : BOLT_STREAM_FAILED;
+    }
+
+    parked = stream->parked;
+    stream->parked = NULL;
+
+    UNLOCK_STREAM(stream);
+
+    return parked;
+}
+
+void
+bolt_stream_incref(bolt_stream_t *stream)
+{
+    __sync_fetch_and_add(&stream->refcount, 1);
+}
+
+void
+bolt_stream_decref(bolt_stream_t *stream)
+{
+    bolt_stream_block_t *block, *next;
+
+    if (__sync_sub_and_fetch(&stream->refcount, 1) == 0) {
+
+        for (block = stream->head; block; block = next) {
+            next = block->next;
+            free(block);
+        }
+
+        pthread_mutex_destroy(&stream->lock);
+        free(stream);
+    }
+}
@@ -0,0 +1,11 @@
+#ifndef __BOLT_STREAM_H
+#define __BOLT_STREAM_H
+
+bolt_stream_t *bolt_stream_new();
+bolt_connection_t *bolt_stream_write(bolt_stream_t *stream, char *data,
+    size_t size);
+bolt_connection_t *bolt_stream_finish(bolt_stream_t *stream, int success);
+void bolt_stream_incref(bolt_stream_t *stream);
+void bolt_stream_decref(bolt_stream_t *stream);
+
+#endif
@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2012 - 2013, Liexusong <280259971@qq.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __JK_CHAIN_H
+#define __JK_CHAIN_H
+
+#define  JK_CHAIN_OK              (0)
+#define  JK_CHAIN_ERR             (-1)
+#define  JK_CHAIN_DUPLICATE_KEY   (-2)
+
+#define  JK_CHAIN_BUCKETS_MIN_SIZE   7
+#define  JK_CHAIN_BUCKETS_MAX_SIZE   2147483647
+
+typedef long jk_chain_hash_fn(char *, int);
+typedef void jk_chain_free_fn(void *);
+
+typedef struct jk_chain_s {
+    jk_chain_hash_fn *hash;
+    jk_chain_free_fn *free;
+    void **buckets;
+    unsigned int buckets_size;
+    unsigned int elm_nums;
+} jk_chain_t;
+
+typedef struct jk_chain_entry_s jk_chain_entry_t;
+
+struct jk_chain_entry_s {
+    int hashval;
+    int klen;
+    void *data;
+    jk_chain_entry_t *next;
+    char key[0];
+};
+
+
+int jk_chain_init(jk_chain_t *o, unsigned int init_buckets, jk_chain_hash_fn *hash,
+    jk_chain_free_fn *free);
+jk_chain_t *jk_chain_new(unsigned int init_buckets, jk_chain_hash_fn *hash,
+    jk_chain_free_fn *free);
+int jk_chain_find(jk_chain_t *o, char *key, int klen, void **ret);
+int jk_chain_insert(jk_chain_t *o, char *key, int klen, void *data, int replace);
+int jk_chain_remove(jk_chain_t *o, char *key, int klen);
+void jk_chain_destroy(jk_chain_t *o);
+void jk_chain_free(jk_chain_t *o);
+
+#endif
@@ -0,0 +1,102 @@
+/*
+ * Bolt - The Realtime Image Compress System
+ * Copyright (c) 2015 - 2016, Liexusong <280259971@qq.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "../bolt.h"
+#include "test.h"
+
+/* The modules under test read the configure and service */
+bolt_setting_t *setting, _setting;
+bolt_service_t *service, _service;
+
+int bolt_test_checks;
+int bolt_test_failures;
+int bolt_test_bench;
+
+static char *bolt_test_name;
+static __thread uint64_t bolt_test_state = 88172645463325252ULL;
+
+void
+bolt_test_init(char *name, int argc, char **argv)
+{
+    int i;
+
+    bolt_test_name = name;
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-b")) {
+            bolt_test_bench = 1;
+        } else if (!strcmp(argv[i], "-v")) {
+            bolt_init_log(NULL, BOLT_LOG_DEBUG);
+        }
+    }
+
+    setting = &_setting;
+    service = &_service;
+
+    service->current_time = time(NULL);
+}
+
+int
+bolt_test_done()
+{
+    if (bolt_test_failures > 0) {
+        printf("%s: %d of %d checks failed\n", bolt_test_name,
+               bolt_test_failures, bolt_test_checks);
+        return 1;
+    }
+
+    printf("%s: %d checks passed\n", bolt_test_name, bolt_test_checks);
+
+    return 0;
+}
+
+/*
+ * Xorshift of every thread, so the runs were reproducible
+ */
+void
+bolt_test_seed(uint64_t seed)
+{
+    bolt_test_state = seed ? seed : 88172645463325252ULL;
+}
+
+uint64_t
+bolt_test_random()
+{
+    bolt_test_state ^= bolt_test_state << 13;
+    bolt_test_state ^= bolt_test_state >> 7;
+    bolt_test_state ^= bolt_test_state << 17;
+
+    return bolt_test_state;
+}
+
+double
+bolt_test_usec()
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
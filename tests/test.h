@@ -0,0 +1,60 @@
+/*
+ * Bolt - The Realtime Image Compress System
+ * Copyright (c) 2015 - 2016, Liexusong <280259971@qq.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef __BOLT_TEST_H
+#define __BOLT_TEST_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Tiny harness of the standalone modules, every test program checks
+ * its module by BOLT_CHECK() and prints timings when run with -b
+ * (make bench), the exit status is the number of failed checks.
+ * Checks and random numbers can be used by threads.
+ */
+
+#define BOLT_CHECK(cond)                                                \
+    do {                                                                \
+        __sync_fetch_and_add(&bolt_test_checks, 1);                     \
+        if (!(cond)) {                                                  \
+            __sync_fetch_and_add(&bolt_test_failures, 1);               \
+            fprintf(stderr, "%s:%d: check `%s' failed\n",               \
+                    __FILE__, __LINE__, #cond);                         \
+        }                                                               \
+    } while (0)
+
+#define BOLT_BENCH(name, ops, usec)                                     \
+    printf("  %-36s %10.1f ns/op %12.0f op/s\n", (name),               \
+           (usec) * 1000.0 / (ops), (ops) * 1000000.0 / ((usec) + 1))
+
+extern int bolt_test_checks;
+extern int bolt_test_failures;
+extern int bolt_test_bench;
+
+void bolt_test_init(char *name, int argc, char **argv);
+int bolt_test_done();
+void bolt_test_seed(uint64_t seed);
+uint64_t bolt_test_random();
+double bolt_test_usec();
+
+#endif
@@ -0,0 +1,75 @@
+#!/bin/sh
+#
+# Regression test of coalesced variants which go through different
+# pipelines: the JPEG variant of a source is done by the native
+# pipeline and freed, then the PNG variant of the same source is done
+# by MagickWand in the same batch. Run by make test-server, which
+# builds bolt with AddressSanitizer so a stale task is caught.
+#
+
+BOLT=${BOLT:-./tests/bolt_asan}
+PORT=${PORT:-18089}
+ROUNDS=${ROUNDS:-10}
+IMAGES=$(cd "$(dirname "$0")/../images" && pwd)
+
+TMP=$(mktemp -d /tmp/bolt-test-XXXXXX)
+URL=http://127.0.0.1:$PORT
+
+trap 'kill $PID 2>/dev/null; rm -rf $TMP' EXIT
+
+# One worker, so the variants queue up behind a slow task
+cat > $TMP/bolt.conf <<CONF
+host = 0.0.0.0
+port = $PORT
+workers = 1
+logmark = error
+native = jpg
+path = $IMAGES
+daemon = no
+CONF
+
+ASAN_OPTIONS=${ASAN_OPTIONS:-detect_leaks=0} \
+    $BOLT -c $TMP/bolt.conf 2>$TMP/bolt.log &
+PID=$!
+
+sleep 1
+
+failed=0
+
+for i in $(seq 1 $ROUNDS); do
+    # Blocker of the worker, a big MagickWand upscale of another source
+    curl -s -o /dev/null "$URL/2-$((3000 + i))x3000_90.png" &
+    BLOCKER=$!
+    sleep 0.1
+
+    curl -s -o $TMP/jpg -w "%{http_code}" \
+        "$URL/1-$((100 + i))x100_80.jpg" > $TMP/jpg.code &
+    JPG=$!
+    sleep 0.05
+    curl -s -o $TMP/png -w "%{http_code}" \
+        "$URL/1-$((120 + i))x90_80.png" > $TMP/png.code &
+
+    wait $BLOCKER $JPG $!
+
+    if [ "$(cat $TMP/jpg.code)" != 200 ] \
+       || [ "$(cat $TMP/png.code)" != 200 ] \
+       || [ ! -s $TMP/jpg ] || [ ! -s $TMP/png ]
+    then
+        echo "round $i: jpg $(cat $TMP/jpg.code) png $(cat $TMP/png.code)"
+        failed=1
+        break
+    fi
+done
+
+if ! kill -0 $PID 2>/dev/null; then
+    echo "bolt exited:"
+    failed=1
+fi
+
+if [ $failed -ne 0 ]; then
+    cat $TMP/bolt.log
+    echo "test_batch: failed"
+    exit 1
+fi
+
+echo "test_batch: $ROUNDS mixed batches passed"
@@ -0,0 +1,517 @@
+/*
+ * Bolt - The Realtime Image Compress System
+ * Copyright (c) 2015 - 2016, Liexusong <280259971@qq.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../bolt.h"
+#include "../cache.h"
+#include "../policy.h"
+#include "../slab.h"
+#include "test.h"
+
+/*
+ * Drive the cache shards as reactors and workers do, from several
+ * threads at once, and check that every cache was reclaimed exactly
+ * once. With -b it compares the throughput of one shard (the old
+ * global lock) with sharded caches as the threads grow.
+ */
+
+#define TEST_KEYS     4096
+#define TEST_THREADS  8
+
+typedef struct {
+    char key[64];
+    int klen;
+    uint64_t hashval;
+} test_key_t;
+
+static test_key_t keys[TEST_KEYS];
+static int test_ops;
+static int test_trim;
+
+static void
+test_init_keys()
+{
+    int i;
+
+    for (i = 0; i < TEST_KEYS; i++) {
+        keys[i].klen = sprintf(keys[i].key, "/photo-%d.jpg-%dx%d_75.jpg",
+                               i / 8, 100 + i % 8, 100 + i % 8);
+        keys[i].hashval = jk_hash_calc(keys[i].key, keys[i].klen);
+    }
+}
+
+static void
+test_init_cache(int policy, int shards, int slab)
+{
+    memset(service, 0, sizeof(*service));
+
+    service->current_time = time(NULL);
+
+    setting->cache_policy = policy;
+    setting->slab = slab;
+    setting->cache_life = 3600;
+
+    BOLT_CHECK(bolt_init_cache(shards) == 0);
+}
+
+/*
+ * Evict every cache by policy, so the policy must know them all
+ */
+static void
+test_destroy_cache()
+{
+    bolt_cache_shard_t *shard;
+    bolt_cache_t *cache;
+    int i, memory = 0;
+
+    for (i = 0; i < service->cache_shards_num; i++) {
+
+        shard = &service->cache_shards[i];
+
+        LOCK_CACHE(shard);
+
+        while ((cache = bolt_cache_policy->victim(shard)) != NULL) {
+            bolt_cache_evict(shard, cache);
+        }
+
+        BOLT_CHECK(shard->htb->elm_nums == 0);
+        BOLT_CHECK(shard->wheel.timers == 0);
+
+        memory += shard->memory_usage;
+
+        UNLOCK_CACHE(shard);
+
+        jk_hash_free(shard->htb);
+        free(shard->sketch.counters);
+        free(shard->heap);
+    }
+
+    BOLT_CHECK(memory == 0);
+
+    free(service->cache_shards);
+}
+
+/*
+ * Lookup as the reactor does, return a pinned cache or NULL
+ */
+static bolt_cache_t *
+test_cache_get(test_key_t *k)
+{
+    bolt_cache_shard_t *shard;
+    bolt_cache_t *cache;
+
+    shard = bolt_cache_get_shard(k->hashval);
+
+    LOCK_CACHE(shard);
+
+    bolt_cache_policy->access(shard, k->hashval);
+
+    if (jk_hash_find_hash(shard->htb, k->key, k->klen,
+                          k->hashval, (void **)&cache) == JK_HASH_OK)
+    {
+        bolt_cache_policy->hit(shard, cache);
+        bolt_cache_incref(cache);
+
+        UNLOCK_CACHE(shard);
+
+        return cache;
+    }
+
+    UNLOCK_CACHE(shard);
+
+    return NULL;
+}
+
+/*
+ * Insert as the worker does, trim the shard as GC thread does
+ */
+static void
+test_cache_put(test_key_t *k, int size, int life)
+{
+    bolt_cache_shard_t *shard;
+    bolt_cache_t *cache, *ocache;
+    char *blob;
+
+    shard = bolt_cache_get_shard(k->hashval);
+
+    blob = malloc(size);
+    memset(blob, k->klen, size);
+
+    cache = bolt_cache_new(shard, k->key, k->klen, blob, size, -1);
+    BOLT_CHECK(cache != NULL);
+
+    cache->hashval = k->hashval;
+    cache->time = service->current_time;
+    cache->life_time = cache->time + life;
+    cache->cost = 100 + k->klen;
+
+    LOCK_CACHE(shard);
+
+    if (jk_hash_find_hash(shard->htb, k->key, k->klen,
+                          k->hashval, (void **)&ocache) != JK_HASH_OK
+        && jk_hash_insert_hash(shard->htb, cache->filename, cache->fnlen,
+                               k->hashval, cache, 0) == JK_HASH_OK)
+    {
+        bolt_cache_incref(cache);
+        bolt_cache_add_timer(shard, cache);
+        bolt_cache_policy->insert(shard, cache);
+    }
+
+    while (test_trim
+           && shard->memory_usage > bolt_cache_shard_capacity()
+           && (ocache = bolt_cache_policy->victim(shard)) != NULL)
+    {
+        bolt_cache_evict(shard, ocache);
+    }
+
+    UNLOCK_CACHE(shard);
+
+    bolt_cache_decref(cache);
+}
+
+static void *
+test_thread(void *arg)
+{
+    bolt_cache_t *cache;
+    test_key_t *k;
+    int i, ok = 1;
+
+    bolt_test_seed((long)arg * 2654435761ULL);
+
+    for (i = 0; i < test_ops; i++) {
+
+        /* Skewed, a quarter of keys take most of requests */
+        k = &keys[bolt_test_random() % (bolt_test_random() % 4
+                                        ? TEST_KEYS / 4 : TEST_KEYS)];
+
+        cache = test_cache_get(k);
+
+        if (cache) {
+            /* Blob was not freed while pinned */
+            ok &= strcmp(cache->filename, k->key) == 0
+                  && ((unsigned char *)cache->cache)[cache->size - 1]
+                     == (unsigned char)k->klen;
+
+            bolt_cache_decref(cache);
+
+        } else {
+            test_cache_put(k, 512 + k->hashval % 8192, 3600);
+        }
+    }
+
+    return (void *)(long)ok;
+}
+
+static double
+test_run_threads(void *(*fn)(void *), int threads, int ops)
+{
+    pthread_t tids[TEST_THREADS];
+    double start;
+    void *ok;
+    int i;
+
+    test_ops = ops;
+
+    start = bolt_test_usec();
+
+    for (i = 0; i < threads; i++) {
+        pthread_create(&tids[i], NULL, fn, (void *)(long)(i + 1));
+    }
+
+    for (i = 0; i < threads; i++) {
+        pthread_join(tids[i], &ok);
+        BOLT_CHECK(ok != NULL);
+    }
+
+    return bolt_test_usec() - start;
+}
+
+static void
+test_shard_spread()
+{
+    int counts[16] = {0}, i;
+
+    test_init_cache(BOLT_CACHE_POLICY_LRU, 16, 0);
+
+    for (i = 0; i < TEST_KEYS; i++) {
+        counts[bolt_cache_get_shard(keys[i].hashval)
+               - service->cache_shards]++;
+    }
+
+    for (i = 0; i < 16; i++) {
+        BOLT_CHECK(counts[i] > TEST_KEYS / 16 * 3 / 4
+                   && counts[i] < TEST_KEYS / 16 * 5 / 4);
+    }
+
+    test_destroy_cache();
+}
+
+/*
+ * Concurrent hits, inserts and evictions under every policy
+ */
+static void
+test_concurrent()
+{
+    int policy, slab;
+
+    setting->max_cache = 4 * 1024 * 1024;  /* Less than the keys */
+    setting->gc_threshold = 80;
+
+    test_trim = 1;
+
+    for (policy = BOLT_CACHE_POLICY_LRU;
+         policy <= BOLT_CACHE_POLICY_GDSF; policy++)
+    {
+        for (slab = 0; slab <= 1; slab++) {
+            test_init_cache(policy, 16, slab);
+
+            test_run_threads(test_thread, TEST_THREADS, 50000);
+
+            test_destroy_cache();
+        }
+    }
+
+    test_trim = 0;
+}
+
+/*
+ * Caches were expired by timer wheel, never before their life time
+ */
+static void
+test_expire()
+{
+    time_t start, now;
+    int i, early = 0;
+    bolt_cache_t *cache;
+
+    test_init_cache(BOLT_CACHE_POLICY_LRU, 4, 0);
+
+    start = service->current_time;
+
+    for (i = 0; i < TEST_KEYS; i++) {
+        test_cache_put(&keys[i], 64, 1 + i % 5000);
+    }
+
+    for (now = start; now < start + 5100; now++) {
+        service->current_time = now;
+
+        bolt_cache_expire(now);
+
+        i = bolt_test_random() % TEST_KEYS;
+
+        if ((cache = test_cache_get(&keys[i])) != NULL) {
+            bolt_cache_decref(cache);
+
+        } else if (start + 1 + i % 5000 >= now) {
+            early++;
+        }
+    }
+
+    BOLT_CHECK(early == 0);
+    BOLT_CHECK(bolt_cache_memory_usage() == 0);
+
+    test_destroy_cache();
+}
+
+/*
+ * Expiring work of one tick was bounded in all, even by many shards
+ */
+static void
+test_expire_budget()
+{
+    time_t start, now;
+    int i, cached, left, evicted, most = 0;
+
+    test_init_cache(BOLT_CACHE_POLICY_LRU, BOLT_MAX_CACHE_SHARDS, 0);
+
+    start = service->current_time;
+
+    for (i = 0; i < TEST_KEYS; i++) {
+        test_cache_put(&keys[i], 64, 1);
+    }
+
+    cached = TEST_KEYS;
+
+    for (now = start + 2; cached > 0 && now < start + 100; now++) {
+        service->current_time = now;
+
+        bolt_cache_expire(now);
+
+        for (left = 0, i = 0; i < service->cache_shards_num; i++) {
+            left += service->cache_shards[i].htb->elm_nums;
+        }
+
+        evicted = cached - left;
+        cached = left;
+
+        if (evicted > most) {
+            most = evicted;
+        }
+    }
+
+    BOLT_CHECK(most > 0 && most <= BOLT_EXPIRE_PER_TICK);
+    BOLT_CHECK(cached == 0);
+
+    test_destroy_cache();
+}
+
+/*
+ * Hits only, every key was cached before
+ */
+static void *
+test_hit_thread(void *arg)
+{
+    bolt_cache_t *cache;
+    int i, ok = 1;
+
+    bolt_test_seed((long)arg * 2654435761ULL);
+
+    for (i = 0; i < test_ops; i++) {
+        cache = test_cache_get(&keys[bolt_test_random() % TEST_KEYS]);
+
+        if (cache) {
+            bolt_cache_decref(cache);
+        } else {
+            ok = 0;
+        }
+    }
+
+    return (void *)(long)ok;
+}
+
+static test_key_t *bench_keys;
+
+/*
+ * Inserts only, every thread inserts its own keys
+ */
+static void *
+test_insert_thread(void *arg)
+{
+    test_key_t *k = bench_keys + ((long)arg - 1) * test_ops;
+    int i;
+
+    for (i = 0; i < test_ops; i++) {
+        test_cache_put(&k[i], 64, 3600);
+    }
+
+    return (void *)1;
+}
+
+static double
+test_bench_hits(int shards, int threads, int ops)
+{
+    double usec;
+    int i;
+
+    test_init_cache(BOLT_CACHE_POLICY_LRU, shards, 0);
+
+    for (i = 0; i < TEST_KEYS; i++) {
+        test_cache_put(&keys[i], 64, 3600);
+    }
+
+    usec = test_run_threads(test_hit_thread, threads, ops);
+
+    test_destroy_cache();
+
+    return threads * ops / usec;
+}
+
+static double
+test_bench_inserts(int shards, int threads, int ops)
+{
+    double usec;
+
+    test_init_cache(BOLT_CACHE_POLICY_LRU, shards, 0);
+
+    usec = test_run_threads(test_insert_thread, threads, ops);
+
+    test_destroy_cache();
+
+    return threads * ops / usec;
+}
+
+/*
+ * Throughput by the number of reactor threads, one shard is the old
+ * global lock. Hits and inserts are apart, inserts take the lock much
+ * longer and would hide the contention of hits.
+ */
+static void
+test_bench()
+{
+    int threads[] = {1, 2, 4, 8}, shards = 16, i, hits = 200000,
+        inserts = 20000;
+    char hname[32], iname[32];
+
+    setting->max_cache = 1024 * 1024 * 1024;
+
+    bench_keys = malloc(TEST_THREADS * inserts * sizeof(test_key_t));
+
+    for (i = 0; i < TEST_THREADS * inserts; i++) {
+        bench_keys[i].klen = sprintf(bench_keys[i].key,
+                                     "/bench-%d.jpg-100x100_75.jpg", i);
+        bench_keys[i].hashval = jk_hash_calc(bench_keys[i].key,
+                                             bench_keys[i].klen);
+    }
+
+    sprintf(hname, "hit %d shards", shards);
+    sprintf(iname, "insert %d shards", shards);
+
+    /* Threads only scale when they really run in parallel */
+    printf("  %ld CPUs online, Mop/s by threads\n",
+           sysconf(_SC_NPROCESSORS_ONLN));
+
+    printf("  %-8s %16s %16s %16s %16s\n", "threads", "hit 1 shard",
+           hname, "insert 1 shard", iname);
+
+    for (i = 0; i < 4; i++) {
+        printf("  %-8d %16.2f %16.2f %16.2f %16.2f\n", threads[i],
+               test_bench_hits(1, threads[i], hits),
+               test_bench_hits(shards, threads[i], hits),
+               test_bench_inserts(1, threads[i], inserts),
+               test_bench_inserts(shards, threads[i], inserts));
+    }
+
+    free(bench_keys);
+}
+
+int
+main(int argc, char **argv)
+{
+    bolt_test_init("test_cache", argc, argv);
+
+    bolt_init_slab_classes();
+
+    test_init_keys();
+
+    test_shard_spread();
+    test_concurrent();
+    test_expire();
+    test_expire_budget();
+
+    if (bolt_test_bench) {
+        test_bench();
+    }
+
+    return bolt_test_done();
+}
@@ -0,0 +1,312 @@
+/*
+ * Bolt - The Realtime Image Compress System
+ * Copyright (c) 2015 - 2016, Liexusong <280259971@qq.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include "../hash.h"
+#include "hash_chain.h"
+#include "test.h"
+
+/*
+ * Check jk_hash against a plain array model by random operations,
+ * across growing, incremental rehash and deleted buckets cleanup.
+ */
+
+#define TEST_KEYS  20000
+#define TEST_OPS   400000
+
+static int model[TEST_KEYS];    /* Value + 1, 0 means absent */
+static int freed;
+
+static int
+test_key(char *buf, int i)
+{
+    return sprintf(buf, "/images/%d/photo-%dx%d.jpg", i, i % 640, i % 480);
+}
+
+/* Weak hash, many keys share a group to exercise long probing */
+static uint64_t
+test_weak_hash(char *key, int klen)
+{
+    return jk_hash_calc(key, klen) & 0x3FF;
+}
+
+static void
+test_free_value(void *data)
+{
+    freed++;
+}
+
+static void
+test_model(jk_hash_hash_fn *hash, int keys)
+{
+    jk_hash_t *htb;
+    char key[64];
+    void *value;
+    int i, k, op, klen, retval, nums = 0;
+
+    memset(model, 0, sizeof(model));
+    freed = 0;
+
+    htb = jk_hash_new(0, hash, test_free_value);
+    BOLT_CHECK(htb != NULL);
+
+    for (i = 0; i < TEST_OPS; i++) {
+
+        k = bolt_test_random() % keys;
+        op = bolt_test_random() % 10;
+        klen = test_key(key, k);
+
+        if (op < 4) {
+            retval = jk_hash_insert(htb, key, klen,
+                                    (void *)(long)(i + 1), op == 0);
+
+            if (model[k] && op != 0) {
+                BOLT_CHECK(retval == JK_HASH_DUPLICATE_KEY);
+            } else {
+                BOLT_CHECK(retval == JK_HASH_OK);
+                nums += model[k] ? 0 : 1;
+                model[k] = i + 1;
+            }
+
+        } else if (op < 7) {
+            retval = jk_hash_remove(htb, key, klen);
+
+            BOLT_CHECK(retval == (model[k] ? JK_HASH_OK : JK_HASH_ERR));
+
+            nums -= model[k] ? 1 : 0;
+            model[k] = 0;
+
+        } else {
+            retval = jk_hash_find(htb, key, klen, &value);
+
+            if (model[k]) {
+                BOLT_CHECK(retval == JK_HASH_OK
+                           && (long)value == model[k]);
+            } else {
+                BOLT_CHECK(retval == JK_HASH_ERR);
+            }
+        }
+
+        BOLT_CHECK(htb->elm_nums == (unsigned int)nums);
+    }
+
+    /* Every present key was found after all */
+    for (k = 0; k < keys; k++) {
+        klen = test_key(key, k);
+        retval = jk_hash_find_hash(htb, key, klen,
+                                   hash(key, klen), &value);
+
+        BOLT_CHECK((retval == JK_HASH_OK) == (model[k] != 0));
+    }
+
+    freed = 0;
+
+    jk_hash_free(htb);
+
+    BOLT_CHECK(freed == nums);
+}
+
+/*
+ * Borrowed keys were not copied, the table points to caller's key
+ */
+static void
+test_borrow_keys()
+{
+    jk_hash_t *htb;
+    char *keys[64], *value;
+    int i;
+
+    htb = jk_hash_new(0, NULL, NULL);
+    jk_hash_borrow_keys(htb);
+
+    for (i = 0; i < 64; i++) {
+        keys[i] = malloc(32);
+        sprintf(keys[i], "borrowed-%d", i);
+
+        BOLT_CHECK(jk_hash_insert(htb, keys[i], strlen(keys[i]),
+                                  keys[i], 0) == JK_HASH_OK);
+    }
+
+    for (i = 0; i < 64; i++) {
+        BOLT_CHECK(jk_hash_find(htb, keys[i], strlen(keys[i]),
+                                (void **)&value) == JK_HASH_OK
+                   && value == keys[i]);
+    }
+
+    for (i = 0; i < 32; i++) {
+        BOLT_CHECK(jk_hash_remove(htb, keys[i], strlen(keys[i]))
+                   == JK_HASH_OK);
+        free(keys[i]);
+    }
+
+    jk_hash_free(htb);
+
+    for (i = 32; i < 64; i++) {
+        free(keys[i]);
+    }
+}
+
+/*
+ * Same loops against the old chained table and the open addressing
+ * one, misses look up keys of the same shape which were not inserted.
+ */
+
+#define TEST_BENCH_INSERT  0
+#define TEST_BENCH_HIT     1
+#define TEST_BENCH_MISS    2
+#define TEST_BENCH_REMOVE  3
+#define TEST_BENCH_LOOPS   4
+
+static char *test_bench_names[TEST_BENCH_LOOPS] = {
+    "insert (grow from empty)", "find (hit)", "find (miss)", "remove"
+};
+
+static void
+test_bench_chain(char (*keys)[64], int *lens, char (*misses)[64],
+    int *mlens, int n, double *usec)
+{
+    jk_chain_t *htb;
+    int i, k;
+    void *value;
+    double start;
+
+    htb = jk_chain_new(0, NULL, NULL);
+
+    start = bolt_test_usec();
+    for (i = 0; i < n; i++) {
+        jk_chain_insert(htb, keys[i], lens[i], (void *)(long)i, 0);
+    }
+    usec[TEST_BENCH_INSERT] = bolt_test_usec() - start;
+
+    start = bolt_test_usec();
+    for (i = 0; i < n; i++) {
+        k = (long)i * 7919 % n;   /* Not the inserted order */
+        jk_chain_find(htb, keys[k], lens[k], &value);
+    }
+    usec[TEST_BENCH_HIT] = bolt_test_usec() - start;
+
+    start = bolt_test_usec();
+    for (i = 0; i < n; i++) {
+        jk_chain_find(htb, misses[i], mlens[i], &value);
+    }
+    usec[TEST_BENCH_MISS] = bolt_test_usec() - start;
+
+    start = bolt_test_usec();
+    for (i = 0; i < n; i++) {
+        jk_chain_remove(htb, keys[i], lens[i]);
+    }
+    usec[TEST_BENCH_REMOVE] = bolt_test_usec() - start;
+
+    jk_chain_free(htb);
+}
+
+static void
+test_bench_open(char (*keys)[64], int *lens, char (*misses)[64],
+    int *mlens, int n, double *usec)
+{
+    jk_hash_t *htb;
+    int i, k;
+    void *value;
+    double start;
+
+    htb = jk_hash_new(0, NULL, NULL);
+
+    start = bolt_test_usec();
+    for (i = 0; i < n; i++) {
+        jk_hash_insert(htb, keys[i], lens[i], (void *)(long)i, 0);
+    }
+    usec[TEST_BENCH_INSERT] = bolt_test_usec() - start;
+
+    start = bolt_test_usec();
+    for (i = 0; i < n; i++) {
+        k = (long)i * 7919 % n;
+        jk_hash_find(htb, keys[k], lens[k], &value);
+    }
+    usec[TEST_BENCH_HIT] = bolt_test_usec() - start;
+
+    start = bolt_test_usec();
+    for (i = 0; i < n; i++) {
+        jk_hash_find(htb, misses[i], mlens[i], &value);
+    }
+    usec[TEST_BENCH_MISS] = bolt_test_usec() - start;
+
+    start = bolt_test_usec();
+    for (i = 0; i < n; i++) {
+        jk_hash_remove(htb, keys[i], lens[i]);
+    }
+    usec[TEST_BENCH_REMOVE] = bolt_test_usec() - start;
+
+    jk_hash_free(htb);
+}
+
+static void
+test_bench()
+{
+    char (*keys)[64], (*misses)[64];
+    int *lens, *mlens, i, n = 1000000;
+    double chain[TEST_BENCH_LOOPS], open[TEST_BENCH_LOOPS];
+
+    keys = malloc(n * sizeof(*keys));
+    lens = malloc(n * sizeof(int));
+    misses = malloc(n * sizeof(*misses));
+    mlens = malloc(n * sizeof(int));
+
+    for (i = 0; i < n; i++) {
+        lens[i] = test_key(keys[i], i);
+        mlens[i] = test_key(misses[i], n + i);
+    }
+
+    test_bench_chain(keys, lens, misses, mlens, n, chain);
+    test_bench_open(keys, lens, misses, mlens, n, open);
+
+    printf("  %-7d keys %28s %14s %9s\n", n, "chained", "open", "speedup");
+
+    for (i = 0; i < TEST_BENCH_LOOPS; i++) {
+        printf("  %-26s %8.1f ns/op %8.1f ns/op %8.2fx\n",
+               test_bench_names[i],
+               chain[i] * 1000.0 / n, open[i] * 1000.0 / n,
+               chain[i] / (open[i] + 1));
+    }
+
+    free(keys);
+    free(lens);
+    free(misses);
+    free(mlens);
+}
+
+int
+main(int argc, char **argv)
+{
+    bolt_test_init("test_hash", argc, argv);
+
+    test_model(jk_hash_calc, TEST_KEYS);
+    test_model(jk_hash_calc, 100);      /* Deleted buckets churn */
+    test_model(test_weak_hash, 2000);   /* Long probing */
+    test_borrow_keys();
+
+    if (bolt_test_bench) {
+        test_bench();
+    }
+
+    return bolt_test_done();
+}
@@ -0,0 +1,210 @@
+/*
+ * Bolt - The Realtime Image Compress System
+ * Copyright (c) 2015 - 2016, Liexusong <280259971@qq.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../bolt.h"
+#include "../image.h"
+#include "test.h"
+
+/*
+ * Check the DCT scaled decoding by size hint: the decoded image is
+ * never smaller than the hint and uses the largest scale allowed.
+ * With -b it compares the per-image latency of full size and hinted
+ * decoding, of a generated 24MP JPEG or the JPEG files given.
+ */
+
+static char test_path[] = "/tmp/bolt-test-XXXXXX";
+
+/*
+ * Photo-like source, gradients with noise so the DCT has work to do
+ */
+static int
+test_make_jpeg(char *path, int width, int height)
+{
+    bolt_image_t img;
+    unsigned char *p;
+    char *blob;
+    size_t size;
+    FILE *fp;
+    int x, y, ok;
+
+    img.width = width;
+    img.height = height;
+    img.channels = 3;
+    img.pixels = malloc((size_t)width * height * 3 + BOLT_IMAGE_PADDING);
+
+    p = img.pixels;
+
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x++) {
+            *p++ = (x * 255 / width + bolt_test_random() % 16) & 0xFF;
+            *p++ = (y * 255 / height + bolt_test_random() % 16) & 0xFF;
+            *p++ = ((x ^ y) & 0x3F) + 96;
+        }
+    }
+
+    blob = bolt_image_encode_jpeg(&img, 90, &size, NULL, NULL);
+
+    bolt_image_free(&img);
+
+    if (blob == NULL) {
+        return -1;
+    }
+
+    fp = fopen(path, "wb");
+    ok = fp && fwrite(blob, size, 1, fp) == 1;
+
+    if (fp) {
+        fclose(fp);
+    }
+
+    free(blob);
+
+    return ok ? 0 : -1;
+}
+
+static void
+test_decode_hint(int width, int height)
+{
+    static int hints[][2] = {
+        {0, 0}, {100, 100}, {128, 96}, {200, 40}, {400, 300},
+        {640, 480}, {1000, 10}, {1500, 1000}, {4000, 4000}
+    };
+    bolt_image_t img;
+    int i, hw, hh, denom;
+
+    BOLT_CHECK(test_make_jpeg(test_path, width, height) == 0);
+
+    for (i = 0; i < sizeof(hints) / sizeof(hints[0]); i++) {
+
+        hw = hints[i][0];
+        hh = hints[i][1];
+
+        BOLT_CHECK(bolt_image_decode_jpeg(test_path, hw, hh, &img) == 0);
+
+        /* Never smaller than the hint, unless the source is */
+        BOLT_CHECK(img.width >= (hw < width ? hw : width));
+        BOLT_CHECK(img.height >= (hh < height ? hh : height));
+        BOLT_CHECK(img.channels == 3);
+
+        /* The scale is one of 1/1, 1/2, 1/4, 1/8 ... */
+        denom = (width + img.width - 1) / img.width;
+
+        BOLT_CHECK(denom == 1 || denom == 2 || denom == 4 || denom == 8);
+        BOLT_CHECK(img.width == (width + denom - 1) / denom);
+        BOLT_CHECK(img.height == (height + denom - 1) / denom);
+
+        /* ... and the next smaller scale would be too small */
+        if (hw > 0 && hh > 0 && denom < 8) {
+            BOLT_CHECK((width + denom * 2 - 1) / (denom * 2) < hw
+                       || (height + denom * 2 - 1) / (denom * 2) < hh);
+        }
+
+        if (hw == 0) {
+            BOLT_CHECK(img.width == width && img.height == height);
+        }
+
+        bolt_image_free(&img);
+    }
+
+    unlink(test_path);
+}
+
+static double
+test_decode_usec(char *path, int hw, int hh, int rounds)
+{
+    bolt_image_t img;
+    double start;
+    int i;
+
+    start = bolt_test_usec();
+
+    for (i = 0; i < rounds; i++) {
+        if (bolt_image_decode_jpeg(path, hw, hh, &img) == -1) {
+            return -1.0;
+        }
+        bolt_image_free(&img);
+    }
+
+    return (bolt_test_usec() - start) / rounds;
+}
+
+static void
+test_bench_file(char *path)
+{
+    static int hints[][2] = {{0, 0}, {1024, 768}, {400, 300}, {100, 100}};
+    double usec;
+    int i;
+
+    printf("  %s\n", path);
+
+    for (i = 0; i < sizeof(hints) / sizeof(hints[0]); i++) {
+        usec = test_decode_usec(path, hints[i][0], hints[i][1], 5);
+
+        if (usec < 0) {
+            printf("    not decodable by libjpeg\n");
+            return;
+        }
+
+        if (hints[i][0]) {
+            printf("    decode for %4dx%-4d %10.2f ms/image\n",
+                   hints[i][0], hints[i][1], usec / 1000);
+        } else {
+            printf("    decode full size     %10.2f ms/image\n",
+                   usec / 1000);
+        }
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    int i, fd, files = 0;
+
+    bolt_test_init("test_image", argc, argv);
+
+    fd = mkstemp(test_path);
+    BOLT_CHECK(fd != -1);
+    close(fd);
+
+    test_decode_hint(4000, 3000);
+    test_decode_hint(4001, 2999);  /* Partial MCU at the edges */
+    test_decode_hint(333, 77);
+
+    if (bolt_test_bench) {
+        for (i = 1; i < argc; i++) {
+            if (argv[i][0] != '-') {
+                test_bench_file(argv[i]);
+                files++;
+            }
+        }
+
+        if (files == 0 && test_make_jpeg(test_path, 6000, 4000) == 0) {
+            test_bench_file(test_path);
+            unlink(test_path);
+        }
+    }
+
+    return bolt_test_done();
+}
@@ -0,0 +1,359 @@
+/*
+ * Bolt - The Realtime Image Compress System
+ * Copyright (c) 2015 - 2016, Liexusong <280259971@qq.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * The resampler's tables and passes are private, test them in place
+ */
+#include "../image.c"
+#include "test.h"
+
+/*
+ * Check the fixed-point filter tables, that SSE2 and AVX2 passes are
+ * bit-identical to the C passes, and the PSNR against a floating point
+ * resize done the way ImageMagick does with CatromFilter. With -b it
+ * prints the speed of every pass.
+ */
+
+#define TEST_MIN_PSNR  45.0
+
+typedef struct {
+    char *name;
+    bolt_resample_h_t h;
+    bolt_resample_v_t v;
+} test_passes_t;
+
+static test_passes_t test_passes[3];
+static int test_passes_num;
+
+static void
+test_init_passes()
+{
+    bolt_image_t src, dst;
+
+    /* Let resize select passes first, then it uses ours */
+    src.width = src.height = 1;
+    src.channels = 3;
+    src.pixels = calloc(1, 3 + BOLT_IMAGE_PADDING);
+
+    bolt_image_resize(&src, &dst, 1, 1);
+
+    bolt_image_free(&src);
+    bolt_image_free(&dst);
+
+    test_passes[test_passes_num].name = "C";
+    test_passes[test_passes_num].h = bolt_resample_h_c;
+    test_passes[test_passes_num++].v = bolt_resample_v_c;
+
+#if defined(BOLT_HAVE_SIMD)
+    if (__builtin_cpu_supports("sse2")) {
+        test_passes[test_passes_num].name = "SSE2";
+        test_passes[test_passes_num].h = bolt_resample_h_sse2;
+        test_passes[test_passes_num++].v = bolt_resample_v_sse2;
+    }
+
+    if (__builtin_cpu_supports("avx2")) {
+        test_passes[test_passes_num].name = "AVX2";
+        test_passes[test_passes_num].h = bolt_resample_h_avx2;
+        test_passes[test_passes_num++].v = bolt_resample_v_avx2;
+    }
+#endif
+}
+
+static void
+test_use_passes(test_passes_t *p)
+{
+    bolt_resample_h = p->h;
+    bolt_resample_v = p->v;
+}
+
+/*
+ * Photo-like pixels, smooth gradients, edges and some noise
+ */
+static void
+test_make_image(bolt_image_t *img, int width, int height, int ch)
+{
+    unsigned char *p;
+    int x, y, k;
+
+    img->width = width;
+    img->height = height;
+    img->channels = ch;
+    img->pixels = malloc((size_t)width * height * ch + BOLT_IMAGE_PADDING);
+
+    p = img->pixels;
+
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x++) {
+            for (k = 0; k < ch; k++) {
+                int v = (x * (k + 1) * 255 / width + y * 255 / height) / 2;
+
+                if (((x / 37) + (y / 29)) % 5 == 0) {
+                    v = 255 - v;    /* Sharp edges, ringing of Catrom */
+                }
+
+                *p++ = (v + bolt_test_random() % 9) & 0xFF;
+            }
+        }
+    }
+}
+
+static void
+test_filter_tables()
+{
+    static int sizes[][2] = {
+        {1, 1}, {1, 9}, {7, 1}, {640, 100}, {100, 640}, {4000, 31},
+        {333, 332}, {5, 3}, {3, 5}
+    };
+    bolt_filter_t *f;
+    int i, x, j, sum;
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+
+        f = bolt_image_get_filter(sizes[i][0], sizes[i][1]);
+        BOLT_CHECK(f != NULL);
+
+        for (x = 0; x < f->out_size; x++) {
+            sum = 0;
+            for (j = 0; j < f->taps; j++) {
+                sum += f->weights[(size_t)x * f->taps + j];
+            }
+
+            BOLT_CHECK(sum == 1 << BOLT_FILTER_BITS);
+            BOLT_CHECK(f->start[x] >= 0
+                       && f->start[x] + f->taps <= f->in_size);
+        }
+
+        /* Cached, the same table comes back */
+        BOLT_CHECK(bolt_image_get_filter(sizes[i][0], sizes[i][1]) == f);
+    }
+}
+
+/*
+ * Every SIMD pass gives exactly what the C pass gives
+ */
+static void
+test_passes_identical()
+{
+    bolt_image_t src, ref, dst;
+    int i, p, sw, sh, dw, dh, ch, same = 1;
+
+    for (i = 0; i < 300; i++) {
+
+        sw = 1 + bolt_test_random() % (i < 100 ? 16 : 700);
+        sh = 1 + bolt_test_random() % (i < 100 ? 16 : 500);
+        dw = 1 + bolt_test_random() % (i % 3 ? sw : sw * 3);
+        dh = 1 + bolt_test_random() % (i % 3 ? sh : sh * 3);
+        ch = i % 4 == 0 ? 4 : 3;
+
+        test_make_image(&src, sw, sh, ch);
+
+        test_use_passes(&test_passes[0]);
+        BOLT_CHECK(bolt_image_resize(&src, &ref, dw, dh) == 0);
+
+        for (p = 1; p < test_passes_num; p++) {
+            test_use_passes(&test_passes[p]);
+            BOLT_CHECK(bolt_image_resize(&src, &dst, dw, dh) == 0);
+
+            same &= memcmp(ref.pixels, dst.pixels,
+                           (size_t)dw * dh * ch) == 0;
+
+            bolt_image_free(&dst);
+        }
+
+        bolt_image_free(&ref);
+        bolt_image_free(&src);
+    }
+
+    BOLT_CHECK(same);
+}
+
+/*
+ * Resize by doubles like ImageMagick's HorizontalFilter() and
+ * VerticalFilter() with CatromFilter, the support was widened by
+ * downscale factor and the weights out of image were dropped.
+ */
+static void
+test_reference_axis(double *src, int in, int out, int count,
+    int step, int stride, double *dst)
+{
+    double scale = (double)in / out;
+    double fscale = scale > 1.0 ? scale : 1.0;
+    double support = 2.0 * fscale;
+    double center, density, w, acc;
+    int i, j, n, start, stop;
+
+    for (i = 0; i < out; i++) {
+
+        center = (i + 0.5) * scale;
+        start = (int)(center - support + 0.5);
+        stop = (int)(center + support + 0.5);
+        start = start < 0 ? 0 : start;
+        stop = stop > in ? in : stop;
+
+        for (n = 0; n < count; n++) {
+            density = 0.0;
+            acc = 0.0;
+
+            for (j = start; j < stop; j++) {
+                w = bolt_image_catrom((float)((j - center + 0.5) / fscale));
+                density += w;
+                acc += w * src[(size_t)j * stride + n * step];
+            }
+
+            dst[(size_t)i * stride + n * step] =
+                density != 0.0 ? acc / density : 0.0;
+        }
+    }
+}
+
+static double
+test_psnr(bolt_image_t *src, int dw, int dh)
+{
+    bolt_image_t dst;
+    double *a, *b, *c, mse = 0.0, v;
+    int sw = src->width, sh = src->height, ch = src->channels;
+    size_t i, n;
+
+    n = (size_t)sw * sh * ch;
+    a = malloc(n * sizeof(double));
+    b = malloc((size_t)dw * sh * ch * sizeof(double));
+    c = malloc((size_t)dw * dh * ch * sizeof(double));
+
+    for (i = 0; i < n; i++) {
+        a[i] = src->pixels[i];
+    }
+
+    /* Rows, pixels of row are ch apart, then columns */
+    for (i = 0; i < (size_t)sh; i++) {
+        test_reference_axis(a + i * sw * ch, sw, dw, ch, 1, ch,
+                            b + i * dw * ch);
+    }
+
+    test_reference_axis(b, sh, dh, dw * ch, 1, dw * ch, c);
+
+    BOLT_CHECK(bolt_image_resize(src, &dst, dw, dh) == 0);
+
+    n = (size_t)dw * dh * ch;
+
+    for (i = 0; i < n; i++) {
+        v = c[i] < 0.0 ? 0.0 : (c[i] > 255.0 ? 255.0 : c[i]);
+        v = floor(v + 0.5) - dst.pixels[i];
+        mse += v * v;
+    }
+
+    bolt_image_free(&dst);
+
+    free(a);
+    free(b);
+    free(c);
+
+    mse /= n;
+
+    return mse == 0.0 ? 99.0 : 10.0 * log10(255.0 * 255.0 / mse);
+}
+
+static void
+test_reference_psnr()
+{
+    static int sizes[][4] = {
+        {640, 480, 100, 75}, {1000, 800, 333, 267}, {512, 512, 256, 256},
+        {300, 200, 299, 199}, {60, 40, 173, 129}, {1920, 1080, 64, 36}
+    };
+    bolt_image_t src;
+    double psnr;
+    int i;
+
+    test_use_passes(&test_passes[test_passes_num - 1]);
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+
+        test_make_image(&src, sizes[i][0], sizes[i][1], 3);
+
+        psnr = test_psnr(&src, sizes[i][2], sizes[i][3]);
+
+        if (bolt_test_bench) {
+            printf("  %4dx%-4d -> %4dx%-4d PSNR %6.2f dB\n",
+                   sizes[i][0], sizes[i][1], sizes[i][2], sizes[i][3], psnr);
+        }
+
+        BOLT_CHECK(psnr >= TEST_MIN_PSNR);
+
+        bolt_image_free(&src);
+    }
+}
+
+static void
+test_bench()
+{
+    static int sizes[][4] = {
+        {4000, 3000, 400, 300}, {1024, 768, 200, 150}, {640, 480, 1280, 960}
+    };
+    bolt_image_t src, dst;
+    double start, usec;
+    char name[64];
+    int i, p, r, rounds;
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+
+        test_make_image(&src, sizes[i][0], sizes[i][1], 3);
+
+        rounds = sizes[i][0] > 2000 ? 5 : 20;
+
+        for (p = 0; p < test_passes_num; p++) {
+            test_use_passes(&test_passes[p]);
+
+            start = bolt_test_usec();
+
+            for (r = 0; r < rounds; r++) {
+                bolt_image_resize(&src, &dst, sizes[i][2], sizes[i][3]);
+                bolt_image_free(&dst);
+            }
+
+            usec = bolt_test_usec() - start;
+
+            sprintf(name, "%dx%d -> %dx%d %s", sizes[i][0], sizes[i][1],
+                    sizes[i][2], sizes[i][3], test_passes[p].name);
+
+            printf("  %-36s %10.2f ms/image\n", name, usec / rounds / 1000);
+        }
+
+        bolt_image_free(&src);
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    bolt_test_init("test_resample", argc, argv);
+
+    test_init_passes();
+
+    test_filter_tables();
+    test_passes_identical();
+    test_reference_psnr();
+
+    if (bolt_test_bench) {
+        test_bench();
+    }
+
+    return bolt_test_done();
+}
@@ -0,0 +1,207 @@
+/*
+ * Bolt - The Realtime Image Compress System
+ * Copyright (c) 2015 - 2016, Liexusong <280259971@qq.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "../bolt.h"
+#include "../slab.h"
+#include "test.h"
+
+/*
+ * Check the slab classes, item alignment, that live items never
+ * overlap, and that the empty pages were returned to system.
+ */
+
+#define TEST_ITEMS  20000
+
+typedef struct {
+    unsigned char *item;
+    size_t size;
+} test_item_t;
+
+static test_item_t items[TEST_ITEMS];
+
+static size_t
+test_size()
+{
+    /* Mostly the size of cache struct and key, some inlined blobs */
+    switch (bolt_test_random() % 4) {
+    case 0:
+        return 1 + bolt_test_random() % 128;
+    case 1:
+        return 128 + bolt_test_random() % 1024;
+    case 2:
+        return 1024 + bolt_test_random() % 65536;
+    }
+
+    return 1 + bolt_test_random() % (BOLT_SLAB_PAGE_SIZE / 2);
+}
+
+static void
+test_fill(test_item_t *t, int i)
+{
+    memset(t->item, i & 0xFF, t->size);
+}
+
+static int
+test_verify(test_item_t *t, int i)
+{
+    size_t j;
+
+    for (j = 0; j < t->size; j++) {
+        if (t->item[j] != (i & 0xFF)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static void
+test_classes()
+{
+    size_t size, chunk, last = 0;
+
+    for (size = 1; size <= BOLT_SLAB_PAGE_SIZE; size += 37) {
+        chunk = bolt_slab_chunk_size(size);
+
+        BOLT_CHECK(chunk >= size);
+        BOLT_CHECK(chunk % 64 == 0);
+        BOLT_CHECK(chunk >= last);
+
+        /* Waste was bounded by the growth factor */
+        BOLT_CHECK(size < 128 || chunk <= size * 5 / 4 + 64);
+
+        last = chunk;
+    }
+}
+
+static void
+test_alloc_free()
+{
+    bolt_slab_t slab;
+    int i, k, ok = 1;
+
+    BOLT_CHECK(bolt_slab_init(&slab) == 0);
+
+    for (i = 0; i < TEST_ITEMS; i++) {
+        items[i].size = test_size();
+        items[i].item = bolt_slab_alloc(&slab, items[i].size);
+
+        BOLT_CHECK(items[i].item != NULL);
+        BOLT_CHECK(((uintptr_t)items[i].item & 63) == 0);
+
+        test_fill(&items[i], i);
+
+        /* Free a random one sometimes, so the freed items reused */
+        k = bolt_test_random() % (i + 1);
+
+        if (k % 3 == 0 && items[k].item) {
+            ok &= test_verify(&items[k], k);
+
+            bolt_slab_free(&slab, items[k].item, items[k].size);
+            items[k].item = NULL;
+        }
+    }
+
+    BOLT_CHECK(slab.resident <= slab.mapped);
+
+    for (i = 0; i < TEST_ITEMS; i++) {
+        if (items[i].item) {
+            ok &= test_verify(&items[i], i);
+
+            bolt_slab_free(&slab, items[i].item, items[i].size);
+        }
+    }
+
+    BOLT_CHECK(ok);
+
+    /* Only the spare page was kept */
+    BOLT_CHECK(slab.mapped <= BOLT_SLAB_PAGE_SIZE);
+    BOLT_CHECK(slab.resident <= slab.mapped);
+}
+
+static void
+test_bench()
+{
+    bolt_slab_t slab;
+    void **ptrs;
+    size_t *sizes;
+    int i, n = 1000000, live = 50000;
+    double start;
+
+    ptrs = calloc(live, sizeof(void *));
+    sizes = malloc(n * sizeof(size_t));
+
+    for (i = 0; i < n; i++) {
+        sizes[i] = 128 + bolt_test_random() % 2048;
+    }
+
+    bolt_slab_init(&slab);
+
+    start = bolt_test_usec();
+    for (i = 0; i < n; i++) {
+        if (ptrs[i % live]) {
+            bolt_slab_free(&slab, ptrs[i % live], sizes[i - live]);
+        }
+        ptrs[i % live] = bolt_slab_alloc(&slab, sizes[i]);
+    }
+    BOLT_BENCH("bolt_slab_alloc + bolt_slab_free", n,
+               bolt_test_usec() - start);
+
+    for (i = 0; i < live; i++) {
+        bolt_slab_free(&slab, ptrs[i], sizes[n - live + i]);
+        ptrs[i] = NULL;
+    }
+
+    start = bolt_test_usec();
+    for (i = 0; i < n; i++) {
+        free(ptrs[i % live]);
+        ptrs[i % live] = malloc(sizes[i]);
+    }
+    BOLT_BENCH("malloc + free", n, bolt_test_usec() - start);
+
+    for (i = 0; i < live; i++) {
+        free(ptrs[i]);
+    }
+
+    free(ptrs);
+    free(sizes);
+}
+
+int
+main(int argc, char **argv)
+{
+    bolt_test_init("test_slab", argc, argv);
+
+    bolt_init_slab_classes();
+
+    test_classes();
+    test_alloc_free();
+
+    if (bolt_test_bench) {
+        test_bench();
+    }
+
+    return bolt_test_done();
+}
@@ -342,3 +342,29 @@ bolt_format_time(char *buf, time_t t)
                                   tm.tm_min,
                                   tm.tm_sec);
 }
+
+/*
+ * Monotonic clock in microseconds, used to measure intervals
+ */
+uint64_t
+bolt_usec_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * CPU time of current thread in microseconds
+ */
+uint64_t
+bolt_cpu_usec_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
@@ -4,5 +4,7 @@
 time_t bolt_parse_time(char *value, size_t len);
 void bolt_gmtime(time_t t, struct tm *tp);
 size_t bolt_format_time(char *buf, time_t t);
+uint64_t bolt_usec_now();
+uint64_t bolt_cpu_usec_now();
 
 #endif
@@ -0,0 +1,437 @@
+/*
+ * Bolt - The Realtime Image Compress System
+ * Copyright (c) 2015 - 2016, Liexusong <280259971@qq.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "../bolt.h"
+#include "../cache.h"
+#include "../policy.h"
+
+/*
+ * Replay an access trace through the cache policies (the same code
+ * as the server, cache.c and policy.c) and print their hit ratios.
+ *
+ * The trace is an access log (common or combined format, the path of
+ * request and the bytes sent were used), or lines of "key size [cost]".
+ * Without trace file a synthetic one was used: hot thumbnails mixed
+ * with a crawler which requests rare sizes once.
+ *
+ * usage: policy_sim [-m max-cache] [-s shards] [-g gc-threshold]
+ *                   [-n requests] [trace]
+ */
+
+bolt_setting_t *setting, _setting;
+bolt_service_t *service, _service;
+
+typedef struct {
+    char key[BOLT_FILENAME_LENGTH];
+    int klen;
+    int size;
+    int cost;
+} bolt_sim_access_t;
+
+typedef struct {
+    char *name;
+    int policy;
+    long long requests;
+    long long hits;
+    long long bytes;
+    long long hit_bytes;
+    long long cost;         /* Regenerating cost of misses */
+} bolt_sim_result_t;
+
+static bolt_sim_access_t *accesses;
+static int accesses_num;
+static int accesses_cap;
+
+static long long
+bolt_sim_parse_size(char *value)
+{
+    char *end;
+    long long size = strtoll(value, &end, 10);
+
+    switch (*end) {
+    case 'k': case 'K':
+        return size * 1024;
+    case 'm': case 'M':
+        return size * 1024 * 1024;
+    case 'g': case 'G':
+        return size * 1024 * 1024 * 1024;
+    }
+
+    return size;
+}
+
+/*
+ * Cost was unknown from access log, estimated by output pixels
+ * of the file name like "name-100x100_75.jpg"
+ */
+static int
+bolt_sim_pixels(char *key)
+{
+    char *dash = strrchr(key, '-');
+    int width, height;
+
+    if (dash && sscanf(dash + 1, "%dx%d_", &width, &height) == 2) {
+        return width * height;
+    }
+
+    return 10000;
+}
+
+static int
+bolt_sim_add(char *key, int klen, int size, int cost)
+{
+    bolt_sim_access_t *a;
+
+    if (klen <= 0 || klen >= BOLT_FILENAME_LENGTH || size <= 0) {
+        return -1;
+    }
+
+    if (accesses_num == accesses_cap) {
+        a = realloc(accesses, (accesses_cap ? accesses_cap * 2 : 1024)
+                              * sizeof(*a));
+        if (a == NULL) {
+            return -1;
+        }
+        accesses = a;
+        accesses_cap = accesses_cap ? accesses_cap * 2 : 1024;
+    }
+
+    a = &accesses[accesses_num++];
+
+    memcpy(a->key, key, klen);
+    a->key[klen] = 0;
+    a->klen = klen;
+    a->size = size;
+    a->cost = cost > 0 ? cost : bolt_sim_pixels(a->key);
+
+    return 0;
+}
+
+/*
+ * One line of access log: ... "GET /path HTTP/1.1" 200 12345 ...
+ * or "key size [cost]"
+ */
+static void
+bolt_sim_parse_line(char *line)
+{
+    char key[BOLT_FILENAME_LENGTH], *begin, *end;
+    int status, size, cost = 0;
+
+    begin = strstr(line, "\"GET ");
+
+    if (begin) {
+        begin += 5;
+        end = strchr(begin, ' ');
+
+        if (end && end - begin < BOLT_FILENAME_LENGTH
+            && (end = strchr(end, '"')) != NULL
+            && sscanf(end + 1, "%d %d", &status, &size) == 2
+            && status == 200)
+        {
+            bolt_sim_add(begin, strchr(begin, ' ') - begin, size, 0);
+        }
+
+        return;
+    }
+
+    if (sscanf(line, "%1023s %d %d", key, &size, &cost) >= 2) {
+        bolt_sim_add(key, strlen(key), size, cost);
+    }
+}
+
+static int
+bolt_sim_load(char *file)
+{
+    char line[4096];
+    FILE *fp;
+
+    fp = fopen(file, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to open trace file `%s'\n", file);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        bolt_sim_parse_line(line);
+    }
+
+    fclose(fp);
+
+    return 0;
+}
+
+static uint64_t
+bolt_sim_random()
+{
+    static uint64_t x = 88172645463325252ULL;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+
+    return x;
+}
+
+/*
+ * Hot thumbnails of popular sources with skewed popularity, and a
+ * crawler sweeping the rare sizes of all sources, once each.
+ */
+static void
+bolt_sim_synthetic(int requests)
+{
+    char key[128];
+    int i, src, width, klen;
+    double r;
+
+    for (i = 0; i < requests; i++) {
+
+        if (bolt_sim_random() % 10 < 3) {
+            src = bolt_sim_random() % 100000;
+            width = 40 + bolt_sim_random() % 1200;
+        } else {
+            r = (double)(bolt_sim_random() % 1000000) / 1000000.0;
+            src = (int)(20000 * r * r * r);     /* Skewed to small ids */
+            width = 100 << (src % 3);
+        }
+
+        klen = sprintf(key, "/photo/%d-%dx%d_75.jpg", src, width, width);
+
+        bolt_sim_add(key, klen, width * width / 8 + 200, 0);
+    }
+}
+
+static void
+bolt_sim_init_cache(int policy, int shards)
+{
+    memset(service, 0, sizeof(*service));
+
+    service->current_time = time(NULL);
+
+    setting->cache_policy = policy;
+
+    if (bolt_init_cache(shards) == -1) {
+        exit(1);
+    }
+}
+
+static void
+bolt_sim_destroy_cache()
+{
+    bolt_cache_shard_t *shard;
+    bolt_cache_t *cache;
+    int i;
+
+    for (i = 0; i < service->cache_shards_num; i++) {
+
+        shard = &service->cache_shards[i];
+
+        while ((cache = bolt_cache_policy->victim(shard)) != NULL) {
+            bolt_cache_evict(shard, cache);
+        }
+
+        jk_hash_free(shard->htb);
+        free(shard->sketch.counters);
+        free(shard->heap);
+    }
+
+    free(service->cache_shards);
+}
+
+/*
+ * As GC thread does when memory usage reached max-cache
+ */
+static void
+bolt_sim_gc()
+{
+    bolt_cache_shard_t *shard;
+    bolt_cache_t *cache;
+    int i, keepsize;
+
+    if (bolt_cache_memory_usage() < setting->max_cache) {
+        return;
+    }
+
+    keepsize = bolt_cache_shard_capacity();
+
+    for (i = 0; i < service->cache_shards_num; i++) {
+
+        shard = &service->cache_shards[i];
+
+        while (shard->memory_usage > keepsize
+               && (cache = bolt_cache_policy->victim(shard)) != NULL)
+        {
+            bolt_cache_evict(shard, cache);
+        }
+    }
+}
+
+static void
+bolt_sim_replay(bolt_sim_result_t *result, int shards)
+{
+    bolt_sim_access_t *a;
+    bolt_cache_shard_t *shard;
+    bolt_cache_t *cache;
+    uint64_t hashval;
+    int i;
+
+    bolt_sim_init_cache(result->policy, shards);
+
+    for (i = 0; i < accesses_num; i++) {
+
+        a = &accesses[i];
+
+        hashval = jk_hash_calc(a->key, a->klen);
+        shard = bolt_cache_get_shard(hashval);
+
+        result->requests++;
+        result->bytes += a->size;
+
+        /* Request path of reactor */
+
+        bolt_cache_policy->access(shard, hashval);
+
+        if (jk_hash_find_hash(shard->htb, a->key, a->klen,
+                              hashval, (void **)&cache) == JK_HASH_OK)
+        {
+            bolt_cache_policy->hit(shard, cache);
+
+            result->hits++;
+            result->hit_bytes += a->size;
+            continue;
+        }
+
+        result->cost += a->cost;
+
+        /* Insert path of worker, the blob itself was not needed */
+
+        cache = bolt_cache_new(shard, a->key, a->klen, NULL, a->size, -1);
+        if (cache == NULL) {
+            fprintf(stderr, "Not enough memory\n");
+            exit(1);
+        }
+
+        cache->hashval = hashval;
+        cache->time = service->current_time;
+        cache->life_time = cache->time + setting->cache_life;
+        cache->cost = a->cost;
+
+        if (jk_hash_insert_hash(shard->htb, cache->filename, cache->fnlen,
+                                hashval, cache, 0) == JK_HASH_OK)
+        {
+            bolt_cache_incref(cache);
+            bolt_cache_policy->insert(shard, cache);
+        }
+
+        bolt_cache_decref(cache);
+
+        bolt_sim_gc();
+    }
+
+    bolt_sim_destroy_cache();
+}
+
+int
+main(int argc, char **argv)
+{
+    bolt_sim_result_t results[] = {
+        {"lru",     BOLT_CACHE_POLICY_LRU},
+        {"tinylfu", BOLT_CACHE_POLICY_TINYLFU},
+        {"gdsf",    BOLT_CACHE_POLICY_GDSF},
+    };
+    bolt_sim_result_t *r;
+    int shards = 16, requests = 1000000;
+    long long max_cache = 64 * 1024 * 1024;
+    int i, opt;
+
+    setting = &_setting;
+    service = &_service;
+
+    setting->gc_threshold = 80;
+    setting->cache_life = 3600;
+
+    while ((opt = getopt(argc, argv, "m:s:g:n:")) != -1) {
+        switch (opt) {
+        case 'm':
+            max_cache = bolt_sim_parse_size(optarg);
+            break;
+        case 's':
+            shards = atoi(optarg);
+            break;
+        case 'g':
+            setting->gc_threshold = atoi(optarg);
+            break;
+        case 'n':
+            requests = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-m max-cache] [-s shards] "
+                    "[-g gc-threshold] [-n requests] [trace]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    /* The same bounds as configure */
+    if (shards < 1 || shards > BOLT_MAX_CACHE_SHARDS
+        || max_cache < BOLT_MIN_CACHE_SIZE || max_cache > 0x7fffffff)
+    {
+        fprintf(stderr, "Invalid cache size or shards\n");
+        return 1;
+    }
+
+    setting->max_cache = (int)max_cache;
+
+    if (optind < argc) {
+        if (bolt_sim_load(argv[optind]) == -1) {
+            return 1;
+        }
+    } else {
+        bolt_sim_synthetic(requests);
+    }
+
+    if (accesses_num == 0) {
+        fprintf(stderr, "No request was found in trace\n");
+        return 1;
+    }
+
+    printf("%d requests, max-cache %d bytes, %d shards, gc-threshold %d%%\n",
+           accesses_num, setting->max_cache, shards, setting->gc_threshold);
+
+    printf("%-10s %12s %10s %15s %15s\n", "policy", "hits",
+           "hit ratio", "byte hit ratio", "miss cost");
+
+    for (i = 0; i < sizeof(results) / sizeof(results[0]); i++) {
+
+        r = &results[i];
+
+        bolt_sim_replay(r, shards);
+
+        printf("%-10s %12lld %10.4f %15.4f %15lld\n", r->name, r->hits,
+               (double)r->hits / r->requests,
+               (double)r->hit_bytes / r->bytes, r->cost);
+    }
+
+    return 0;
+}
@@ -20,20 +20,45 @@
  */
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/stat.h>
 #include "compat.h"
 #include "bolt.h"
+#include "cache.h"
 #include "utils.h"
 #include "time.h"
+#include "worker.h"
+#include "stats.h"
+#include "image.h"
+#include "numa.h"
+#include "stream.h"
+#include "policy.h"
+
+#define BOLT_WORKER_STEAL_INTERVAL  100  /* Idle worker try to steal (ms) */
+#define BOLT_WORKER_MAX_VARIANTS    16   /* Max variants of one decoding */
+
+typedef struct {
+    bolt_task_t *task;
+    int width;
+    int height;
+} bolt_variant_t;
 
 typedef struct {
-    int  width;
-    int  height;
-    int  quality;
-    char format[32];
+    MagickWand *wand;
+    time_t mtime;         /* mtime of source file */
+    time_t time;          /* Decoded time */
+    time_t last;          /* Last used time */
+    int hint_width;       /* Decoded by size hint, 0 is full size */
+    int hint_height;
     char path[BOLT_FILENAME_LENGTH];
-} bolt_job_t;
+} bolt_decode_entry_t;
+
+static bolt_decode_entry_t *bolt_decode_cache;
+static pthread_mutex_t bolt_decode_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static MagickWand *bolt_watermark_wand = NULL;
 static int bolt_watermark_width;
@@ -44,11 +69,11 @@ static char *support_formats[] = {
 };
 
 /**
- * Parse task to compress job
+ * Parse file name to compress job
  * like: "ooooooooo-00x00_00.webp"
  */
-bolt_job_t *
-bolt_worker_get_job(bolt_task_t *task)
+static int
+bolt_worker_parse_job(char *filename, int fnlen, bolt_job_t *job)
 {
     enum {
         BOLT_PT_GET_EXT = 0,
@@ -58,15 +83,13 @@ bolt_worker_get_job(bolt_task_t *task)
         BOLT_PT_GET_FOUND,
     } state = BOLT_PT_GET_EXT;
 
-    char *start = task->filename;
-    char *ptail = task->filename + task->fnlen - 1;
+    char *start = filename;
+    char *ptail = filename + fnlen - 1;
     char *pcurr;
     char buf[32], format[32] = {0};
     int last = 0;
     char ch;
     int width = 0, height = 0, quality = 0;
-    int fnlen;
-    bolt_job_t *job;
     char *path;
     int plen;
 
@@ -85,7 +108,7 @@ bolt_worker_get_job(bolt_task_t *task)
                     memcpy(format, pcurr + 1, len);
                     bolt_strtoupper(format, len);
                 } else {
-                    return NULL;
+                    return -1;
                 }
 
                 state = BOLT_PT_GET_QUALITY;
@@ -99,14 +122,14 @@ bolt_worker_get_job(bolt_task_t *task)
             if (ch == '_') {
                 int len = ptail - pcurr;
 
-                if (len > 0) {
+                if (len > 0 && len < 32) {
                     memcpy(buf, pcurr + 1, len);
                     buf[len] = 0;
                     quality = atoi(buf);
                 }
 
                 if (quality <= 0) {
-                    return NULL;
+                    return -1;
                 }
 
                 state = BOLT_PT_GET_HEIGHT;
@@ -120,14 +143,14 @@ bolt_worker_get_job(bolt_task_t *task)
             if (ch == 'x') {
                 int len = ptail - pcurr;
 
-                if (len > 0) {
+                if (len > 0 && len < 32) {
                     memcpy(buf, pcurr + 1, len);
                     buf[len] = 0;
                     height = atoi(buf);
                 }
 
                 if (height <= 0) {
-                    return NULL;
+                    return -1;
                 }
 
                 state = BOLT_PT_GET_WIDTH;
@@ -141,14 +164,14 @@ bolt_worker_get_job(bolt_task_t *task)
             if (ch == '-') {
                 int len = ptail - pcurr;
 
-                if (len > 0) {
+                if (len > 0 && len < 32) {
                     memcpy(buf, pcurr + 1, len);
                     buf[len] = 0;
                     width = atoi(buf);
                 }
 
                 if (width <= 0) {
-                    return NULL;
+                    return -1;
                 }
 
                 state = BOLT_PT_GET_FOUND;
@@ -171,14 +194,9 @@ bolt_worker_get_job(bolt_task_t *task)
 
     if (state != BOLT_PT_GET_FOUND
         || fnlen <= 0
-        || setting->path_len + fnlen + 1 > BOLT_FILENAME_LENGTH)
+        || setting->path_len + fnlen + sizeof(".jpg") > BOLT_FILENAME_LENGTH)
     {
-        return NULL;
-    }
-
-    job = malloc(sizeof(*job));
-    if (job == NULL) {
-        return NULL;
+        return -1;
     }
 
     job->width   = width;
@@ -198,7 +216,7 @@ bolt_worker_get_job(bolt_task_t *task)
     last += fnlen;
     memcpy(job->path + last, ".jpg\0", 5);
 
-    return job;
+    return 0;
 }
 
 int bolt_format_support(char *format)
@@ -213,25 +231,41 @@ int bolt_format_support(char *format)
     return -1;
 }
 
-char *
-bolt_worker_compress(
-    char *path, int quality, int width,
-    int height, char *format, size_t *size)
+/*
+ * Read source image and add watermark, the returned wand
+ * is the base of all variants. Decoder may scale down the
+ * image to hint size (0 means full size).
+ */
+static MagickWand *
+bolt_worker_decode(char *path, int hint_width, int hint_height)
 {
-    MagickWand *wand = NULL;
+    MagickWand *wand;
     int orig_width, orig_height;
-    float rate1, rate2;
-    char *blob;
 
     wand = NewMagickWand();
     if (!wand) {
         bolt_log(BOLT_LOG_ERROR, "Failed to create Magick object");
-        goto failed;
+        return NULL;
+    }
+
+    /* Let JPEG decoder scale by 1/2, 1/4 or 1/8 (DCT scaling) but not */
+    /* smaller than hint size, then resize to the exact size later */
+
+    if (hint_width > 0 && hint_height > 0) {
+#ifdef __LIBGM__
+        MagickSetSize(wand, hint_width, hint_height);
+#else
+        char size[32];
+
+        snprintf(size, sizeof(size), "%dx%d", hint_width, hint_height);
+        MagickSetOption(wand, "jpeg:size", size);
+#endif
     }
 
     if (MagickReadImage(wand, path) == MagickFalse) {
         bolt_log(BOLT_LOG_ERROR, "Failed to read image from `%s'", path);
-        goto failed;
+        DestroyMagickWand(wand);
+        return NULL;
     }
 
     orig_width  = MagickGetImageWidth(wand);
@@ -259,6 +293,19 @@ bolt_worker_compress(
         }
     }
 
+    return wand;
+}
+
+/*
+ * Get output size of job, keep the aspect ratio of source image
+ */
+static void
+bolt_worker_output_size(bolt_job_t *job, int orig_width, int orig_height,
+    int *out_width, int *out_height)
+{
+    int width = job->width, height = job->height;
+    float rate1, rate2;
+
     if (width <= 0) {
         width = orig_width;
     }
@@ -276,13 +323,27 @@ bolt_worker_compress(
         width = (float)height * ((float)orig_width / (float)orig_height);
     }
 
+    *out_width = width > 0 ? width : 1;
+    *out_height = height > 0 ? height : 1;
+}
+
+/*
+ * Resize wand to width x height and encode it by job
+ */
+static char *
+bolt_worker_encode(MagickWand *wand, int width, int height,
+    bolt_job_t *job, size_t *size)
+{
+    char *format = job->format;
+    char *blob;
+
     if (MagickResizeImage(wand, width, height, CatromFilter) == MagickFalse) {
-        bolt_log(BOLT_LOG_ERROR, "Failed to resize image `%s'", path);
-        goto failed;
+        bolt_log(BOLT_LOG_ERROR, "Failed to resize image `%s'", job->path);
+        return NULL;
     }
 
-    if (MagickSetImageCompressionQuality(wand, quality) == MagickFalse) {
-        goto failed;
+    if (MagickSetImageCompressionQuality(wand, job->quality) == MagickFalse) {
+        return NULL;
     }
 
     if (bolt_format_support(format) == -1) {
@@ -291,42 +352,201 @@ bolt_worker_compress(
 
     if (MagickSetImageFormat(wand, format) == MagickFalse) {
         bolt_log(BOLT_LOG_ERROR,
-                 "Failed to set image to %s format `%s'", format, path);
-        goto failed;
+                 "Failed to set image to %s format `%s'", format, job->path);
+        return NULL;
     }
 
     if ((blob = MagickGetImageBlob(wand, size)) == NULL) {
-        bolt_log(BOLT_LOG_ERROR, "Failed to read image blob `%s'", path);
-        goto failed;
+        bolt_log(BOLT_LOG_ERROR, "Failed to read image blob `%s'", job->path);
+        return NULL;
     }
 
-    DestroyMagickWand(wand);
-
     return blob;
+}
+
+/*
+ * Decoded source cache, keep the decoded images for a while so the
+ * variants requested later need not decode the source again.
+ */
+static MagickWand *
+bolt_decode_cache_get(char *path, time_t mtime, int hint_width,
+    int hint_height)
+{
+    bolt_decode_entry_t *e;
+    MagickWand *wand = NULL;
+    int i;
+
+    if (setting->decode_cache <= 0) {
+        return NULL;
+    }
 
-failed:
+    pthread_mutex_lock(&bolt_decode_lock);
 
-    if (wand) DestroyMagickWand(wand);
+    for (i = 0; i < setting->decode_cache; i++) {
 
-    return NULL;
+        e = &bolt_decode_cache[i];
+
+        if (e->wand == NULL || strcmp(e->path, path) != 0) {
+            continue;
+        }
+
+        if (e->mtime != mtime
+            || e->time + setting->decode_cache_life < service->current_time)
+        {
+            DestroyMagickWand(e->wand); /* Expired or source changed */
+            e->wand = NULL;
+            break;
+        }
+
+        /* Decoded image was too small for this request */
+        if (e->hint_width > 0
+            && (hint_width <= 0
+                || e->hint_width < hint_width
+                || e->hint_height < hint_height))
+        {
+            break;
+        }
+
+        wand = CloneMagickWand(e->wand);
+        e->last = service->current_time;
+        break;
+    }
+
+    pthread_mutex_unlock(&bolt_decode_lock);
+
+    return wand;
+}
+
+static void
+bolt_decode_cache_put(char *path, time_t mtime, int hint_width,
+    int hint_height, MagickWand *wand)
+{
+    bolt_decode_entry_t *e, *victim = NULL;
+    MagickWand *clone;
+    int i;
+
+    if (setting->decode_cache <= 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&bolt_decode_lock);
+
+    for (i = 0; i < setting->decode_cache; i++) {
+
+        e = &bolt_decode_cache[i];
+
+        if (e->wand == NULL || !strcmp(e->path, path)) {
+            victim = e;
+            break;
+        }
+
+        if (victim == NULL || e->last < victim->last) { /* LRU */
+            victim = e;
+        }
+    }
+
+    clone = CloneMagickWand(wand);
+
+    if (clone) {
+        if (victim->wand) {
+            DestroyMagickWand(victim->wand);
+        }
+
+        victim->wand = clone;
+        victim->mtime = mtime;
+        victim->hint_width = hint_width;
+        victim->hint_height = hint_height;
+        victim->time = service->current_time;
+        victim->last = service->current_time;
+
+        strcpy(victim->path, path);
+    }
+
+    pthread_mutex_unlock(&bolt_decode_lock);
 }
 
 /*
- * Wakeup wait queue and send cache(locked) to client
+ * Push connections (linked by wakeup_next from first to last) to
+ * reactor's wakeup stack, only notify reactor when the stack was
+ * empty, otherwise a notification was pending already.
  */
-static void bolt_wakeup_cache_locked(char *queuename,
-    int namelen, bolt_cache_t *cache, int http_code)
+static void
+bolt_wakeup_reactor(bolt_reactor_t *r, bolt_connection_t *first,
+    bolt_connection_t *last)
 {
-    struct list_head *e;
+    bolt_connection_t *head;
+#if defined(BOLT_HAVE_EVENTFD)
+    uint64_t count = 1;
+#endif
+
+    do {
+        head = r->wakeup_stack;
+        last->wakeup_next = head;
+    } while (!__sync_bool_compare_and_swap(&r->wakeup_stack, head, first));
+
+    if (head == NULL) {
+#if defined(BOLT_HAVE_EVENTFD)
+        write(r->wakeup_notify[1], &count, sizeof(count));
+#else
+        write(r->wakeup_notify[1], "\0", 1);
+#endif
+    }
+}
+
+/*
+ * Wakeup connections linked by wakeup_next, every connection is
+ * routed back to the reactor which owns it. Chain connections by
+ * reactor, push each chain at once.
+ */
+static void
+bolt_wakeup_connections(bolt_connection_t *list)
+{
+    bolt_connection_t *first[BOLT_MAX_REACTORS] = {0};
+    bolt_connection_t *last[BOLT_MAX_REACTORS] = {0};
+    bolt_connection_t *c, *next;
+    bolt_reactor_t *r;
+    int i;
+
+    if (list == NULL) {
+        return;
+    }
+
+    for (c = list; c; c = next) {
+        next = c->wakeup_next;
+        r = c->reactor;
+
+        c->wakeup_next = first[r->id];
+        first[r->id] = c;
+
+        if (last[r->id] == NULL) {
+            last[r->id] = c;
+        }
+    }
+
+    for (i = 0; i < service->reactors_num; i++) {
+        if (first[i]) {
+            bolt_wakeup_reactor(&service->reactors[i], first[i], last[i]);
+        }
+    }
+}
+
+/*
+ * Wakeup wait queue and send cache to client, the caller must hold
+ * a reference of cache.
+ */
+static void bolt_wakeup_cache(char *queuename, int namelen,
+    uint64_t hashval, bolt_cache_t *cache, int http_code)
+{
+    struct list_head *e, *n;
     bolt_wait_queue_t *waitq;
-    bolt_connection_t *c;
+    bolt_connection_t *c, *list = NULL;
     int wakeup = 0;
     int retval;
 
     LOCK_WAITQUEUE();
 
-    retval = jk_hash_find(service->waiting_htb,
-                          queuename, namelen, (void **)&waitq);
+    retval = jk_hash_find_hash(service->waiting_htb, queuename, namelen,
+                               hashval, (void **)&waitq);
 
     if (retval == JK_HASH_OK) {
 
@@ -334,16 +554,17 @@ static void bolt_wakeup_cache_locked(char *queuename,
             c = list_entry(e, bolt_connection_t, link);
 
             c->http_code = http_code;
+            c->waitq = NULL; /* Owned by reactor's wakeup stack now */
 
             if (cache) {
-                cache->refcount++;
+                bolt_cache_incref(cache);
                 cache->last = service->current_time;
 
                 c->icache = cache;
             }
         }
 
-        jk_hash_remove(service->waiting_htb, queuename, namelen);
+        jk_hash_remove_hash(service->waiting_htb, queuename, namelen, hashval);
 
         wakeup = 1;
     }
@@ -352,289 +573,1188 @@ static void bolt_wakeup_cache_locked(char *queuename,
 
     if (wakeup) {
 
-        LOCK_WAKEUP();
-        list_add(&waitq->link, &service->wakeup_queue);
-        UNLOCK_WAKEUP();
+        list_for_each_safe(e, n, &waitq->wait_conns) {
+            c = list_entry(e, bolt_connection_t, link);
+
+            list_del(e);
+
+            c->wakeup_next = list;
+            list = c;
+        }
 
-        write(service->wakeup_notify[1], "\0", 1);
+        if (waitq->stream) {
+            bolt_stream_decref(waitq->stream);
+        }
+
+        free(waitq);
+
+        bolt_wakeup_connections(list);
     }
 }
 
-void *
-bolt_worker_process(void *arg)
+/*
+ * Reserve a place for task, the cost of one task was estimated by
+ * pixels of the output image. A single task bigger than max-cost
+ * is still admitted when nothing else is running.
+ */
+static int
+bolt_worker_admit_task(int cost)
 {
-    bolt_task_t       *tsk = NULL;
-    bolt_task_t       *bak = NULL;
-    bolt_job_t        *job = NULL;
-    struct list_head  *e;
-    char              *blob;
-    size_t             size;
-    bolt_cache_t      *cache, *ocache;
-    int                http_code;
-    int                retval;
+    int pending;
+    long long inflight;
 
-    for (;;) {
+    pending = __sync_add_and_fetch(&service->tasks_pending, 1);
+    inflight = __sync_add_and_fetch(&service->cost_pending, cost);
 
-        /* Get a task from queue */
+    if ((setting->max_tasks > 0 && pending > setting->max_tasks)
+        || (setting->max_cost > 0
+            && inflight > setting->max_cost && inflight != cost))
+    {
+        __sync_fetch_and_sub(&service->tasks_pending, 1);
+        __sync_fetch_and_sub(&service->cost_pending, cost);
+        return -1;
+    }
 
-        LOCK_TASK();
+    return 0;
+}
+
+static void
+bolt_worker_free_task(bolt_task_t *tsk)
+{
+    __sync_fetch_and_sub(&service->tasks_pending, 1);
+    __sync_fetch_and_sub(&service->cost_pending, tsk->cost);
 
-        while (list_empty(&service->task_queue)) {
-            pthread_cond_wait(&service->task_cond, &service->task_lock);
+    free(tsk);
+}
+
+/*
+ * Priority of task by schedule policy, bigger run first.
+ */
+static long long
+bolt_worker_task_priority(bolt_task_t *tsk)
+{
+    switch (setting->schedule) {
+    case BOLT_SCHEDULE_WAITERS:
+        return tsk->waitq ? tsk->waitq->waiters : 0; /* Just a hint */
+    case BOLT_SCHEDULE_SMALL_FIRST:
+        if (!tsk->job_valid) { /* Bad request, answer it quickly */
+            return 0;
         }
+        return -((long long)tsk->job.width * tsk->job.height);
+    }
 
-        e = service->task_queue.next;
+    return 0;
+}
 
-        tsk = list_entry(e, bolt_task_t, link);
+/*
+ * Take a task from queue (must hold the task lock), tasks were
+ * queued by arrival, so the first one with the highest priority
+ * is also the oldest one. Tasks which nobody waits for were run
+ * after all the others.
+ */
+static bolt_task_t *
+bolt_worker_pick_task(bolt_worker_t *w)
+{
+    struct list_head *e;
+    bolt_task_t *tsk, *best = NULL;
+    long long prio, best_prio = 0;
+    int live, best_live = 0;
 
-        list_del(e);
+    if (list_empty(&w->task_queue)) {
+        return NULL;
+    }
 
-        UNLOCK_TASK();
+    list_for_each(e, &w->task_queue) {
+        tsk = list_entry(e, bolt_task_t, link);
 
-        if (!tsk) continue;
+        /* Read without wait queue lock, just a hint */
+        live = !tsk->waitq || tsk->waitq->waiters > 0;
 
-        /* 1) Bad Request */
+        if (setting->schedule == BOLT_SCHEDULE_FIFO) {
+            if (best == NULL || live > best_live) {
+                best = tsk;
+                best_live = live;
+            }
 
-        if ((job = bolt_worker_get_job(tsk)) == NULL) {
-            http_code = 400;
-            bolt_log(BOLT_LOG_DEBUG,
-                     "Request file format was invaild `%s'", tsk->filename);
-            goto fatal;
+            if (live) {
+                break;
+            }
+
+            continue;
         }
 
-        /* 2) Not Found */
+        prio = bolt_worker_task_priority(tsk);
 
-        if (!bolt_file_exists(job->path)) {
-            http_code = 404;
-            bolt_log(BOLT_LOG_DEBUG,
-                     "Request file was not found `%s'", job->path);
-            goto fatal;
+        if (best == NULL || live > best_live
+            || (live == best_live && prio > best_prio))
+        {
+            best = tsk;
+            best_prio = prio;
+            best_live = live;
         }
+    }
 
-        /* 3) Internal Server Error */
-
-        blob = bolt_worker_compress(job->path,
-                                    job->quality,
-                                    job->width,
-                                    job->height,
-                                    job->format,
-                                    &size);
+    list_del(&best->link);
+    w->task_nums--;
 
-        if (!blob || !(cache = malloc(sizeof(*cache)))) {
+    return best;
+}
 
-            if (blob) free(blob);
+/*
+ * Steal a task from the other workers, the thief uses the same
+ * policy as the owner so the oldest tasks were not left behind.
+ */
+static bolt_task_t *
+bolt_worker_steal_task(bolt_worker_t *w)
+{
+    bolt_worker_t *v;
+    bolt_task_t *tsk = NULL;
+    int i;
 
-            http_code = 500;
+    for (i = 1; i < service->workers_num && !tsk; i++) {
 
-            if (!blob) {
-                bolt_log(BOLT_LOG_ERROR,
-                         "Failed to compress file `%s'", tsk->filename);
-            } else {
-                bolt_log(BOLT_LOG_ERROR,
-                         "Not enough memory from alloc cache struct");
-            }
+        v = &service->workers[(w->id + i) % service->workers_num];
 
-            goto fatal;
+        if (v->task_nums <= 0) { /* Read without lock, just a hint */
+            continue;
         }
 
-        cache->size = (int)size;
-        cache->cache = blob;
-        cache->refcount = 0;
-        cache->flags = CACHE_FLAG_INUSED;
-        cache->time = service->current_time;
-        cache->life_time = cache->time + setting->cache_life;
-        cache->fnlen = tsk->fnlen;
-
-        memcpy(cache->filename, tsk->filename, cache->fnlen);
+        LOCK_TASK(v);
 
-        bolt_format_time(cache->datetime, cache->time);
+        tsk = bolt_worker_pick_task(v);
 
-        /* Lock cache here */
-
-        LOCK_CACHE();
+        UNLOCK_TASK(v);
+    }
 
-        /* Try to get cache because the cache may be existsed (not often) */
+    return tsk;
+}
 
-        retval = jk_hash_find(service->cache_htb,
-                              tsk->filename, tsk->fnlen, (void **)&ocache);
+/*
+ * Get a task from worker's own queue, or steal from others
+ * when it's empty. Idle worker wakes up periodically to steal.
+ */
+static bolt_task_t *
+bolt_worker_get_task(bolt_worker_t *w)
+{
+    bolt_task_t *tsk;
+    struct timeval now;
+    struct timespec timeout;
 
-        if (retval == JK_HASH_OK) {
+    for (;;) {
 
-            bolt_wakeup_cache_locked(tsk->filename,
-                                     tsk->fnlen, ocache, 200);
+        LOCK_TASK(w);
 
-            UNLOCK_CACHE();
+        if ((tsk = bolt_worker_pick_task(w)) != NULL) {
+            w->busy = 1;
 
-            free(tsk);
-            free(job);
-            free(cache->cache);
-            free(cache);
+            UNLOCK_TASK(w);
 
-            continue;
+            return tsk;
         }
 
-        retval = jk_hash_insert(service->cache_htb,
-                                tsk->filename, tsk->fnlen,
-                                (void *)cache, 0);
+        w->busy = 0;
 
-        if (retval == JK_HASH_OK) {
+        UNLOCK_TASK(w);
 
-            /* Add LRU list */
-            list_add_tail(&cache->link, &service->gc_lru);
-
-            http_code = 200;
-
-            service->memory_usage += size;
+        if ((tsk = bolt_worker_steal_task(w)) != NULL) {
+            w->busy = 1;
+            return tsk;
+        }
 
-        } else {
-            free(cache->cache);
-            free(cache);
+        gettimeofday(&now, NULL);
 
-            cache = NULL;
-            http_code = 500;
+        timeout.tv_sec = now.tv_sec;
+        timeout.tv_nsec = (now.tv_usec + BOLT_WORKER_STEAL_INTERVAL * 1000)
+                        * 1000;
 
-            bolt_log(BOLT_LOG_ERROR, "Failed to add cache to hash table");
+        if (timeout.tv_nsec >= 1000000000) {
+            timeout.tv_sec++;
+            timeout.tv_nsec -= 1000000000;
         }
 
-        bolt_wakeup_cache_locked(tsk->filename,
-                                 tsk->fnlen, cache, http_code);
+        LOCK_TASK(w);
 
-        UNLOCK_CACHE();
-
-        free(tsk);
-        free(job);
+        if (list_empty(&w->task_queue)) {
+            w->idle = 1;
+            pthread_cond_timedwait(&w->task_cond, &w->task_lock, &timeout);
+            w->idle = 0;
+        }
 
-        continue;
+        UNLOCK_TASK(w);
+    }
+}
 
-fatal:
+/*
+ * Save compressed image to cache and wakeup the waiting clients,
+ * the blob was owned by cache after called.
+ */
+static void
+bolt_worker_finish_task(bolt_task_t *tsk, char *blob, size_t size,
+    int http_code)
+{
+    bolt_cache_shard_t *shard;
+    bolt_cache_t *cache = NULL, *ocache;
+    int retval;
 
-        bolt_wakeup_cache_locked(tsk->filename,
-                                 tsk->fnlen, NULL, http_code);
+    if (http_code != 200) {
+        goto wakeup;
+    }
 
-        if (job) free(job);
+    shard = bolt_cache_get_shard(tsk->hashval);
 
-        free(tsk);
+    cache = bolt_cache_new(shard, tsk->filename, tsk->fnlen,
+                           blob, (int)size, tsk->node);
+    if (cache == NULL) {
+        free(blob);
+        http_code = 500;
+        bolt_log(BOLT_LOG_ERROR,
+                 "Not enough memory from alloc cache struct");
+        goto wakeup;
     }
-}
 
-int
-bolt_worker_pass_task(bolt_connection_t *c)
-{
-    bolt_task_t *task;
+    cache->hashval = tsk->hashval;
+    cache->time = service->current_time;
 
-    task = (bolt_task_t *)malloc(sizeof(*task));
-    if (NULL == task) {
-        bolt_log(BOLT_LOG_ERROR, "Not enough memory to alloc task struct");
-        return -1;
+    /* Streamed clients would validate by the stream's time, the */
+    /* stream was opened by current worker so no lock here */
+    if (tsk->waitq && tsk->waitq->stream) {
+        cache->time = tsk->waitq->stream->time;
     }
 
-    memcpy(task->filename, c->filename, c->fnlen);
-    task->filename[c->fnlen] = 0;
-    task->fnlen = c->fnlen;
+    cache->life_time = cache->time + setting->cache_life;
+    cache->cost = tsk->cpu_cost;
 
-    LOCK_TASK();
+    /* Lock cache shard here */
 
-    list_add(&task->link, &service->task_queue);
+    LOCK_CACHE(shard);
 
-    pthread_cond_signal(&service->task_cond);
+    /* Try to get cache because the cache may be existsed (not often) */
 
-    UNLOCK_TASK();
+    retval = jk_hash_find_hash(shard->htb, tsk->filename, tsk->fnlen,
+                               tsk->hashval, (void **)&ocache);
 
-    return 0;
-}
+    if (retval == JK_HASH_OK) {
 
-void *
-bolt_gc_thread(void *arg)
-{
-    char byte;
-    int freesize, tofree;
-    struct list_head *e, *n;
-    bolt_cache_t *cache;
+        bolt_cache_incref(ocache); /* Pin it before unlock */
 
-    for (;;) {
+        UNLOCK_CACHE(shard);
 
-        if (read(service->gc_notify[0], (char *)&byte, 1) != 1) {
-            continue;
-        }
+        bolt_wakeup_cache(tsk->filename, tsk->fnlen,
+                          tsk->hashval, ocache, 200);
 
-        LOCK_CACHE();
+        bolt_cache_decref(ocache);
+        bolt_cache_decref(cache);
 
-        freesize = service->memory_usage
-                 - (setting->max_cache * setting->gc_threshold / 100);
+        bolt_worker_free_task(tsk);
 
-        tofree = freesize;
+        return;
+    }
 
-        list_for_each_safe(e, n, &service->gc_lru) {
+    retval = jk_hash_insert_hash(shard->htb, cache->filename, cache->fnlen,
+                                 tsk->hashval, (void *)cache, 0);
 
-            if (tofree <= 0) {
-                break;
-            }
+    if (retval == JK_HASH_OK) {
 
-            cache = list_entry(e, bolt_cache_t, link);
+        bolt_cache_incref(cache); /* Hash table's reference */
 
-            /* If this cache in used by client skip it */
-            if (cache->refcount > 0) {
-                continue;
-            }
+        bolt_cache_add_timer(shard, cache);
 
-            list_del(e); /* Remove from GC LRU queue */
+        /* Policy may evict others for it */
+        bolt_cache_policy->insert(shard, cache);
 
-            /* Remove from cache hash table */
-            jk_hash_remove(service->cache_htb, cache->filename, cache->fnlen);
+    } else {
+        http_code = 500;
 
-            service->memory_usage -= cache->size;
+        bolt_log(BOLT_LOG_ERROR, "Failed to add cache to hash table");
+    }
 
-            tofree -= cache->size;
+    UNLOCK_CACHE(shard);
 
-            free(cache->cache);
-            free(cache);
-        }
+wakeup:
 
-        UNLOCK_CACHE();
+    bolt_wakeup_cache(tsk->filename, tsk->fnlen, tsk->hashval,
+                      http_code == 200 ? cache : NULL, http_code);
 
-        bolt_log(BOLT_LOG_DEBUG, "Freed `%d' bytes by GC thread", freesize);
+    if (cache) {
+        bolt_cache_decref(cache); /* Release worker's reference */
     }
 
-    return NULL;
+    bolt_worker_free_task(tsk);
 }
 
-int
-bolt_init_workers(int num)
+/*
+ * Check task before running it. Drop it when all the clients were
+ * gone away (unless orphan-task is fill), and answer 503 when it
+ * was queued longer than task-timeout. Return 1 when the task was
+ * finished here.
+ */
+static int
+bolt_worker_cancel_task(bolt_task_t *tsk)
 {
-    int cnt;
-    pthread_t tid;
+    bolt_wait_queue_t *waitq = NULL;
+    uint64_t timeout;
 
-    MagickWandGenesis(); /* Init ImageMagick */
+    if (setting->orphan_task == BOLT_ORPHAN_DROP && tsk->waitq) {
 
-    if (setting->watermark_enable) {
+        LOCK_WAITQUEUE();
 
-        bolt_watermark_wand = NewMagickWand();
+        /* Nobody waits, remove the queue so new clients queue again */
+        if (tsk->waitq->waiters == 0) {
+            jk_hash_remove_hash(service->waiting_htb, tsk->filename,
+                                tsk->fnlen, tsk->hashval);
+            waitq = tsk->waitq;
+        }
 
-        if (bolt_watermark_wand) {
-            if (MagickReadImage(bolt_watermark_wand, setting->watermark)
-                == MagickFalse)
-            {
-                bolt_log(BOLT_LOG_ERROR,
-                         "Failed to get watermark from image file `%s'",
-                         setting->watermark);
-                return -1;
-            }
+        UNLOCK_WAITQUEUE();
 
-        } else {
-            bolt_log(BOLT_LOG_ERROR,
-                     "Failed to create ImageMagickWand object");
-            return -1;
-        }
+        if (waitq) {
+            bolt_log(BOLT_LOG_DEBUG,
+                     "Nobody waits for `%s', task was cancelled",
+                     tsk->filename);
 
-        bolt_watermark_width  = MagickGetImageWidth(bolt_watermark_wand);
-        bolt_watermark_height = MagickGetImageHeight(bolt_watermark_wand);
-    }
+            __sync_fetch_and_add(&service->stats.cancelled, 1);
+
+            free(waitq);
+            bolt_worker_free_task(tsk);
+
+            return 1;
+        }
+    }
+
+    timeout = (uint64_t)setting->task_timeout * 1000000;
+
+    if (timeout > 0 && bolt_usec_now() - tsk->enqueue_time > timeout) {
+        bolt_log(BOLT_LOG_DEBUG,
+                 "Task `%s' was queued too long, abandoned", tsk->filename);
+
+        __sync_fetch_and_add(&service->stats.expired, 1);
+
+        bolt_worker_finish_task(tsk, NULL, 0, 503);
+
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Take the queued tasks which share the same source image from
+ * all workers, so the source would be decoded once for them.
+ */
+static int
+bolt_worker_take_siblings(bolt_task_t *tsk, bolt_task_t **tasks, int max)
+{
+    struct list_head *e, *n;
+    bolt_worker_t *v;
+    bolt_task_t *t;
+    int i, nums = 0;
+
+    for (i = 0; i < service->workers_num && nums < max; i++) {
+
+        v = &service->workers[i];
+
+        if (v->task_nums <= 0) { /* Read without lock, just a hint */
+            continue;
+        }
+
+        LOCK_TASK(v);
+
+        list_for_each_safe(e, n, &v->task_queue) {
+
+            t = list_entry(e, bolt_task_t, link);
+
+            if (!t->job_valid
+                || t->srchash != tsk->srchash
+                || strcmp(t->job.path, tsk->job.path) != 0)
+            {
+                continue;
+            }
+
+            list_del(e);
+            v->task_nums--;
+
+            tasks[nums++] = t;
+
+            if (nums >= max) {
+                break;
+            }
+        }
+
+        UNLOCK_TASK(v);
+    }
+
+    return nums;
+}
+
+/*
+ * Decoding size hint is the largest requested size, watermark
+ * must be added to full size image, so disabled by watermark.
+ */
+static void
+bolt_worker_size_hint(bolt_task_t **tasks, int nums,
+    int *hint_width, int *hint_height)
+{
+    int i;
+
+    *hint_width = 0;
+    *hint_height = 0;
+
+    for (i = 0; i < nums && !setting->watermark_enable; i++) {
+        if (tasks[i]->job.width > *hint_width) {
+            *hint_width = tasks[i]->job.width;
+        }
+
+        if (tasks[i]->job.height > *hint_height) {
+            *hint_height = tasks[i]->job.height;
+        }
+    }
+}
+
+/*
+ * Sort variants from the largest one downward
+ */
+static void
+bolt_worker_sort_variants(bolt_task_t **tasks, int nums,
+    int orig_width, int orig_height, bolt_variant_t *variants)
+{
+    bolt_variant_t tmp;
+    int i, j;
+
+    for (i = 0; i < nums; i++) {
+        variants[i].task = tasks[i];
+
+        bolt_worker_output_size(&tasks[i]->job, orig_width, orig_height,
+                                &variants[i].width, &variants[i].height);
+
+        for (j = i; j > 0 && variants[j].width > variants[j-1].width; j--) {
+            tmp = variants[j];
+            variants[j] = variants[j-1];
+            variants[j-1] = tmp;
+        }
+    }
+}
+
+static int
+bolt_worker_native_format(char *format)
+{
+    if (!strcmp(format, "JPG") || !strcmp(format, "JPEG")) {
+        return setting->native_formats & BOLT_NATIVE_JPEG;
+    }
+
+#if defined(BOLT_HAVE_WEBP)
+    if (!strcmp(format, "WEBP")) {
+        return setting->native_formats & BOLT_NATIVE_WEBP;
+    }
+#endif
+
+    return 0;
+}
+
+/*
+ * Begin to stream the output of task, the waiting clients which
+ * support chunked encoding receive it while encoding, and the later
+ * ones would find the stream by wait queue.
+ */
+static bolt_stream_t *
+bolt_worker_open_stream(bolt_task_t *tsk)
+{
+    struct list_head *e, *n;
+    bolt_wait_queue_t *waitq;
+    bolt_connection_t *c, *list = NULL;
+    bolt_stream_t *stream;
+
+    if (!tsk->waitq || !(stream = bolt_stream_new())) {
+        return NULL;
+    }
+
+    stream->time = service->current_time;
+
+    bolt_format_time(stream->datetime, stream->time);
+
+    LOCK_WAITQUEUE();
+
+    waitq = tsk->waitq;
+
+    waitq->stream = stream;
+    bolt_stream_incref(stream); /* Wait queue's reference */
+
+    list_for_each_safe(e, n, &waitq->wait_conns) {
+        c = list_entry(e, bolt_connection_t, link);
+
+        if (!c->chunked) { /* Wait for the cache */
+            continue;
+        }
+
+        list_del(e);
+        waitq->waiters--;
+
+        c->waitq = NULL;
+        c->http_code = 200;
+        c->istream = stream;
+        bolt_stream_incref(stream);
+
+        c->wakeup_next = list;
+        list = c;
+    }
+
+    UNLOCK_WAITQUEUE();
+
+    bolt_wakeup_connections(list);
+
+    return stream;
+}
+
+static void
+bolt_worker_stream_write(void *arg, char *data, size_t size)
+{
+    bolt_wakeup_connections(bolt_stream_write(arg, data, size));
+}
+
+static void
+bolt_worker_close_stream(bolt_stream_t *stream, int success)
+{
+    bolt_wakeup_connections(bolt_stream_finish(stream, success));
+
+    bolt_stream_decref(stream); /* Worker's reference */
+}
+
+static char *
+bolt_worker_native_encode(bolt_task_t *tsk, bolt_image_t *img, size_t *size)
+{
+    bolt_stream_t *stream = NULL;
+    char *blob;
+
+#if defined(BOLT_HAVE_WEBP)
+    if (!strcmp(tsk->job.format, "WEBP")) {
+        return bolt_image_encode_webp(img, tsk->job.quality, size);
+    }
+#endif
+
+    /* Large output was sent while encoding */
+    if (setting->stream_pixels > 0
+        && (long long)img->width * img->height >= setting->stream_pixels)
+    {
+        stream = bolt_worker_open_stream(tsk);
+    }
+
+    blob = bolt_image_encode_jpeg(img, tsk->job.quality, size,
+                                  stream ? bolt_worker_stream_write : NULL,
+                                  stream);
+
+    if (stream) {
+        bolt_worker_close_stream(stream, blob != NULL);
+    }
+
+    return blob;
+}
+
+/*
+ * CPU time to generate one variant, the shared decoding was
+ * counted for every variant of the source.
+ */
+static int
+bolt_worker_cpu_cost(uint64_t start, uint64_t decode)
+{
+    uint64_t cost = decode + bolt_cpu_usec_now() - start;
+
+    return cost > 0x7fffffff ? 0x7fffffff : (int)cost;
+}
+
+/*
+ * Native encoders take RGB, JPEG takes grayscale too
+ */
+static int
+bolt_worker_native_channels(bolt_task_t **tasks, int nums, int channels)
+{
+    int i;
+
+    for (i = 0; i < nums; i++) {
+        if (channels != 3
+            && (channels != 1 || !strcmp(tasks[i]->job.format, "WEBP")))
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * Native pipeline, every variant was resized from the decoded source.
+ * Return -1 when the source can not be decoded (CMYK etc) or not be
+ * encoded by every format, the tasks should be done by MagickWand then.
+ */
+static int
+bolt_worker_native_variants(bolt_task_t **tasks, int nums, char *path)
+{
+    bolt_variant_t variants[BOLT_WORKER_MAX_VARIANTS];
+    bolt_image_t src, dst;
+    int hint_width, hint_height;
+    uint64_t start, decode;
+    char *blob;
+    size_t size;
+    int i;
+
+    bolt_worker_size_hint(tasks, nums, &hint_width, &hint_height);
+
+    start = bolt_cpu_usec_now();
+
+    if (bolt_image_decode_jpeg(path, hint_width, hint_height, &src) == -1) {
+        return -1;
+    }
+
+    if (!bolt_worker_native_channels(tasks, nums, src.channels)) {
+        bolt_image_free(&src);
+        return -1;
+    }
+
+    decode = bolt_cpu_usec_now() - start;
+
+    bolt_worker_sort_variants(tasks, nums, src.width, src.height, variants);
+
+    for (i = 0; i < nums; i++) {
+
+        start = bolt_cpu_usec_now();
+        blob = NULL;
+
+        if (bolt_image_resize(&src, &dst, variants[i].width,
+                              variants[i].height) == 0)
+        {
+            blob = bolt_worker_native_encode(variants[i].task, &dst, &size);
+
+            bolt_image_free(&dst);
+        }
+
+        if (!blob) {
+            bolt_log(BOLT_LOG_ERROR, "Failed to compress file `%s'",
+                     variants[i].task->filename);
+        }
+
+        /* Regenerating it alone would decode the source again */
+        variants[i].task->cpu_cost = bolt_worker_cpu_cost(start, decode);
+
+        bolt_worker_finish_task(variants[i].task, blob, size,
+                                blob ? 200 : 500);
+    }
+
+    bolt_image_free(&src);
+
+    return 0;
+}
+
+/*
+ * Share CPU budget among the tasks in flight. The thread limit of
+ * ImageMagick is process wide, so a lonely large job can use all of
+ * the budget, and every job runs single thread when queue is long.
+ */
+static void
+bolt_worker_magick_threads()
+{
+    int pending = service->tasks_pending;
+    int threads, old;
+
+    threads = setting->cpu_budget / (pending > 0 ? pending : 1);
+    if (threads < 1) {
+        threads = 1;
+    }
+
+    old = service->magick_threads;
+
+    if (threads != old
+        && __sync_bool_compare_and_swap(&service->magick_threads,
+                                        old, threads))
+    {
+        MagickSetResourceLimit(ThreadResource, threads);
+    }
+}
+
+/*
+ * MagickWand pipeline, every variant was resized from the smallest
+ * downscaled image which is not smaller than it.
+ */
+static void
+bolt_worker_magick_variants(bolt_task_t **tasks, int nums, char *path,
+    time_t mtime)
+{
+    bolt_variant_t variants[BOLT_WORKER_MAX_VARIANTS];
+    MagickWand *wand, *base, *v;
+    int orig_width, orig_height;
+    int hint_width, hint_height;
+    uint64_t start, decode;
+    char *blob;
+    size_t size;
+    int i;
+
+    bolt_worker_size_hint(tasks, nums, &hint_width, &hint_height);
+
+    bolt_worker_magick_threads();
+
+    start = bolt_cpu_usec_now();
+
+    wand = bolt_decode_cache_get(path, mtime, hint_width, hint_height);
+
+    if (wand == NULL
+        && (wand = bolt_worker_decode(path, hint_width,
+                                      hint_height)) != NULL)
+    {
+        bolt_decode_cache_put(path, mtime, hint_width, hint_height, wand);
+    }
+
+    if (wand == NULL) {
+        bolt_log(BOLT_LOG_ERROR, "Failed to decode file `%s'", path);
+
+        for (i = 0; i < nums; i++) {
+            bolt_worker_finish_task(tasks[i], NULL, 0, 500);
+        }
+        return;
+    }
+
+    decode = bolt_cpu_usec_now() - start;
+
+    orig_width  = MagickGetImageWidth(wand);
+    orig_height = MagickGetImageHeight(wand);
+
+    bolt_worker_sort_variants(tasks, nums, orig_width, orig_height, variants);
+
+    base = wand;
+
+    for (i = 0; i < nums; i++) {
+
+        start = bolt_cpu_usec_now();
+
+        v = (i == nums - 1) ? base : CloneMagickWand(base);
+        blob = NULL;
+
+        if (v) {
+            blob = bolt_worker_encode(v, variants[i].width,
+                                      variants[i].height,
+                                      &variants[i].task->job, &size);
+        }
+
+        if (!blob) {
+            bolt_log(BOLT_LOG_ERROR, "Failed to compress file `%s'",
+                     variants[i].task->filename);
+        }
+
+        variants[i].task->cpu_cost = bolt_worker_cpu_cost(start, decode);
+
+        bolt_worker_finish_task(variants[i].task, blob, size,
+                                blob ? 200 : 500);
+
+        if (v == NULL || v == base) {
+            continue;
+        }
+
+        if (blob
+            && variants[i].width <= orig_width
+            && variants[i].height <= orig_height)
+        {
+            DestroyMagickWand(base);
+            base = v;
+
+        } else {
+            DestroyMagickWand(v);
+        }
+    }
+
+    DestroyMagickWand(base);
+}
+
+void *
+bolt_worker_process(void *arg)
+{
+    bolt_worker_t *w = (bolt_worker_t *)arg;
+    bolt_task_t   *tsk, *tasks[BOLT_WORKER_MAX_VARIANTS];
+    struct stat    st;
+    char           path[BOLT_FILENAME_LENGTH];
+    int            nums, native, i, n;
+
+    for (;;) {
+
+        /* Get a task from queue */
+
+        tsk = bolt_worker_get_task(w);
+
+        bolt_stats_task_start(tsk->enqueue_time);
+
+        if (bolt_worker_cancel_task(tsk)) {
+            continue;
+        }
+
+        /* 1) Bad Request */
+
+        if (!tsk->job_valid) {
+            bolt_log(BOLT_LOG_DEBUG,
+                     "Request file format was invaild `%s'", tsk->filename);
+            bolt_worker_finish_task(tsk, NULL, 0, 400);
+            continue;
+        }
+
+        /* Coalesce the tasks of the same source image */
+
+        tasks[0] = tsk;
+        nums = 1 + bolt_worker_take_siblings(tsk, tasks + 1,
+                                             BOLT_WORKER_MAX_VARIANTS - 1);
+
+        for (i = 1, n = 1; i < nums; i++) {
+            bolt_stats_task_start(tasks[i]->enqueue_time);
+
+            if (!bolt_worker_cancel_task(tasks[i])) {
+                tasks[n++] = tasks[i];
+            }
+        }
+
+        nums = n;
+
+        /* The tasks were freed when finished, but the batch may */
+        /* go on with the others of this source */
+        strcpy(path, tsk->job.path);
+
+        /* 2) Not Found */
+
+        if (stat(path, &st) == -1) {
+            bolt_log(BOLT_LOG_DEBUG, "Request file was not found `%s'", path);
+
+            for (i = 0; i < nums; i++) {
+                bolt_worker_finish_task(tasks[i], NULL, 0, 404);
+            }
+            continue;
+        }
+
+        /* 3) Native pipeline for enabled formats, move them to front */
+
+        native = 0;
+
+        for (i = 0; i < nums && !setting->watermark_enable; i++) {
+            if (bolt_worker_native_format(tasks[i]->job.format)) {
+                tsk = tasks[native];
+                tasks[native++] = tasks[i];
+                tasks[i] = tsk;
+            }
+        }
+
+        if (native > 0
+            && bolt_worker_native_variants(tasks, native, path) == 0)
+        {
+            if (native == nums) {
+                continue;
+            }
+
+            memmove(tasks, tasks + native, (nums - native) * sizeof(tsk));
+            nums -= native;
+        }
+
+        /* 4) The others by MagickWand */
+
+        bolt_worker_magick_variants(tasks, nums, path, st.st_mtime);
+    }
+}
+
+/*
+ * Select the least loaded worker, begin from next one of
+ * last selected so the idle workers were used by turns.
+ */
+static bolt_worker_t *
+bolt_worker_select()
+{
+    static __thread unsigned int next = 0;
+    bolt_worker_t *w, *best = NULL;
+    int i, load, best_load = 0;
+
+    for (i = 0; i < service->workers_num; i++) {
+
+        w = &service->workers[(next + i) % service->workers_num];
+
+        load = w->task_nums + w->busy; /* Read without lock */
+
+        if (best == NULL || load < best_load) {
+            best = w;
+            best_load = load;
+
+            if (load == 0) {
+                break;
+            }
+        }
+    }
+
+    next = best->id + 1;
+
+    return best;
+}
+
+/*
+ * Worker's queue is bounded by worker-queue (must hold the task lock)
+ */
+static int
+bolt_worker_queue_full(bolt_worker_t *w)
+{
+    return setting->worker_queue > 0
+           && w->task_nums >= setting->worker_queue;
+}
+
+/*
+ * Pass task to worker, must hold the wait queue lock.
+ * Return BOLT_TASK_REJECTED when the workers were overload,
+ * or the queues of all workers were full.
+ */
+int
+bolt_worker_pass_task(bolt_connection_t *c, bolt_wait_queue_t *waitq)
+{
+    bolt_worker_t *w;
+    bolt_task_t *task;
+    bolt_job_t job;
+    int valid, i, cost = 0;
+
+    /* Parse job here, so scheduler and admission control can use it */
+    valid = bolt_worker_parse_job(c->buf->filename, c->fnlen, &job) == 0;
+
+    if (valid) {
+        long long pixels = (long long)job.width * job.height;
+
+        cost = pixels > 0x7fffffff ? 0x7fffffff : (int)pixels;
+    }
+
+    if (bolt_worker_admit_task(cost) == -1) {
+        bolt_log(BOLT_LOG_DEBUG,
+                 "Workers were overload, reject request `%s'",
+                 c->buf->filename);
+        return BOLT_TASK_REJECTED;
+    }
+
+    task = (bolt_task_t *)malloc(sizeof(*task));
+    if (NULL == task) {
+        __sync_fetch_and_sub(&service->tasks_pending, 1);
+        __sync_fetch_and_sub(&service->cost_pending, cost);
+        bolt_log(BOLT_LOG_ERROR, "Not enough memory to alloc task struct");
+        return -1;
+    }
+
+    memcpy(task->filename, c->buf->filename, c->fnlen);
+    task->filename[c->fnlen] = 0;
+    task->fnlen = c->fnlen;
+    task->hashval = c->hashval;
+    task->waitq = waitq;
+    task->enqueue_time = bolt_usec_now();
+    task->cost = cost;
+    task->node = c->reactor->node;
+    task->job_valid = valid;
+    task->cpu_cost = 0;
+
+    if (valid) {
+        memcpy(&task->job, &job, sizeof(job));
+        task->srchash = jk_hash_calc(job.path, strlen(job.path));
+    }
+
+    w = bolt_worker_select();
+
+    LOCK_TASK(w);
+
+    /* Queue was full, try the others before rejecting */
+    for (i = 1; bolt_worker_queue_full(w) && i < service->workers_num; i++) {
+        UNLOCK_TASK(w);
+        w = &service->workers[(w->id + 1) % service->workers_num];
+        LOCK_TASK(w);
+    }
+
+    if (bolt_worker_queue_full(w)) {
+        UNLOCK_TASK(w);
+
+        bolt_log(BOLT_LOG_DEBUG,
+                 "Task queues were full, reject request `%s'",
+                 task->filename);
+
+        bolt_worker_free_task(task);
+
+        return BOLT_TASK_REJECTED;
+    }
+
+    list_add_tail(&task->link, &w->task_queue); /* FIFO */
+
+    w->task_nums++;
+
+    if (w->idle) {
+        pthread_cond_signal(&w->task_cond);
+    }
+
+    UNLOCK_TASK(w);
+
+    return 0;
+}
+
+void *
+bolt_gc_thread(void *arg)
+{
+    char byte;
+    int freesize, tofree, keepsize;
+    bolt_cache_shard_t *shard;
+    bolt_cache_t *cache;
+    int i;
+
+    for (;;) {
+
+        if (read(service->gc_notify[0], (char *)&byte, 1) != 1) {
+            continue;
+        }
+
+        /* Every shard keeps the same part of cache */
+        keepsize = bolt_cache_shard_capacity();
+
+        freesize = 0;
+
+        for (i = 0; i < service->cache_shards_num; i++) {
+
+            shard = &service->cache_shards[i];
+
+            if (shard->memory_usage <= keepsize) {
+                continue;
+            }
+
+            LOCK_CACHE(shard);
+
+            tofree = shard->memory_usage - keepsize;
+
+            while (tofree > 0
+                   && (cache = bolt_cache_policy->victim(shard)) != NULL)
+            {
+                tofree -= cache->alloc;
+                freesize += cache->alloc;
+
+                bolt_cache_evict(shard, cache);
+            }
+
+            UNLOCK_CACHE(shard);
+        }
+
+        bolt_log(BOLT_LOG_DEBUG, "Freed `%d' bytes by GC thread", freesize);
+    }
+
+    return NULL;
+}
+
+/*
+ * Bolt owns the CPU budget, ImageMagick runs single thread at
+ * beginning and its memory was bounded by configure.
+ */
+static void
+bolt_worker_magick_limits()
+{
+    if (setting->cpu_budget <= 0) {
+        setting->cpu_budget = sysconf(_SC_NPROCESSORS_ONLN);
+        if (setting->cpu_budget <= 0) {
+            setting->cpu_budget = 1;
+        }
+    }
+
+    if (setting->workers > setting->cpu_budget) {
+        bolt_log(BOLT_LOG_NOTICE,
+                 "Workers (%d) were more than CPU budget (%d)",
+                 setting->workers, setting->cpu_budget);
+    }
+
+    service->magick_threads = 1;
+
+    MagickSetResourceLimit(ThreadResource, 1);
+
+    if (setting->magick_memory > 0) {
+        MagickSetResourceLimit(MemoryResource, setting->magick_memory);
+    }
+
+    if (setting->magick_map > 0) {
+        MagickSetResourceLimit(MapResource, setting->magick_map);
+    }
+
+    if (setting->magick_area > 0) {
+        MagickSetResourceLimit(AreaResource, setting->magick_area);
+    }
+}
+
+int
+bolt_init_workers(int num)
+{
+    bolt_worker_t *w;
+    int cnt;
+    pthread_t tid;
+
+    MagickWandGenesis(); /* Init ImageMagick */
+
+    bolt_worker_magick_limits();
+
+    if (setting->watermark_enable) {
+
+        bolt_watermark_wand = NewMagickWand();
+
+        if (bolt_watermark_wand) {
+            if (MagickReadImage(bolt_watermark_wand, setting->watermark)
+                == MagickFalse)
+            {
+                bolt_log(BOLT_LOG_ERROR,
+                         "Failed to get watermark from image file `%s'",
+                         setting->watermark);
+                return -1;
+            }
+
+        } else {
+            bolt_log(BOLT_LOG_ERROR,
+                     "Failed to create ImageMagickWand object");
+            return -1;
+        }
+
+        bolt_watermark_width  = MagickGetImageWidth(bolt_watermark_wand);
+        bolt_watermark_height = MagickGetImageHeight(bolt_watermark_wand);
+    }
+
+    if (setting->decode_cache > 0) {
+        bolt_decode_cache = calloc(setting->decode_cache,
+                                   sizeof(bolt_decode_entry_t));
+        if (bolt_decode_cache == NULL) {
+            bolt_log(BOLT_LOG_ERROR,
+                     "Not enough memory to alloc decoded source cache");
+            return -1;
+        }
+    }
+
+    service->workers = calloc(num, sizeof(bolt_worker_t));
+    if (service->workers == NULL) {
+        bolt_log(BOLT_LOG_ERROR, "Not enough memory to alloc workers");
+        return -1;
+    }
+
+    service->workers_num = num;
 
     for (cnt = 0; cnt < num; cnt++) {
-        if (pthread_create(&tid, NULL, bolt_worker_process, NULL) == -1) {
+
+        w = &service->workers[cnt];
+
+        w->id = cnt;
+        w->cpu = -1;
+        w->node = -1;
+
+        if (pthread_mutex_init(&w->task_lock, NULL) == -1
+            || pthread_cond_init(&w->task_cond, NULL) == -1)
+        {
+            bolt_log(BOLT_LOG_ERROR,
+                     "Failed to initialize worker's lock and condition");
+            return -1;
+        }
+
+        INIT_LIST_HEAD(&w->task_queue);
+    }
+
+    for (cnt = 0; cnt < num; cnt++) {
+
+        w = &service->workers[cnt];
+
+        if (pthread_create(&w->tid, NULL, bolt_worker_process, w) != 0) {
             bolt_log(BOLT_LOG_ERROR, "Failed to create worker thread");
             return -1;
         }
+
+        if (setting->worker_cpus_num > 0) {
+            w->cpu = setting->worker_cpus[cnt % setting->worker_cpus_num];
+            w->node = bolt_numa_node_of_cpu(w->cpu);
+
+            bolt_set_affinity(w->tid, w->cpu);
+        }
     }
 
     if (pthread_create(&tid, NULL, bolt_gc_thread, NULL) == -1) {
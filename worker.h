@@ -1,7 +1,9 @@
 #ifndef __BOLT_WORKER_H
 #define __BOLT_WORKER_H
 
+#define BOLT_TASK_REJECTED  1  /* Task was rejected by admission control */
+
 int bolt_init_workers(int num);
-int bolt_worker_pass_task(bolt_connection_t *c);
+int bolt_worker_pass_task(bolt_connection_t *c, bolt_wait_queue_t *waitq);
 
 #endif